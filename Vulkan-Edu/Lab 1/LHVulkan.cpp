@@ -124,7 +124,8 @@ VkResult createInstance(struct LHContext& context, std::string appName, std::str
 	app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 	app_info.pEngineName = engineName.c_str();
 	app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	app_info.apiVersion = VK_API_VERSION_1_0;
+	// Timeline semaphores are core in Vulkan 1.2
+	app_info.apiVersion = VK_API_VERSION_1_2;
 
 	VkInstanceCreateInfo inst_info = {};
 	inst_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -183,6 +184,8 @@ VkResult createDeviceInfo(struct LHContext& context, bool selectGPU) {
 	vkGetPhysicalDeviceProperties(context.physicalDevice, &context.deviceProperties);
 	vkGetPhysicalDeviceFeatures(context.physicalDevice, &context.deviceFeatures);
 	vkGetPhysicalDeviceMemoryProperties(context.physicalDevice, &context.deviceMemoryProperties);
+	// Shaders are compiled against what this GPU can actually do
+	init_resources(context.shaderResources, context.deviceProperties.limits);
 
 	vkGetPhysicalDeviceQueueFamilyProperties(context.gpus[context.selectedGPU], &context.queue_family_count, NULL);
 	assert(context.queue_family_count >= 1);
@@ -205,14 +208,22 @@ VkResult createDeviceInfo(struct LHContext& context, bool selectGPU) {
 
 }
 
+static void framebufferResizeCallback(GLFWwindow* window, int width, int height);
+static void windowRefreshCallback(GLFWwindow* window);
+
 void createWindowContext(struct LHContext& context, int w, int h) {
 
 	context.width = w;
 	context.height = h;
+	context.framebufferWidth = w;
+	context.framebufferHeight = h;
 
 	glfwDefaultWindowHints();
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
 	context.window = glfwCreateWindow(w, h, context.name.c_str(), NULL, NULL);
+	glfwSetWindowUserPointer(context.window, &context);
+	glfwSetFramebufferSizeCallback(context.window, framebufferResizeCallback);
+	glfwSetWindowRefreshCallback(context.window, windowRefreshCallback);
 
 	if (glfwCreateWindowSurface(context.instance, context.window, nullptr, &context.surface) != VK_SUCCESS) {
 		throw std::runtime_error("failed to create window surface!");
@@ -339,8 +350,93 @@ VkResult createDevice(struct LHContext& context) {
 		: NULL;
 	device_info.pEnabledFeatures = NULL;
 
+	// All queue submissions are tracked on one timeline semaphore instead of per-object fences
+	VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = {};
+	timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+	VkPhysicalDeviceFeatures2 features = {};
+	features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	features.pNext = &timelineFeatures;
+
+	// Pipelines are linked from separately compiled parts where the device has VK_EXT_graphics_pipeline_library
+	uint32_t extensionCount = 0;
+	vkEnumerateDeviceExtensionProperties(context.gpus[context.selectedGPU], NULL, &extensionCount, NULL);
+	std::vector<VkExtensionProperties> extensions(extensionCount);
+	vkEnumerateDeviceExtensionProperties(context.gpus[context.selectedGPU], NULL, &extensionCount, extensions.data());
+	uint32_t libraryExtensions = 0;
+	bool timelineExtension = false;
+	for (auto& extension : extensions) {
+		if (strcmp(extension.extensionName, VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0) {
+			timelineExtension = true;
+		}
+		if (strcmp(extension.extensionName, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME) == 0 ||
+			strcmp(extension.extensionName, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME) == 0) {
+			libraryExtensions++;
+		}
+	}
+	VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT libraryFeatures = {};
+	libraryFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT;
+	if (libraryExtensions == 2) {
+		timelineFeatures.pNext = &libraryFeatures;
+	}
+
+	vkGetPhysicalDeviceFeatures2(context.gpus[context.selectedGPU], &features);
+	// Vulkan 1.1 devices get timeline semaphores from VK_KHR_timeline_semaphore
+	bool timelineCore = context.deviceProperties.apiVersion >= VK_API_VERSION_1_2;
+	if ((!timelineCore && !timelineExtension) || !timelineFeatures.timelineSemaphore) {
+		std::cout << "Timeline semaphores are not supported by " << context.deviceProperties.deviceName << std::endl;
+		exit(-1);
+	}
+	if (!timelineCore) {
+		context.device_extension_names.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+		device_info.enabledExtensionCount = context.device_extension_names.size();
+		device_info.ppEnabledExtensionNames = context.device_extension_names.data();
+	}
+	device_info.pNext = &timelineFeatures;
+
+	context.pipelineLibrary = libraryFeatures.graphicsPipelineLibrary == VK_TRUE;
+	if (context.pipelineLibrary) {
+		VkPhysicalDeviceGraphicsPipelineLibraryPropertiesEXT libraryProperties = {};
+		libraryProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_PROPERTIES_EXT;
+		VkPhysicalDeviceProperties2 properties = {};
+		properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+		properties.pNext = &libraryProperties;
+		vkGetPhysicalDeviceProperties2(context.gpus[context.selectedGPU], &properties);
+		context.pipelineLibraryFastLinking = libraryProperties.graphicsPipelineLibraryFastLinking == VK_TRUE;
+
+		context.device_extension_names.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+		context.device_extension_names.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+		device_info.enabledExtensionCount = context.device_extension_names.size();
+		device_info.ppEnabledExtensionNames = context.device_extension_names.data();
+		std::cout << "Graphics pipeline library: enabled" << (context.pipelineLibraryFastLinking ? ", fast linking" : "") << std::endl;
+	}
+	else {
+		timelineFeatures.pNext = nullptr;
+	}
+
 	res = vkCreateDevice(context.gpus[context.selectedGPU], &device_info, NULL, &context.device);
 	assert(res == VK_SUCCESS);
+
+	context.fpWaitSemaphores = (PFN_vkWaitSemaphores)vkGetDeviceProcAddr(context.device,
+		timelineCore ? "vkWaitSemaphores" : "vkWaitSemaphoresKHR");
+	context.fpGetSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValue)vkGetDeviceProcAddr(context.device,
+		timelineCore ? "vkGetSemaphoreCounterValue" : "vkGetSemaphoreCounterValueKHR");
+	if (context.fpWaitSemaphores == NULL || context.fpGetSemaphoreCounterValue == NULL) {
+		std::cout << "vkGetDeviceProcAddr failed to find the timeline semaphore entry points" << std::endl;
+		exit(-1);
+	}
+
+	VkSemaphoreTypeCreateInfo timelineInfo = {};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	timelineInfo.initialValue = 0;
+	VkSemaphoreCreateInfo semaphoreCreateInfo = {};
+	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreCreateInfo.pNext = &timelineInfo;
+	res = vkCreateSemaphore(context.device, &semaphoreCreateInfo, nullptr, &context.timeline);
+	assert(res == VK_SUCCESS);
+	context.timelineValue = 0;
+
+	createMemoryAllocator(context);
 	return res;
 }
 
@@ -357,28 +453,8 @@ void createDeviceQueue(struct LHContext& context) {
 VkResult createSynchObject(struct LHContext& context) {
 	VkResult res;
 
-
-	// Create synchronization objects
-	VkSemaphoreCreateInfo semaphoreCreateInfo = {};
-	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	// Create a semaphore used to synchronize image presentation
-	// Ensures that the image is displayed before we start submitting new commands to the queu
-	res = vkCreateSemaphore(context.device, &semaphoreCreateInfo, nullptr, &context.semaphores.presentComplete);
-	// Create a semaphore used to synchronize command submission
-	// Ensures that the image is not presented until all commands have been sumbitted and executed
-	res = vkCreateSemaphore(context.device, &semaphoreCreateInfo, nullptr, &context.semaphores.renderComplete);
-
-	// Set up submit info structure
-	// Semaphores will stay the same during application lifetime
-	// Command buffer submission info is set by each example
-	context.submitInfo = {};
-	context.submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	context.submitInfo.pWaitDstStageMask = &context.submitPipelineStages;
-	context.submitInfo.waitSemaphoreCount = 1;
-	context.submitInfo.pWaitSemaphores = &context.semaphores.presentComplete;
-	context.submitInfo.signalSemaphoreCount = 1;
-	context.submitInfo.pSignalSemaphores = &context.semaphores.renderComplete;
-
+	// Create the per-frame synchronization objects, semaphores and command pools are owned by the
+	// frames in flight rather than shared by every submission
 	res = prepareSynchronizationPrimitives(context);
 
 	return res;
@@ -424,19 +500,30 @@ VkResult createSwapChain(struct LHContext& context) {
 	else {
 		swapchainExtent = surfCapabilities.currentExtent;
 	}
+	// Frame buffers and the depth buffer are created at the size the surface actually has
+	context.width = swapchainExtent.width;
+	context.height = swapchainExtent.height;
 
+	// FIFO is the only present mode that is always supported, vsync and power saver use it
 	VkPresentModeKHR swapchainPresentMode = VK_PRESENT_MODE_FIFO_KHR;
-	for (int i = 0; i < presentModeCount; i++) {
-		if (presentModes[i] == VK_PRESENT_MODE_MAILBOX_KHR) {
-			swapchainPresentMode = VK_PRESENT_MODE_MAILBOX_KHR;
-			break;
-		}
-		if ((swapchainPresentMode != VK_PRESENT_MODE_MAILBOX_KHR) && (presentModes[i] == VK_PRESENT_MODE_IMMEDIATE_KHR)) {
-			swapchainPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+	if (context.presentPolicy == LH_PRESENT_LOW_LATENCY) {
+		for (int i = 0; i < presentModeCount; i++) {
+			if (presentModes[i] == VK_PRESENT_MODE_MAILBOX_KHR) {
+				swapchainPresentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+				break;
+			}
+			if ((swapchainPresentMode != VK_PRESENT_MODE_MAILBOX_KHR) && (presentModes[i] == VK_PRESENT_MODE_IMMEDIATE_KHR)) {
+				swapchainPresentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+			}
 		}
 	}
+	context.presentMode = swapchainPresentMode;
 
+	// One spare image lets the CPU work ahead of the display, the power saver keeps the minimum
 	uint32_t desiredNumberOfSwapChainImages = surfCapabilities.minImageCount + 1;
+	if (context.presentPolicy == LH_PRESENT_POWER_SAVER) {
+		desiredNumberOfSwapChainImages = surfCapabilities.minImageCount;
+	}
 	if ((surfCapabilities.maxImageCount > 0) && (desiredNumberOfSwapChainImages > surfCapabilities.maxImageCount)) {
 		desiredNumberOfSwapChainImages = surfCapabilities.maxImageCount;
 	}
@@ -564,21 +651,51 @@ VkResult createCommandBuffer(struct LHContext& context) {
 }
 
 VkResult createSynchPrimitive(struct LHContext& context) {
-	VkResult U_ASSERT_ONLY res;
+	VkResult U_ASSERT_ONLY res = VK_SUCCESS;
 
-	// Wait fences to sync command buffer access
-	VkFenceCreateInfo fenceCreateInfo = {};
-	fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-	context.waitFences.resize(context.cmdBuffer.size());
+	// No frame has rendered to any image yet
+	context.imageTimelineValues.assign(context.swapchainImageCount, 0);
 
-	for (auto& fence : context.waitFences) {
-		res = vkCreateFence(context.device, &fenceCreateInfo, nullptr, &fence);
+	// Per swap chain image primitives, these follow the image rather than the frame. Waiting for the device does
+	// not cover a present still waiting on them, so the same number of images keeps the semaphores it has
+	if (context.renderComplete.size() == context.swapchainImageCount) {
+		return res;
+	}
+	if (!context.renderComplete.empty()) {
+		LHRetiredSemaphores retired;
+		retired.semaphores.swap(context.renderComplete);
+		retired.acquired.assign(context.swapchainImageCount, false);
+		context.retiredSemaphores.push_back(retired);
+	}
+
+	VkSemaphoreCreateInfo semaphoreCreateInfo = {};
+	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreCreateInfo.pNext = nullptr;
+
+	// Present waits on this semaphore, it is only safe to signal again once the image has been re-acquired
+	context.renderComplete.resize(context.swapchainImageCount);
+	for (auto& semaphore : context.renderComplete) {
+		res = vkCreateSemaphore(context.device, &semaphoreCreateInfo, nullptr, &semaphore);
 		assert(res == VK_SUCCESS);
 	}
 	return res;
 }
 
+// Once an image of the new swap chain has been acquired, nothing presented before the recreation waits any more
+static void releaseRetiredSemaphores(struct LHContext& context, uint32_t image) {
+	for (auto retired = context.retiredSemaphores.begin(); retired != context.retiredSemaphores.end();) {
+		retired->acquired[image] = true;
+		if (std::find(retired->acquired.begin(), retired->acquired.end(), false) != retired->acquired.end()) {
+			++retired;
+			continue;
+		}
+		for (auto semaphore : retired->semaphores) {
+			vkDestroySemaphore(context.device, semaphore, nullptr);
+		}
+		retired = context.retiredSemaphores.erase(retired);
+	}
+}
+
 VkResult createDepthBuffers(struct LHContext& context) {
 	VkResult U_ASSERT_ONLY res;
 	bool U_ASSERT_ONLY pass;
@@ -625,21 +742,11 @@ VkResult createDepthBuffers(struct LHContext& context) {
 
 	res = vkCreateImage(context.device, &image_info, nullptr, &context.depth.image);
 	assert(res == VK_SUCCESS);
-	VkMemoryRequirements memReqs{};
-	vkGetImageMemoryRequirements(context.device, context.depth.image, &memReqs);
 
-	VkMemoryAllocateInfo memAllloc{};
-
-	memAllloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	memAllloc.allocationSize = memReqs.size;
-
-	pass = memory_type_from_properties(context, memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memAllloc.memoryTypeIndex);
-	assert(pass);
-
-	res = vkAllocateMemory(context.device, &memAllloc, NULL, &context.depth.mem);
-	assert(res == VK_SUCCESS);
-	res = vkBindImageMemory(context.device, context.depth.image, context.depth.mem, 0);
+	LHAllocation allocation;
+	res = allocateImageMemory(context, context.depth.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, allocation, false, image_info.tiling);
 	assert(res == VK_SUCCESS);
+	context.depth.mem = allocation.memory;
 
 	VkImageViewCreateInfo view_info = {};
 	view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -666,7 +773,7 @@ VkResult createDepthBuffers(struct LHContext& context) {
 	view_info.image = context.depth.image;
 	res = vkCreateImageView(context.device, &view_info, NULL, &context.depth.view);
 	assert(res == VK_SUCCESS);
-
+	return res;
 }
 
 VkResult createRenderPass(struct LHContext& context, bool includeDepth) {
@@ -745,17 +852,32 @@ VkResult createRenderPass(struct LHContext& context, bool includeDepth) {
 
 }
 
-void createPipeLineCache(struct LHContext& context) {
+static bool loadPipelineCacheData(struct LHContext& context, std::vector<char>& data);
+
+void createPipeLineCache(struct LHContext &context) {
 	VkResult U_ASSERT_ONLY res;
 
+	// Starts from what the last run saved for this GPU and driver, if anything
+	std::vector<char> data;
+	bool warm = loadPipelineCacheData(context, data);
+
 	VkPipelineCacheCreateInfo pipelineCache;
 	pipelineCache.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
 	pipelineCache.pNext = NULL;
-	pipelineCache.initialDataSize = 0;
-	pipelineCache.pInitialData = NULL;
+	pipelineCache.initialDataSize = warm ? data.size() : 0;
+	pipelineCache.pInitialData = warm ? data.data() : NULL;
 	pipelineCache.flags = 0;
-	res = vkCreatePipelineCache(context.device, &pipelineCache, NULL, &context.pipelineCache);
+	res = vkCreatePipelineCache(context.device, &pipelineCache, NULL,&context.pipelineCache);
+	if (res != VK_SUCCESS && warm) {
+		// The driver turned the data down after all
+		warm = false;
+		pipelineCache.initialDataSize = 0;
+		pipelineCache.pInitialData = NULL;
+		res = vkCreatePipelineCache(context.device, &pipelineCache, NULL, &context.pipelineCache);
+	}
 	assert(res == VK_SUCCESS);
+	context.pipelineCacheStats.warm = warm;
+	context.pipelineCacheStats.loadedBytes = warm ? data.size() : 0;
 }
 
 VkResult createFrameBuffer(struct LHContext& context, bool includeDepth) {
@@ -769,6 +891,7 @@ VkResult createFrameBuffer(struct LHContext& context, bool includeDepth) {
 	fb_info.pNext = NULL;
 	fb_info.renderPass = context.render_pass;
 	fb_info.attachmentCount = includeDepth ? 2 : 1;
+	context.includeDepth = includeDepth;
 	fb_info.pAttachments = attachments;
 	fb_info.width = context.width;
 	fb_info.height = context.height;
@@ -786,15 +909,14 @@ VkResult createFrameBuffer(struct LHContext& context, bool includeDepth) {
 }
 
 VkResult mapVerticiesToGPU(struct LHContext& context, const void* vertexInput, uint32_t dataSize,
-	VkBuffer& vertexBuffer, VkDeviceMemory& memory) {
+	VkBuffer& vertexBuffer, VkDeviceMemory& memory, bool useStagingBuffers) {
 
 	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
 
-	VkMemoryAllocateInfo memAlloc = {};
-	memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	VkMemoryRequirements memReqs;
-	void* data;
+	// DEVICE_LOCAL buffer filled by a transfer instead of a host visible one read over the bus every frame
+	if (useStagingBuffers) {
+		return uploadBufferThroughStaging(context, vertexInput, dataSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, vertexBuffer, memory);
+	}
 
 	// Vertex buffer
 	VkBufferCreateInfo vertexBufferInfo = {};
@@ -805,34 +927,25 @@ VkResult mapVerticiesToGPU(struct LHContext& context, const void* vertexInput, u
 	// Copy vertex data to a buffer visible to the host
 	res = (vkCreateBuffer(context.device, &vertexBufferInfo, nullptr, &vertexBuffer));
 	assert(res == VK_SUCCESS);
-	vkGetBufferMemoryRequirements(context.device, vertexBuffer, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
 
-	pass = memory_type_from_properties(context, memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &memAlloc.memoryTypeIndex);
-	assert(pass && "No mappable coherent memory");
-
-	res = (vkAllocateMemory(context.device, &memAlloc, nullptr, &memory));
-	assert(res == VK_SUCCESS);
-	res = (vkMapMemory(context.device, memory, 0, memAlloc.allocationSize, 0, &data));
-	assert(res == VK_SUCCESS);
-	memcpy(data, vertexInput, dataSize);
-	vkUnmapMemory(context.device, memory);
-	res = (vkBindBufferMemory(context.device, vertexBuffer, memory, 0));
+	// The buffer is placed in a shared, persistently mapped block so no map/unmap is needed
+	LHAllocation allocation;
+	res = allocateBufferMemory(context, vertexBuffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, allocation);
 	assert(res == VK_SUCCESS);
+	memcpy(allocation.mapped, vertexInput, dataSize);
+	memory = allocation.memory;
 
-	return res;;
+	return res;
 }
 
 VkResult mapIndiciesToGPU(struct LHContext& context, const void* indiciesInput, uint32_t dataSize,
-	VkBuffer& indexBuffer, VkDeviceMemory& memory) {
+	VkBuffer& indexBuffer, VkDeviceMemory& memory, bool useStagingBuffers) {
 
 	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
 
-	VkMemoryAllocateInfo memAlloc = {};
-	memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	VkMemoryRequirements memReqs;
-	void* data;
+	if (useStagingBuffers) {
+		return uploadBufferThroughStaging(context, indiciesInput, dataSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, indexBuffer, memory);
+	}
 
 	// Index buffer
 	VkBufferCreateInfo indexbufferInfo = {};
@@ -843,60 +956,106 @@ VkResult mapIndiciesToGPU(struct LHContext& context, const void* indiciesInput,
 	// Copy index data to a buffer visible to the host
 	res = (vkCreateBuffer(context.device, &indexbufferInfo, nullptr, &indexBuffer));
 	assert(res == VK_SUCCESS);
-	vkGetBufferMemoryRequirements(context.device, indexBuffer, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
-	pass = memory_type_from_properties(context, memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &memAlloc.memoryTypeIndex);
-	assert(pass && "No mappable coherent memory");
-	res = (vkAllocateMemory(context.device, &memAlloc, nullptr, &memory));
-	assert(res == VK_SUCCESS);
-	res = (vkMapMemory(context.device, memory, 0, dataSize, 0, &data));
-	assert(res == VK_SUCCESS);
-	memcpy(data, indiciesInput, dataSize);
-	vkUnmapMemory(context.device, memory);
-	res = (vkBindBufferMemory(context.device, indexBuffer, memory, 0));
+
+	LHAllocation allocation;
+	res = allocateBufferMemory(context, indexBuffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, allocation);
 	assert(res == VK_SUCCESS);
+	memcpy(allocation.mapped, indiciesInput, dataSize);
+	memory = allocation.memory;
 	return res;
 }
 
 VkResult prepareSynchronizationPrimitives(struct LHContext& context) {
 	VkResult U_ASSERT_ONLY res;
 
-	// Semaphores (Used for correct command ordering)
-	VkSemaphoreCreateInfo semaphoreCreateInfo = {};
-	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	semaphoreCreateInfo.pNext = nullptr;
-
-	// Semaphore used to ensures that image presentation is complete before starting to submit again
-	res = (vkCreateSemaphore(context.device, &semaphoreCreateInfo, nullptr, &context.semaphores.presentComplete));
+	// Command pool and image acquired semaphore for each frame in flight, completion is tracked on the timeline
+	res = createFrames(context, context.framesInFlight);
 	assert(res == VK_SUCCESS);
-	// Semaphore used to ensures that all commands submitted have been finished before submitting the image to the queue
-	res = (vkCreateSemaphore(context.device, &semaphoreCreateInfo, nullptr, &context.semaphores.renderComplete));
-	assert(res == VK_SUCCESS);
-
-	// Fences (Used to check draw command buffer completion)
-	VkFenceCreateInfo fenceCreateInfo = {};
-	fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	// Create in signaled state so we don't wait on first render of each command buffer
-	fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-	context.waitFences.resize(context.cmdBuffer.size());
-	for (auto& fence : context.waitFences) {
-		res = (vkCreateFence(context.device, &fenceCreateInfo, nullptr, &fence));
-		assert(res == VK_SUCCESS);
-	}
 
 	return res;
 }
 
 void draw(struct LHContext& context) {
+	acquireFrame(context);
+	submitFrame(context);
+}
+
+static void collectFinishedFrames(struct LHContext& context);
+
+// Once this returns the submission that last used context.currentBuffer has finished,
+// so per-image data (e.g. its uniform ring region) can be written before submitFrame()
+void acquireFrame(struct LHContext& context) {
 	VkResult U_ASSERT_ONLY res;
+	LHFrame& frame = context.frames[context.currentFrame];
+	LHFrameStats& stats = context.frameStats;
+
+	// Input is polled right before acquiring, the latency of this frame counts from here
+	auto start = std::chrono::high_resolution_clock::now();
+	frame.inputTime = start;
+	if (stats.frames > 0) {
+		double frameMs = std::chrono::duration<double, std::milli>(start - stats.lastFrame).count();
+		stats.frameMs += frameMs;
+		stats.frameMsSq += frameMs * frameMs;
+	}
+	stats.lastFrame = start;
+	stats.frames++;
+
+	// Frames submitted and not yet finished on the GPU
+	collectFinishedFrames(context);
+	for (auto& queued : context.frames) {
+		stats.queueDepth += queued.pending ? 1 : 0;
+	}
+
+	// Latency limiter, frame N waits for frame N - maxFrameLatency. Limits at or above framesInFlight are
+	// already covered by the wait on this frame's own submission below
+	if (context.maxFrameLatency > 0 && context.maxFrameLatency < context.framesInFlight) {
+		uint32_t limit = (context.currentFrame + context.framesInFlight - context.maxFrameLatency) % context.framesInFlight;
+		waitTimeline(context, context.frames[limit].timelineValue);
+	}
+
+	// Wait until this frame's previous submission has finished, the CPU runs at most framesInFlight frames ahead
+	waitTimeline(context, frame.timelineValue);
+	auto frameDone = std::chrono::high_resolution_clock::now();
+	stats.frameWaitMs += std::chrono::duration<double, std::milli>(frameDone - start).count();
+	collectFinishedFrames(context);
+
+	// Release staging buffers whose copies have completed
+	retireStagingBuffers(context);
 	// Get next image in the swap chain (back/front buffer)
-	res = vkAcquireNextImageKHR(context.device, context.swapChain, UINT64_MAX, context.semaphores.presentComplete, VK_NULL_HANDLE, &context.currentBuffer);
-	assert(res == VK_SUCCESS);
-	// Use a fence to wait until the command buffer has finished execution before using it again
-	res = (vkWaitForFences(context.device, 1, &context.waitFences[context.currentBuffer], VK_TRUE, UINT64_MAX));
-	assert(res == VK_SUCCESS);
-	res = (vkResetFences(context.device, 1, &context.waitFences[context.currentBuffer]));
+	while (true) {
+		res = vkAcquireNextImageKHR(context.device, context.swapChain, UINT64_MAX, frame.imageAcquired, VK_NULL_HANDLE, &context.currentBuffer);
+		if (res == VK_ERROR_OUT_OF_DATE_KHR) {
+			// No image was acquired and the semaphore stays unsignaled, try again on the new swap chain
+			recreateSwapChain(context);
+			continue;
+		}
+		// A suboptimal image is still acquired and presented, the swap chain is rebuilt afterwards
+		if (res == VK_SUBOPTIMAL_KHR) {
+			context.swapChainDirty = true;
+		}
+		else {
+			assert(res == VK_SUCCESS);
+		}
+		break;
+	}
+	stats.acquireWaitMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - frameDone).count();
+	releaseRetiredSemaphores(context, context.currentBuffer);
+
+	// The image can come back before the frame that last rendered to it has finished (frames and
+	// images are not paired), its command buffer and uniform region are only reused after that
+	waitTimeline(context, context.imageTimelineValues[context.currentBuffer]);
+
+	// Everything recorded into this frame's pools last time around has executed
+	res = vkResetCommandPool(context.device, frame.commandPool, 0);
 	assert(res == VK_SUCCESS);
+	resetRecordPools(context, context.currentFrame);
+}
+
+// cmd is a primary recorded for this frame (see beginFrameCommandBuffer()), by default the
+// prerecorded command buffer of the acquired image is submitted
+void submitFrame(struct LHContext& context, VkCommandBuffer cmd) {
+	VkResult U_ASSERT_ONLY res;
+	LHFrame& frame = context.frames[context.currentFrame];
 
 	// Pipeline stage at which the queue submission will wait (via pWaitSemaphores)
 	VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
@@ -904,16 +1063,21 @@ void draw(struct LHContext& context) {
 	VkSubmitInfo submitInfo = {};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 	submitInfo.pWaitDstStageMask = &waitStageMask;									// Pointer to the list of pipeline stages that the semaphore waits will occur at
-	submitInfo.pWaitSemaphores = &context.semaphores.presentComplete;				// Semaphore(s) to wait upon before the submitted command buffer starts executing
+	submitInfo.pWaitSemaphores = &frame.imageAcquired;								// Semaphore(s) to wait upon before the submitted command buffer starts executing
 	submitInfo.waitSemaphoreCount = 1;												// One wait semaphore																				
-	submitInfo.pSignalSemaphores = &context.semaphores.renderComplete;				// Semaphore(s) to be signaled when command buffers have completed
+	submitInfo.pSignalSemaphores = &context.renderComplete[context.currentBuffer];	// Semaphore(s) to be signaled when command buffers have completed
 	submitInfo.signalSemaphoreCount = 1;											// One signal semaphore
-	submitInfo.pCommandBuffers = &context.cmdBuffer[context.currentBuffer];			// Command buffers(s) to execute in this batch (submission)
+	if (cmd == VK_NULL_HANDLE) {
+		cmd = context.cmdBuffer[context.currentBuffer];
+	}
+	submitInfo.pCommandBuffers = &cmd;												// Command buffers(s) to execute in this batch (submission)
 	submitInfo.commandBufferCount = 1;												// One command buffer
 
-	// Submit to the graphics queue passing a wait fence
-	res = (vkQueueSubmit(context.queue, 1, &submitInfo, context.waitFences[context.currentBuffer]));
-	assert(res == VK_SUCCESS);
+	// Submit to the graphics queue, the timeline reaches the frame's value once it has executed
+	frame.timelineValue = submitTimeline(context, submitInfo);
+	context.imageTimelineValues[context.currentBuffer] = frame.timelineValue;
+	frame.pending = true;
+	context.frameDirty = false;
 
 	VkPresentInfoKHR presentInfo = {};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -921,43 +1085,61 @@ void draw(struct LHContext& context) {
 	presentInfo.swapchainCount = 1;
 	presentInfo.pSwapchains = &context.swapChain;
 	presentInfo.pImageIndices = &context.currentBuffer;
-	// Check if a wait semaphore has been specified to wait for before presenting the image
-	if (context.semaphores.renderComplete != VK_NULL_HANDLE) {
-		presentInfo.pWaitSemaphores = &context.semaphores.renderComplete;
-		presentInfo.waitSemaphoreCount = 1;
+	presentInfo.pWaitSemaphores = &context.renderComplete[context.currentBuffer];
+	presentInfo.waitSemaphoreCount = 1;
+	{
+		std::lock_guard<std::mutex> lock(context.queueMutex);
+		res = vkQueuePresentKHR(context.queue, &presentInfo);
+	}
+	context.frameStats.latencyMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - frame.inputTime).count();
+	context.frameStats.latencySamples++;
+	context.currentFrame = (context.currentFrame + 1) % context.framesInFlight;
+
+	// Input applied to this frame has now been handed to the presentation engine
+	if (context.inputEventTime != std::chrono::high_resolution_clock::time_point()) {
+		context.frameStats.inputLatencyMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - context.inputEventTime).count();
+		context.frameStats.inputSamples++;
+		context.inputEventTime = std::chrono::high_resolution_clock::time_point();
+	}
+
+	if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR || context.swapChainDirty) {
+		recreateSwapChain(context);
+	}
+	else {
+		assert(res == VK_SUCCESS);
 	}
-	res = vkQueuePresentKHR(context.queue, &presentInfo);
-	assert(res == VK_SUCCESS);
 }
 
-VkResult bindBufferToMem(struct LHContext& context, VkBufferCreateInfo& bufferInfo, VkFlags flags,
-	VkBuffer& inputBuffer, VkDeviceMemory& memory) {
+VkResult bindBufferToMem(struct LHContext& context, VkBufferCreateInfo &bufferInfo, VkFlags flags,
+	VkBuffer& inputBuffer, VkDeviceMemory& memory, void** mapped, VkDeviceSize* offset) {
 	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
-
-	VkMemoryRequirements memReqs;
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.pNext = nullptr;
-	allocInfo.allocationSize = 0;
-	allocInfo.memoryTypeIndex = 0;
-
 
 	// Create a new buffer
 	res = (vkCreateBuffer(context.device, &bufferInfo, nullptr, &inputBuffer));
 	assert(res == VK_SUCCESS);
-	vkGetBufferMemoryRequirements(context.device, inputBuffer, &memReqs);
-	allocInfo.allocationSize = memReqs.size;
-	pass = memory_type_from_properties(context, memReqs.memoryTypeBits, flags, &allocInfo.memoryTypeIndex);
-	assert(pass && "No mappable coherent memory");
-	res = (vkAllocateMemory(context.device, &allocInfo, nullptr, &(memory)));
-	assert(res == VK_SUCCESS);
-	res = (vkBindBufferMemory(context.device, inputBuffer, memory, 0));
+
+	// Host visible buffers share a persistently mapped block like every other buffer, the caller gets the
+	// pointer at its offset instead of mapping the memory itself
+	LHAllocation allocation;
+	res = allocateBufferMemory(context, inputBuffer, flags, allocation);
 	assert(res == VK_SUCCESS);
+	memory = allocation.memory;
+	if (mapped) {
+		*mapped = allocation.mapped;
+	}
+	if (offset) {
+		*offset = allocation.offset;
+	}
 	return res;
 }
 
-void createShaderStage(struct LHContext& context, std::string filename, VkShaderStageFlagBits flag, VkPipelineShaderStageCreateInfo& shaderStage) {
+static std::string shaderCachePath(struct LHContext& context, const std::string& source, VkShaderStageFlagBits stage);
+static bool loadCachedSpirv(const std::string& path, std::vector<unsigned int>& spirv);
+static void storeCachedSpirv(struct LHContext& context, const std::string& path, const std::vector<unsigned int>& spirv);
+static void recordShaderReflection(struct LHContext& context, VkShaderModule module, VkShaderStageFlagBits stage, const uint32_t* code, size_t codeSize);
+static const TBuiltInResource* deviceShaderResources(struct LHContext& context);
+
+static void compileShaderStage(struct LHContext& context, const std::string& filename, VkShaderStageFlagBits flag, VkPipelineShaderStageCreateInfo& shaderStage, LHShaderCacheStats& stats) {
 	VkResult U_ASSERT_ONLY res;
 	bool U_ASSERT_ONLY retVal;
 	std::string sCode;
@@ -977,7 +1159,6 @@ void createShaderStage(struct LHContext& context, std::string filename, VkShader
 	}
 
 	if (!sCode.empty()) {
-		init_glslang();
 		std::vector<unsigned int> vtx_spv;
 		VkShaderModuleCreateInfo moduleCreateInfo;
 
@@ -988,8 +1169,32 @@ void createShaderStage(struct LHContext& context, std::string filename, VkShader
 		shaderStage.stage = flag;
 		shaderStage.pName = "main";
 
-		retVal = GLSLtoSPV(flag, sCode.c_str(), vtx_spv);
-		assert(retVal);
+		// A hit goes straight to the shader module, glslang is only brought up to compile a miss
+		auto start = std::chrono::high_resolution_clock::now();
+		bool cached = !context.shaderCacheDir.empty();
+		std::string cachePath = cached ? shaderCachePath(context, sCode, flag) : std::string();
+		if (cached && loadCachedSpirv(cachePath, vtx_spv)) {
+			stats.hits++;
+			stats.hitMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+		else {
+			LHSpirvOptimizeReport report;
+			init_glslang();
+			retVal = GLSLtoSPV(flag, sCode.c_str(), vtx_spv, context.shaderOptimization, &report, deviceShaderResources(context));
+			assert(retVal);
+			if (context.shaderOptimization != LH_SPIRV_OPTIMIZE_NONE && retVal) {
+				// Summed up and reported once by printShaderCacheStats()
+				stats.optimized.instructionsBefore += report.instructionsBefore;
+				stats.optimized.instructionsAfter += report.instructionsAfter;
+				stats.optimized.bytesBefore += report.bytesBefore;
+				stats.optimized.bytesAfter += report.bytesAfter;
+			}
+			if (cached && retVal) {
+				storeCachedSpirv(context, cachePath, vtx_spv);
+			}
+			stats.misses++;
+			stats.missMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		}
 
 		moduleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
 		moduleCreateInfo.pNext = NULL;
@@ -998,149 +1203,3925 @@ void createShaderStage(struct LHContext& context, std::string filename, VkShader
 		moduleCreateInfo.pCode = vtx_spv.data();
 		res = vkCreateShaderModule(context.device, &moduleCreateInfo, NULL, &shaderStage.module);
 		assert(res == VK_SUCCESS);
+		recordShaderReflection(context, shaderStage.module, flag, vtx_spv.data(), moduleCreateInfo.codeSize);
 
 	}
 	else {
 		std::cerr << "Error: Could not open shader file \"" << filename << "\"" << std::endl;
 	}
+}
 
-	finalize_glslang();
+void createShaderStage(struct LHContext& context, std::string filename, VkShaderStageFlagBits flag, VkPipelineShaderStageCreateInfo& shaderStage) {
+	compileShaderStage(context, filename, flag, shaderStage, context.shaderCacheStats);
 }
-//--------------IGNORE FROM HERE---------------------------------------------------------------------->
+//----------------------------> Device memory sub-allocation
 
-//TODO: Move all of this to a helper file
-bool memory_type_from_properties(struct LHContext& context, uint32_t typeBits, VkFlags requirements_mask, uint32_t* typeIndex) {
-	// Search memtypes to find first index with those properties
-	for (uint32_t i = 0; i < context.memory_properties.memoryTypeCount; i++) {
-		if ((typeBits & 1) == 1) {
-			// Type is available, does it match user properties?
-			if ((context.memory_properties.memoryTypes[i].propertyFlags & requirements_mask) == requirements_mask) {
-				*typeIndex = i;
-				return true;
-			}
-		}
-		typeBits >>= 1;
+// Order of the smallest buddy node that can hold size bytes
+static uint32_t memoryOrderFor(struct LHMemoryAllocator* allocator, VkDeviceSize size) {
+	uint32_t order = 0;
+	while ((allocator->minNodeSize << order) < size) {
+		order++;
 	}
-	// No memory types matched, return failure
-	return false;
+	return order;
 }
 
-void createClearColor(struct LHContext& context, VkClearValue* clear_values) {
-	clear_values[0].color = { { 0.0f, 0.0f, 0.2f, 1.0f } };
-	clear_values[1].depthStencil = { 1.0f, 0 };
+// Blocks are shrunk on small heaps (e.g. the 256MB device local + host visible heap) so one block can't exhaust them
+static VkDeviceSize blockSizeFor(struct LHContext& context, uint32_t memoryTypeIndex) {
+	uint32_t heapIndex = context.memory_properties.memoryTypes[memoryTypeIndex].heapIndex;
+	VkDeviceSize heapSize = context.memory_properties.memoryHeaps[heapIndex].size;
+	VkDeviceSize size = context.allocator->blockSize;
+	while (size > context.allocator->minNodeSize && size > heapSize / 8) {
+		size >>= 1;
+	}
+	return size;
 }
 
-void createRenderPassCreateInfo(struct LHContext& context, VkRenderPassBeginInfo& rp_begin) {
-	rp_begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-	rp_begin.pNext = nullptr;
-	rp_begin.renderPass = context.render_pass;
-	rp_begin.renderArea.offset.x = 0;
-	rp_begin.renderArea.offset.y = 0;
-	rp_begin.renderArea.extent.width = context.width;
-	rp_begin.renderArea.extent.height = context.height;
+// Drivers may fail or slow down past maxMemoryAllocationCount, new device allocations are refused from there on
+static bool allocationLimitReached(LHMemoryAllocator* allocator) {
+	if (allocator->deviceAllocationCount < allocator->maxAllocationCount) {
+		return false;
+	}
+	std::cerr << "maxMemoryAllocationCount (" << allocator->maxAllocationCount << ") reached, allocation refused" << std::endl;
+	return true;
 }
 
-
-void setupRenderPass(struct LHContext& context, bool useStagingBuffers) {
+static LHMemoryBlock* createMemoryBlock(struct LHContext& context, uint32_t memoryTypeIndex, VkDeviceSize size) {
 	VkResult U_ASSERT_ONLY res;
-	// This example will use a single render pass with one subpass
+	LHMemoryAllocator* allocator = context.allocator;
 
-	// Descriptors for the attachments used by this renderpass
-	std::array<VkAttachmentDescription, 2> attachments = {};
-	/*VkAttachmentDescription *attachments;
-	createAttachmentDescription(context, attachments);*/
-	// Color attachment
-	attachments[0].format = context.format;									// Use the color format selected by the swapchain
-	attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;									// We don't use multi sampling in this example
-	attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;							// Clear this attachment at the start of the render pass
-	attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;							// Keep it's contents after the render pass is finished (for displaying it)
-	attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;					// We don't use stencil, so don't care for load
-	attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;				// Same for store
-	attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;						// Layout at render pass start. Initial doesn't matter, so we use undefined
-	attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;					// Layout to which the attachment is transitioned when the render pass is finished
-																					// As we want to present the color buffer to the swapchain, we transition to PRESENT_KHR	
-	// Depth attachment
-	attachments[1].format = context.depth.format;											// A proper depth format is selected in the example base
-	attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
-	attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;							// Clear depth at start of first subpass
-	attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;						// We don't need depth after render pass has finished (DONT_CARE may result in better performance)
-	attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;					// No stencil
-	attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;				// No Stencil
-	attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;						// Layout at render pass start. Initial doesn't matter, so we use undefined
-	attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;	// Transition to depth/stencil attachment
+	VkMemoryAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = size;
+	allocInfo.memoryTypeIndex = memoryTypeIndex;
 
-	// Setup attachment references
-	VkAttachmentReference colorReference = {};
-	colorReference.attachment = 0;													// Attachment 0 is color
-	colorReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;				// Attachment layout used as color during the subpass
+	VkDeviceMemory memory;
+	if (vkAllocateMemory(context.device, &allocInfo, nullptr, &memory) != VK_SUCCESS) {
+		return nullptr;
+	}
 
-	VkAttachmentReference depthReference = {};
-	depthReference.attachment = 1;													// Attachment 1 is color
-	depthReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;		// Attachment used as depth/stemcil used during the subpass
+	LHMemoryBlock* block = new LHMemoryBlock();
+	block->memory = memory;
+	block->size = size;
+	block->mapped = nullptr;
+	block->usedBytes = 0;
 
-	// Setup a single subpass reference
-	VkSubpassDescription subpassDescription = {};
-	subpassDescription.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-	subpassDescription.colorAttachmentCount = 1;									// Subpass uses one color attachment
-	subpassDescription.pColorAttachments = &colorReference;							// Reference to the color attachment in slot 0
-	subpassDescription.pDepthStencilAttachment = &depthReference;					// Reference to the depth attachment in slot 1
-	subpassDescription.inputAttachmentCount = 0;									// Input attachments can be used to sample from contents of a previous subpass
-	subpassDescription.pInputAttachments = nullptr;									// (Input attachments not used by this example)
-	subpassDescription.preserveAttachmentCount = 0;									// Preserved attachments can be used to loop (and preserve) attachments through subpasses
-	subpassDescription.pPreserveAttachments = nullptr;								// (Preserve attachments not used by this example)
-	subpassDescription.pResolveAttachments = nullptr;								// Resolve attachments are resolved at the end of a sub pass and can be used for e.g. multi sampling
+	// Host visible blocks stay mapped for their whole lifetime, every sub-allocation gets a pointer into it
+	if (context.memory_properties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+		res = vkMapMemory(context.device, memory, 0, VK_WHOLE_SIZE, 0, &block->mapped);
+		assert(res == VK_SUCCESS);
+	}
 
-	// Setup subpass dependencies
-	// These will add the implicit ttachment layout transitionss specified by the attachment descriptions
-	// The actual usage layout is preserved through the layout specified in the attachment reference		
-	// Each subpass dependency will introduce a memory and execution dependency between the source and dest subpass described by
-	// srcStageMask, dstStageMask, srcAccessMask, dstAccessMask (and dependencyFlags is set)
-	// Note: VK_SUBPASS_EXTERNAL is a special constant that refers to all commands executed outside of the actual renderpass)
-	std::array<VkSubpassDependency, 2> dependencies;
+	// The whole block starts out as a single free node of the highest order
+	uint32_t maxOrder = memoryOrderFor(allocator, size);
+	block->freeLists.resize(maxOrder + 1);
+	block->freeLists[maxOrder].insert(0);
 
-	// First dependency at the start of the renderpass
-	// Does the transition from final to initial layout 
-	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;								// Producer of the dependency 
-	dependencies[0].dstSubpass = 0;													// Consumer is our single subpass that will wait for the execution depdendency
-	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-	dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+	allocator->deviceAllocationCount++;
+	allocator->allocatedBytes += size;
+	return block;
+}
 
-	// Second dependency at the end the renderpass
-	// Does the transition from the initial to the final layout
-	dependencies[1].srcSubpass = 0;													// Producer of the dependency is our single subpass
-	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;								// Consumer are all commands outside of the renderpass
-	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-	dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-	dependencies[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-	dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+static bool allocateFromBlock(struct LHMemoryAllocator* allocator, LHMemoryBlock* block, uint32_t order, VkDeviceSize& offset) {
+	uint32_t level = order;
+	while (level < block->freeLists.size() && block->freeLists[level].empty()) {
+		level++;
+	}
+	if (level >= block->freeLists.size()) {
+		return false;
+	}
 
-	// Create the actual renderpass
-	VkRenderPassCreateInfo renderPassInfo = {};
-	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());		// Number of attachments used by this render pass
-	renderPassInfo.pAttachments = attachments.data();								// Descriptions of the attachments used by the render pass
-	renderPassInfo.subpassCount = 1;												// We only use one subpass in this example
-	renderPassInfo.pSubpasses = &subpassDescription;								// Description of that subpass
-	renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());	// Number of subpass dependencies
-	renderPassInfo.pDependencies = dependencies.data();								// Subpass dependencies used by the render pass
+	offset = *block->freeLists[level].begin();
+	block->freeLists[level].erase(block->freeLists[level].begin());
 
-	res = (vkCreateRenderPass(context.device, &renderPassInfo, nullptr, &context.render_pass));
+	// Split the node down to the requested order, the upper halves go back on the free lists
+	while (level > order) {
+		level--;
+		block->freeLists[level].insert(offset + (allocator->minNodeSize << level));
+	}
+
+	block->used[offset] = order;
+	block->usedBytes += allocator->minNodeSize << order;
+	return true;
 }
 
-void createViewports(struct LHContext& context, VkCommandBuffer& cmd, VkViewport& vp) {
-	vp.height = (float)context.height;
-	vp.width = (float)context.width;
-	vp.minDepth = (float)0.0f;
-	vp.maxDepth = (float)1.0f;
-	vp.x = 0;
-	vp.y = 0;
-	vkCmdSetViewport(cmd, 0, 1, &vp);
+static void freeFromBlock(struct LHMemoryAllocator* allocator, LHMemoryBlock* block, VkDeviceSize offset) {
+	auto it = block->used.find(offset);
+	assert(it != block->used.end());
+	uint32_t order = it->second;
+	block->used.erase(it);
+	block->usedBytes -= allocator->minNodeSize << order;
+
+	// Merge with the buddy node for as long as it is free as well
+	while (order + 1 < block->freeLists.size()) {
+		VkDeviceSize buddy = offset ^ (allocator->minNodeSize << order);
+		auto b = block->freeLists[order].find(buddy);
+		if (b == block->freeLists[order].end()) {
+			break;
+		}
+		block->freeLists[order].erase(b);
+		offset = std::min(offset, buddy);
+		order++;
+	}
+	block->freeLists[order].insert(offset);
 }
-void createScisscor(struct LHContext& context, VkCommandBuffer& cmd, VkRect2D& sc) {
+
+static VkResult allocateMemory(struct LHContext& context, const VkMemoryRequirements& memReqs, VkFlags flags, bool optimal, bool dedicated, LHAllocation& allocation) {
+	VkResult res;
+	LHMemoryAllocator* allocator = context.allocator;
+	assert(allocator && "createDevice() creates the memory allocator");
+
+	uint32_t memoryTypeIndex = 0;
+	bool pass = memory_type_from_properties(context, memReqs.memoryTypeBits, flags, &memoryTypeIndex);
+	assert(pass && "No memory type with the requested properties");
+	if (!pass) {
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+
+	std::lock_guard<std::mutex> lock(allocator->mutex);
+	allocation = LHAllocation();
+	allocation.memoryTypeIndex = memoryTypeIndex;
+	allocation.size = memReqs.size;
+
+	// Buddy nodes are aligned to their own size, so asking for max(size, alignment) satisfies both
+	VkDeviceSize blockSize = blockSizeFor(context, memoryTypeIndex);
+	uint32_t order = memoryOrderFor(allocator, std::max(memReqs.size, memReqs.alignment));
+
+	// Anything larger than half a block gets its own allocation instead of pinning a whole block
+	if (dedicated || (allocator->minNodeSize << order) > blockSize / 2) {
+		if (allocationLimitReached(allocator)) {
+			return VK_ERROR_TOO_MANY_OBJECTS;
+		}
+		VkMemoryAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.allocationSize = memReqs.size;
+		allocInfo.memoryTypeIndex = memoryTypeIndex;
+
+		res = vkAllocateMemory(context.device, &allocInfo, nullptr, &allocation.memory);
+		if (res != VK_SUCCESS) {
+			return res;
+		}
+		// Callers that asked for a dedicated allocation map it themselves, oversized ones expect a pointer like any sub-allocation
+		if (!dedicated && (context.memory_properties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+			res = vkMapMemory(context.device, allocation.memory, 0, VK_WHOLE_SIZE, 0, &allocation.mapped);
+			assert(res == VK_SUCCESS);
+		}
+		allocator->deviceAllocationCount++;
+		allocator->allocatedBytes += memReqs.size;
+		allocator->dedicatedAllocationCount++;
+		allocator->usedBytes += memReqs.size;
+		return VK_SUCCESS;
+	}
+
+	std::vector<LHMemoryBlock*>& pool = allocator->pools[2 * memoryTypeIndex + (optimal ? 1 : 0)];
+	LHMemoryBlock* block = nullptr;
+	VkDeviceSize offset = 0;
+	for (auto candidate : pool) {
+		if (allocateFromBlock(allocator, candidate, order, offset)) {
+			block = candidate;
+			break;
+		}
+	}
+	if (block == nullptr) {
+		if (allocationLimitReached(allocator)) {
+			return VK_ERROR_TOO_MANY_OBJECTS;
+		}
+		block = createMemoryBlock(context, memoryTypeIndex, blockSize);
+		if (block == nullptr) {
+			return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+		}
+		pool.push_back(block);
+		pass = allocateFromBlock(allocator, block, order, offset);
+		assert(pass);
+	}
+
+	allocation.memory = block->memory;
+	allocation.offset = offset;
+	allocation.block = block;
+	allocation.mapped = block->mapped ? (uint8_t*)block->mapped + offset : nullptr;
+
+	allocator->subAllocationCount++;
+	allocator->usedBytes += memReqs.size;
+	return VK_SUCCESS;
+}
+
+void createMemoryAllocator(struct LHContext& context, VkDeviceSize blockSize) {
+	context.allocator = new LHMemoryAllocator();
+	context.allocator->bufferImageGranularity = context.deviceProperties.limits.bufferImageGranularity;
+	context.allocator->maxAllocationCount = context.deviceProperties.limits.maxMemoryAllocationCount;
+
+	// The buddy split needs a power of two block size
+	VkDeviceSize size = context.allocator->minNodeSize;
+	while ((size << 1) <= blockSize) {
+		size <<= 1;
+	}
+	context.allocator->blockSize = size;
+}
+
+void destroyMemoryAllocator(struct LHContext& context) {
+	LHMemoryAllocator* allocator = context.allocator;
+	if (allocator == nullptr) {
+		return;
+	}
+
+	// Dedicated allocations are only known through the resource they are bound to
+	for (auto& buffer : allocator->buffers) {
+		if (buffer.second.block == nullptr) {
+			vkFreeMemory(context.device, buffer.second.memory, nullptr);
+		}
+	}
+	for (auto& image : allocator->images) {
+		if (image.second.block == nullptr) {
+			vkFreeMemory(context.device, image.second.memory, nullptr);
+		}
+	}
+	for (auto& pool : allocator->pools) {
+		for (auto block : pool) {
+			vkFreeMemory(context.device, block->memory, nullptr);
+			delete block;
+		}
+	}
+
+	delete allocator;
+	context.allocator = nullptr;
+}
+
+VkResult allocateBufferMemory(struct LHContext& context, VkBuffer buffer, VkFlags flags, LHAllocation& allocation, bool dedicated) {
+	VkResult res;
+
+	VkMemoryRequirements memReqs;
+	vkGetBufferMemoryRequirements(context.device, buffer, &memReqs);
+	res = allocateMemory(context, memReqs, flags, false, dedicated, allocation);
+	if (res != VK_SUCCESS) {
+		return res;
+	}
+	res = vkBindBufferMemory(context.device, buffer, allocation.memory, allocation.offset);
+	assert(res == VK_SUCCESS);
+
+	std::lock_guard<std::mutex> lock(context.allocator->mutex);
+	context.allocator->buffers[buffer] = allocation;
+	return res;
+}
+
+VkResult allocateImageMemory(struct LHContext& context, VkImage image, VkFlags flags, LHAllocation& allocation, bool dedicated,
+	VkImageTiling tiling) {
+	VkResult res;
+
+	VkMemoryRequirements memReqs;
+	vkGetImageMemoryRequirements(context.device, image, &memReqs);
+	res = allocateMemory(context, memReqs, flags, tiling == VK_IMAGE_TILING_OPTIMAL, dedicated, allocation);
+	if (res != VK_SUCCESS) {
+		return res;
+	}
+	res = vkBindImageMemory(context.device, image, allocation.memory, allocation.offset);
+	assert(res == VK_SUCCESS);
+
+	std::lock_guard<std::mutex> lock(context.allocator->mutex);
+	context.allocator->images[image] = allocation;
+	return res;
+}
+
+void freeAllocation(struct LHContext& context, LHAllocation& allocation) {
+	LHMemoryAllocator* allocator = context.allocator;
+	if (allocation.memory == VK_NULL_HANDLE) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(allocator->mutex);
+	if (allocation.block == nullptr) {
+		vkFreeMemory(context.device, allocation.memory, nullptr);
+		allocator->deviceAllocationCount--;
+		allocator->allocatedBytes -= allocation.size;
+		allocator->dedicatedAllocationCount--;
+	}
+	else {
+		LHMemoryBlock* block = allocation.block;
+		freeFromBlock(allocator, block, allocation.offset);
+
+		// Give empty blocks back to the driver, but keep the last one of a pool for the next allocation
+		if (block->usedBytes == 0) {
+			for (uint32_t kind = 0; kind < 2; kind++) {
+				std::vector<LHMemoryBlock*>& pool = allocator->pools[2 * allocation.memoryTypeIndex + kind];
+				auto it = std::find(pool.begin(), pool.end(), block);
+				if (it != pool.end() && pool.size() > 1) {
+					vkFreeMemory(context.device, block->memory, nullptr);
+					allocator->deviceAllocationCount--;
+					allocator->allocatedBytes -= block->size;
+					pool.erase(it);
+					delete block;
+				}
+			}
+		}
+		allocator->subAllocationCount--;
+	}
+	allocator->usedBytes -= allocation.size;
+	allocation = LHAllocation();
+}
+
+void destroyBuffer(struct LHContext& context, VkBuffer buffer) {
+	LHAllocation allocation;
+	{
+		std::lock_guard<std::mutex> lock(context.allocator->mutex);
+		auto it = context.allocator->buffers.find(buffer);
+		if (it != context.allocator->buffers.end()) {
+			allocation = it->second;
+			context.allocator->buffers.erase(it);
+		}
+	}
+	vkDestroyBuffer(context.device, buffer, nullptr);
+	freeAllocation(context, allocation);
+}
+
+void destroyImage(struct LHContext& context, VkImage image) {
+	LHAllocation allocation;
+	{
+		std::lock_guard<std::mutex> lock(context.allocator->mutex);
+		auto it = context.allocator->images.find(image);
+		if (it != context.allocator->images.end()) {
+			allocation = it->second;
+			context.allocator->images.erase(it);
+		}
+	}
+	vkDestroyImage(context.device, image, nullptr);
+	freeAllocation(context, allocation);
+}
+
+void printMemoryAllocatorStats(struct LHContext& context) {
+	LHMemoryAllocator* allocator = context.allocator;
+	std::lock_guard<std::mutex> lock(allocator->mutex);
+	std::cout << "Device memory: " << allocator->subAllocationCount << " sub-allocated and " << allocator->dedicatedAllocationCount
+		<< " dedicated resources in " << allocator->deviceAllocationCount << " allocations (limit " << allocator->maxAllocationCount << ")" << std::endl;
+	std::cout << " Used: " << allocator->usedBytes / 1024 << " KB of " << allocator->allocatedBytes / 1024 << " KB" << std::endl;
+}
+
+//----------------------------> Staging uploads
+// Data is written into a host visible staging buffer and copied into a DEVICE_LOCAL buffer on the queue.
+// Nothing waits for the copy here: the staging buffer is kept until the timeline reaches the copy's
+// value and is released by retireStagingBuffers(), which draw() calls every frame. With an upload batch
+// open the copy is only recorded into it
+VkResult uploadBufferThroughStaging(struct LHContext& context, const void* input, uint32_t dataSize, VkBufferUsageFlags usage,
+	VkBuffer& buffer, VkDeviceMemory& memory) {
+
+	VkResult U_ASSERT_ONLY res;
+
+	// Destination buffer in device local memory
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = dataSize;
+	bufferInfo.usage = usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	res = vkCreateBuffer(context.device, &bufferInfo, nullptr, &buffer);
+	assert(res == VK_SUCCESS);
+
+	LHAllocation allocation;
+	res = allocateBufferMemory(context, buffer, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, allocation);
+	assert(res == VK_SUCCESS);
+	memory = allocation.memory;
+
+	// Later submissions on this queue read the buffer as vertex/index input
+	if (context.uploadBatch != nullptr) {
+		batchCopyBuffer(context, *context.uploadBatch, input, dataSize, buffer,
+			VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+	}
+	else {
+		LHUploadBatch batch;
+		beginUploadBatch(context, batch);
+		batchCopyBuffer(context, batch, input, dataSize, buffer,
+			VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+		submitUploadBatch(context, batch);
+	}
+	return res;
+}
+
+// Submits a one-time command buffer allocated from context.cmd_pool without waiting for it, the
+// command buffer is freed by retireStagingBuffers() once the timeline passes the returned value
+uint64_t submitUpload(struct LHContext& context, VkCommandBuffer cmd) {
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &cmd;
+
+	LHStagingUpload upload = {};
+	upload.buffer = VK_NULL_HANDLE;
+	upload.cmd = cmd;
+	upload.timelineValue = submitTimeline(context, submitInfo);
+	context.stagingUploads.push_back(upload);
+	return upload.timelineValue;
+}
+
+void retireStagingBuffers(struct LHContext& context, bool wait) {
+	for (auto it = context.stagingUploads.begin(); it != context.stagingUploads.end();) {
+		if (wait) {
+			waitTimeline(context, it->timelineValue);
+		}
+		else if (!timelineReached(context, it->timelineValue)) {
+			++it;
+			continue;
+		}
+		if (it->buffer != VK_NULL_HANDLE) {
+			destroyBuffer(context, it->buffer);
+		}
+		if (it->cmd != VK_NULL_HANDLE) {
+			vkFreeCommandBuffers(context.device, context.cmd_pool, 1, &it->cmd);
+		}
+		it = context.stagingUploads.erase(it);
+	}
+}
+
+//----------------------------> Upload batches
+// Every copy and layout transition between beginUploadBatch() and submitUploadBatch() goes into one
+// command buffer and one submission, loading any number of assets costs a single timeline value.
+// The barriers that hand the data to its readers are collected and recorded once at the end
+void beginUploadBatch(struct LHContext& context, struct LHUploadBatch& batch) {
+	VkResult U_ASSERT_ONLY res;
+	assert(batch.cmd == VK_NULL_HANDLE && "The batch is already open");
+
+	VkCommandBufferAllocateInfo cmdInfo = {};
+	cmdInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	cmdInfo.commandPool = context.cmd_pool;
+	cmdInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	cmdInfo.commandBufferCount = 1;
+	res = vkAllocateCommandBuffers(context.device, &cmdInfo, &batch.cmd);
+	assert(res == VK_SUCCESS);
+
+	VkCommandBufferBeginInfo beginInfo = {};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	res = vkBeginCommandBuffer(batch.cmd, &beginInfo);
+	assert(res == VK_SUCCESS);
+
+	// Staging uploads made by the library while the batch is open are recorded into it
+	context.uploadBatch = &batch;
+}
+
+// Staging buffer, sub-allocated from a persistently mapped block and kept until the batch has executed
+static VkBuffer createBatchStaging(struct LHContext& context, struct LHUploadBatch& batch, const void* data, VkDeviceSize size) {
+	VkResult U_ASSERT_ONLY res;
+	VkBuffer staging;
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = size;
+	bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	res = vkCreateBuffer(context.device, &bufferInfo, nullptr, &staging);
+	assert(res == VK_SUCCESS);
+
+	LHAllocation allocation;
+	res = allocateBufferMemory(context, staging, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, allocation);
+	assert(res == VK_SUCCESS);
+	memcpy(allocation.mapped, data, size);
+
+	batch.stagingBuffers.push_back(staging);
+	return staging;
+}
+
+void batchCopyBuffer(struct LHContext& context, struct LHUploadBatch& batch, const void* data, VkDeviceSize size, VkBuffer buffer,
+	VkAccessFlags dstAccess, VkPipelineStageFlags dstStages) {
+	VkBuffer staging = createBatchStaging(context, batch, data, size);
+
+	VkBufferCopy region = {};
+	region.size = size;
+	vkCmdCopyBuffer(batch.cmd, staging, buffer, 1, &region);
+
+	VkBufferMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = dstAccess;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	batch.bufferBarriers.push_back(barrier);
+	batch.srcStages |= VK_PIPELINE_STAGE_TRANSFER_BIT;
+	batch.dstStages |= dstStages;
+}
+
+// Copies tightly packed texels into mip level 0 of a color image created with TRANSFER_DST usage, the
+// image ends up in finalLayout
+void batchCopyImage(struct LHContext& context, struct LHUploadBatch& batch, const void* data, VkDeviceSize size, VkImage image,
+	uint32_t width, uint32_t height, VkImageLayout finalLayout, VkPipelineStageFlags dstStages) {
+	VkBuffer staging = createBatchStaging(context, batch, data, size);
+
+	VkImageSubresourceRange subresourceRange = {};
+	subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	subresourceRange.baseMipLevel = 0;
+	subresourceRange.levelCount = 1;
+	subresourceRange.baseArrayLayer = 0;
+	subresourceRange.layerCount = 1;
+
+	// The old contents are discarded, nothing has to be waited for before the copy
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange = subresourceRange;
+	vkCmdPipelineBarrier(batch.cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	VkBufferImageCopy region = {};
+	region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	region.imageSubresource.mipLevel = 0;
+	region.imageSubresource.baseArrayLayer = 0;
+	region.imageSubresource.layerCount = 1;
+	region.imageExtent = { width, height, 1 };
+	vkCmdCopyBufferToImage(batch.cmd, staging, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+	batchTransitionImage(context, batch, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, finalLayout,
+		VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_SHADER_READ_BIT, dstStages);
+}
+
+// Queues a layout transition of a whole color image, recorded with the other barriers at submission
+void batchTransitionImage(struct LHContext& context, struct LHUploadBatch& batch, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+	VkAccessFlags srcAccess, VkPipelineStageFlags srcStages, VkAccessFlags dstAccess, VkPipelineStageFlags dstStages) {
+	VkImageMemoryBarrier barrier = {};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = dstAccess;
+	barrier.oldLayout = oldLayout;
+	barrier.newLayout = newLayout;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+	barrier.subresourceRange.baseMipLevel = 0;
+	barrier.subresourceRange.levelCount = 1;
+	barrier.subresourceRange.baseArrayLayer = 0;
+	barrier.subresourceRange.layerCount = 1;
+	batch.imageBarriers.push_back(barrier);
+	batch.srcStages |= srcStages;
+	batch.dstStages |= dstStages;
+}
+
+// One submission for the whole batch without waiting for it. The staging buffers and the command
+// buffer are released by retireStagingBuffers() once the timeline passes the returned value
+uint64_t submitUploadBatch(struct LHContext& context, struct LHUploadBatch& batch) {
+	VkResult U_ASSERT_ONLY res;
+
+	if (!batch.bufferBarriers.empty() || !batch.imageBarriers.empty()) {
+		vkCmdPipelineBarrier(batch.cmd, batch.srcStages, batch.dstStages, 0, 0, nullptr,
+			(uint32_t)batch.bufferBarriers.size(), batch.bufferBarriers.data(),
+			(uint32_t)batch.imageBarriers.size(), batch.imageBarriers.data());
+	}
+	res = vkEndCommandBuffer(batch.cmd);
+	assert(res == VK_SUCCESS);
+
+	VkSubmitInfo submitInfo = {};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch.cmd;
+	uint64_t value = submitTimeline(context, submitInfo);
+
+	// The command buffer travels with the first entry, every staging buffer retires at the same value
+	LHStagingUpload upload = {};
+	upload.buffer = VK_NULL_HANDLE;
+	upload.cmd = batch.cmd;
+	upload.timelineValue = value;
+	if (batch.stagingBuffers.empty()) {
+		context.stagingUploads.push_back(upload);
+	}
+	for (VkBuffer staging : batch.stagingBuffers) {
+		upload.buffer = staging;
+		context.stagingUploads.push_back(upload);
+		upload.cmd = VK_NULL_HANDLE;
+	}
+
+	if (context.uploadBatch == &batch) {
+		context.uploadBatch = nullptr;
+	}
+	batch = LHUploadBatch();
+	return value;
+}
+
+//----------------------------> Uniform ring
+// Reserves an aligned slice in every frame region and returns its offset inside the region.
+// All slices have to be reserved before createUniformRing()
+uint32_t reserveUniformSlice(struct LHContext& context, LHUniformRing& ring, VkDeviceSize size) {
+	assert(ring.buffer == VK_NULL_HANDLE && "Slices are reserved before the ring is created");
+	ring.alignment = std::max<VkDeviceSize>(context.deviceProperties.limits.minUniformBufferOffsetAlignment, 1);
+
+	VkDeviceSize offset = ring.frameSize;
+	ring.frameSize += (size + ring.alignment - 1) & ~(ring.alignment - 1);
+	return (uint32_t)offset;
+}
+
+VkResult createUniformRing(struct LHContext& context, LHUniformRing& ring, uint32_t frameCount) {
+	VkResult U_ASSERT_ONLY res;
+	assert(ring.frameSize > 0 && "Reserve the slices first");
+
+	ring.frameCount = frameCount;
+	ring.frameVersion.assign(frameCount, 0);
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = ring.frameSize * frameCount;
+	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+	res = vkCreateBuffer(context.device, &bufferInfo, nullptr, &ring.buffer);
+	assert(res == VK_SUCCESS);
+
+	// Sub-allocated from a host visible block which stays mapped, no vkMapMemory per update
+	LHAllocation allocation;
+	res = allocateBufferMemory(context, ring.buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, allocation);
+	assert(res == VK_SUCCESS);
+	ring.mapped = (uint8_t*)allocation.mapped;
+	return res;
+}
+
+void destroyUniformRing(struct LHContext& context, LHUniformRing& ring) {
+	if (ring.buffer != VK_NULL_HANDLE) {
+		destroyBuffer(context, ring.buffer);
+	}
+	ring = LHUniformRing();
+}
+
+// A recreated swap chain may have a different number of images, the ring then needs a region for each of them.
+// Slices keep their offsets and every region is stale afterwards. Returns true when the buffer was replaced, the
+// descriptors pointing at it have to be written again. Called with the device idle, from onSwapChainRecreated
+bool resizeUniformRing(struct LHContext& context, LHUniformRing& ring, uint32_t frameCount) {
+	if (ring.frameCount == frameCount) {
+		return false;
+	}
+	destroyBuffer(context, ring.buffer);
+	ring.buffer = VK_NULL_HANDLE;
+	ring.mapped = nullptr;
+	VkResult U_ASSERT_ONLY res = createUniformRing(context, ring, frameCount);
+	assert(res == VK_SUCCESS);
+	return true;
+}
+
+// Host pointer of a slice for the given frame
+void* uniformRingSlice(LHUniformRing& ring, uint32_t frame, uint32_t slice) {
+	assert(frame < ring.frameCount);
+	return ring.mapped + ring.frameSize * frame + slice;
+}
+
+// Dynamic offset to pass to vkCmdBindDescriptorSets for a slice of the given frame
+uint32_t uniformRingOffset(const LHUniformRing& ring, uint32_t frame, uint32_t slice) {
+	return (uint32_t)(ring.frameSize * frame) + slice;
+}
+
+void markUniformRingDirty(LHUniformRing& ring) {
+	ring.version++;
+}
+
+// True once per region after every markUniformRingDirty(), the caller is expected to rewrite the region then
+bool uniformRingStale(LHUniformRing& ring, uint32_t frame) {
+	if (ring.frameVersion[frame] == ring.version) {
+		return false;
+	}
+	ring.frameVersion[frame] = ring.version;
+	return true;
+}
+
+//----------------------------> Present policy
+void setPresentPolicy(struct LHContext& context, LHPresentPolicy policy, uint32_t maxFrameLatency) {
+	context.presentPolicy = policy;
+	context.maxFrameLatency = maxFrameLatency;
+	// An existing swap chain picks up the new present mode on the next frame
+	if (context.swapChain != VK_NULL_HANDLE) {
+		context.swapChainDirty = true;
+	}
+}
+
+static const char* presentModeString(VkPresentModeKHR mode) {
+	switch (mode) {
+	case VK_PRESENT_MODE_IMMEDIATE_KHR:
+		return "IMMEDIATE";
+	case VK_PRESENT_MODE_MAILBOX_KHR:
+		return "MAILBOX";
+	case VK_PRESENT_MODE_FIFO_KHR:
+		return "FIFO";
+	case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+		return "FIFO_RELAXED";
+	default:
+		return "UNKNOWN";
+	}
+}
+
+// Frames that have finished since the last call no longer count towards the queue depth
+static void collectFinishedFrames(struct LHContext& context) {
+	for (auto& frame : context.frames) {
+		if (frame.pending && timelineReached(context, frame.timelineValue)) {
+			frame.pending = false;
+		}
+	}
+}
+
+//----------------------------> Frames in flight
+VkResult createFrames(struct LHContext& context, uint32_t framesInFlight) {
+	VkResult U_ASSERT_ONLY res = VK_SUCCESS;
+
+	// Frames can only be rebuilt once nothing is queued on them
+	if (!context.frames.empty()) {
+		vkDeviceWaitIdle(context.device);
+		destroyFrames(context);
+	}
+
+	context.framesInFlight = framesInFlight > 0 ? framesInFlight : 1;
+	context.currentFrame = 0;
+	context.frames.resize(context.framesInFlight);
+
+	VkCommandPoolCreateInfo cmd_pool_info = {};
+	cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	cmd_pool_info.pNext = NULL;
+	cmd_pool_info.queueFamilyIndex = context.graphics_queue_family_index;
+	// The whole pool is reset every time its frame comes around, so the buffers are short lived
+	cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+	VkSemaphoreCreateInfo semaphoreCreateInfo = {};
+	semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreCreateInfo.pNext = nullptr;
+
+	for (auto& frame : context.frames) {
+		res = vkCreateCommandPool(context.device, &cmd_pool_info, NULL, &frame.commandPool);
+		assert(res == VK_SUCCESS);
+
+		VkCommandBufferAllocateInfo cmd = {};
+		cmd.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		cmd.pNext = NULL;
+		cmd.commandPool = frame.commandPool;
+		cmd.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		cmd.commandBufferCount = 1;
+		res = vkAllocateCommandBuffers(context.device, &cmd, &frame.cmd);
+		assert(res == VK_SUCCESS);
+
+		res = vkCreateSemaphore(context.device, &semaphoreCreateInfo, nullptr, &frame.imageAcquired);
+		assert(res == VK_SUCCESS);
+		// Value 0 is always reached, so the first use of each frame doesn't wait
+		frame.timelineValue = 0;
+	}
+
+	context.frameStats = {};
+	context.frameStats.start = std::chrono::high_resolution_clock::now();
+
+	return res;
+}
+
+void destroyFrames(struct LHContext& context) {
+	for (auto& frame : context.frames) {
+		vkDestroySemaphore(context.device, frame.imageAcquired, nullptr);
+		// Destroying the pool frees its command buffer
+		vkDestroyCommandPool(context.device, frame.commandPool, nullptr);
+	}
+	context.frames.clear();
+}
+
+void printFrameStats(struct LHContext& context) {
+	LHFrameStats& stats = context.frameStats;
+	if (stats.frames == 0) {
+		return;
+	}
+	double frames = (double)stats.frames;
+	std::cout << "Frames in flight: " << context.framesInFlight << " (" << context.swapchainImageCount << " swap chain images, "
+		<< presentModeString(context.presentMode) << ")" << std::endl;
+	// Jitter is the standard deviation of the frame time
+	double intervals = std::max(frames - 1.0, 1.0);
+	double frameMs = stats.frameMs / intervals;
+	double jitterMs = std::sqrt(std::max(stats.frameMsSq / intervals - frameMs * frameMs, 0.0));
+	std::cout << (context.renderThreaded ? "Render thread" : "Single thread") << std::endl;
+	std::cout << "  frames: " << stats.frames << ", average frame time: " << frameMs << " ms, jitter: " << jitterMs << " ms" << std::endl;
+	// Time blocked on the previous frame means the GPU is the bottleneck, more frames in flight can hide it
+	// at the cost of input latency. Time blocked in acquire means presentation is limiting the frame rate
+	std::cout << "  waiting on previous frame: " << stats.frameWaitMs / frames << " ms"
+		<< ", waiting on acquire: " << stats.acquireWaitMs / frames << " ms" << std::endl;
+	std::cout << "  average queue depth: " << stats.queueDepth / frames << " frames";
+	if (stats.latencySamples > 0) {
+		// From polling input to the present being queued, the wait on the previous frame included
+		std::cout << ", input to present latency: " << stats.latencyMs / stats.latencySamples << " ms";
+	}
+	std::cout << std::endl;
+	// Time asleep is time the CPU and GPU could idle, the figure that matters for power on a static scene
+	double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - stats.start).count();
+	std::cout << "  " << stats.frames << " frames in " << elapsedMs / 1000.0 << " s (" << stats.frames * 1000.0 / std::max(elapsedMs, 1.0) << " fps)";
+	if (context.renderOnDemand) {
+		std::cout << ", asleep " << 100.0 * stats.idleMs / std::max(elapsedMs, 1.0) << "% of the time over " << stats.wakeups << " wakeups";
+	}
+	std::cout << std::endl;
+	if (stats.inputSamples > 0) {
+		std::cout << "  key event to present: " << stats.inputLatencyMs / stats.inputSamples << " ms over " << stats.inputSamples << " frames" << std::endl;
+	}
+	if (stats.recreateCount > 0) {
+		std::cout << "  swap chain recreated " << stats.recreateCount << " times, "
+			<< stats.recreateMs / stats.recreateCount << " ms per rebuild" << std::endl;
+	}
+}
+
+//----------------------------> Parallel command recording
+static void recordChunk(struct LHContext& context, uint32_t index) {
+	VkResult U_ASSERT_ONLY res;
+	LHRecordThreads* threads = context.recordThreads;
+	LHRecordWorker& worker = threads->workers[index];
+
+	// Contiguous slice of the item range, idle workers get nothing when there are fewer items than workers
+	uint32_t workerCount = std::min((uint32_t)threads->workers.size(), threads->itemCount);
+	uint32_t chunk = (threads->itemCount + workerCount - 1) / workerCount;
+	uint32_t first = index * chunk;
+	if (index >= workerCount || first >= threads->itemCount) {
+		return;
+	}
+	uint32_t count = std::min(chunk, threads->itemCount - first);
+
+	// Reuse the secondaries handed out since this frame's pool was last reset, allocate more when short
+	uint32_t frame = threads->frame;
+	if (worker.used[frame] == worker.cmds[frame].size()) {
+		VkCommandBufferAllocateInfo cmd = {};
+		cmd.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		cmd.pNext = NULL;
+		cmd.commandPool = worker.pools[frame];
+		cmd.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		cmd.commandBufferCount = 1;
+
+		VkCommandBuffer buffer;
+		res = vkAllocateCommandBuffers(context.device, &cmd, &buffer);
+		assert(res == VK_SUCCESS);
+		worker.cmds[frame].push_back(buffer);
+	}
+	VkCommandBuffer buffer = worker.cmds[frame][worker.used[frame]++];
+
+	VkCommandBufferBeginInfo cmdBufInfo = {};
+	cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	cmdBufInfo.pNext = nullptr;
+	// Executed inside the primary's render pass, recorded again next time around
+	cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	cmdBufInfo.pInheritanceInfo = threads->inheritance;
+
+	res = vkBeginCommandBuffer(buffer, &cmdBufInfo);
+	assert(res == VK_SUCCESS);
+	(*threads->record)(buffer, first, count);
+	res = vkEndCommandBuffer(buffer);
+	assert(res == VK_SUCCESS);
+
+	threads->out[index] = buffer;
+}
+
+static void recordWorkerLoop(struct LHContext* context, uint32_t index) {
+	LHRecordThreads* threads = context->recordThreads;
+	uint64_t generation = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(threads->mutex);
+			threads->wake.wait(lock, [&] { return threads->quit || threads->generation != generation; });
+			if (threads->quit) {
+				return;
+			}
+			generation = threads->generation;
+		}
+
+		recordChunk(*context, index);
+
+		std::lock_guard<std::mutex> lock(threads->mutex);
+		if (--threads->pending == 0) {
+			threads->done.notify_one();
+		}
+	}
+}
+
+void createRecordThreads(struct LHContext& context, uint32_t threadCount) {
+	VkResult U_ASSERT_ONLY res;
+
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	context.recordThreads = new LHRecordThreads();
+	LHRecordThreads* threads = context.recordThreads;
+	threads->workers.resize(threadCount);
+
+	VkCommandPoolCreateInfo cmd_pool_info = {};
+	cmd_pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	cmd_pool_info.pNext = NULL;
+	cmd_pool_info.queueFamilyIndex = context.graphics_queue_family_index;
+	cmd_pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+	// A command pool may only be used by one thread at a time, so every worker owns its pools
+	// One per frame in flight, the threads have to be created after the frames
+	for (auto& worker : threads->workers) {
+		worker.pools.resize(context.framesInFlight);
+		worker.cmds.resize(context.framesInFlight);
+		worker.used.assign(context.framesInFlight, 0);
+		for (auto& pool : worker.pools) {
+			res = vkCreateCommandPool(context.device, &cmd_pool_info, NULL, &pool);
+			assert(res == VK_SUCCESS);
+		}
+	}
+
+	// Worker 0 is the thread calling recordSecondaryCommandBuffers()
+	for (uint32_t i = 1; i < threadCount; i++) {
+		threads->threads.push_back(std::thread(recordWorkerLoop, &context, i));
+	}
+}
+
+void destroyRecordThreads(struct LHContext& context) {
+	LHRecordThreads* threads = context.recordThreads;
+	if (threads == nullptr) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(threads->mutex);
+		threads->quit = true;
+	}
+	threads->wake.notify_all();
+	for (auto& thread : threads->threads) {
+		thread.join();
+	}
+
+	for (auto& worker : threads->workers) {
+		for (auto& pool : worker.pools) {
+			vkDestroyCommandPool(context.device, pool, nullptr);
+		}
+	}
+	delete threads;
+	context.recordThreads = nullptr;
+}
+
+void resetRecordPools(struct LHContext& context, uint32_t frame) {
+	VkResult U_ASSERT_ONLY res;
+	LHRecordThreads* threads = context.recordThreads;
+	if (threads == nullptr) {
+		return;
+	}
+
+	// Only called once the frame's previous submission has finished, none of these secondaries are pending anymore
+	for (auto& worker : threads->workers) {
+		res = vkResetCommandPool(context.device, worker.pools[frame], 0);
+		assert(res == VK_SUCCESS);
+		worker.used[frame] = 0;
+	}
+}
+
+void recordSecondaryCommandBuffers(struct LHContext& context, const VkCommandBufferInheritanceInfo& inheritance,
+	uint32_t itemCount, const LHRecordFunc& record, std::vector<VkCommandBuffer>& secondaries) {
+	LHRecordThreads* threads = context.recordThreads;
+	assert(threads != nullptr);
+
+	secondaries.clear();
+	if (itemCount == 0) {
+		return;
+	}
+	uint32_t workerCount = std::min((uint32_t)threads->workers.size(), itemCount);
+	uint32_t chunk = (itemCount + workerCount - 1) / workerCount;
+	secondaries.resize(workerCount);
+
+	threads->record = &record;
+	threads->inheritance = &inheritance;
+	threads->itemCount = itemCount;
+	threads->frame = context.currentFrame;
+	threads->out = secondaries.data();
+
+	{
+		std::lock_guard<std::mutex> lock(threads->mutex);
+		threads->pending = (uint32_t)threads->threads.size();
+		threads->generation++;
+	}
+	threads->wake.notify_all();
+
+	// The calling thread records the first chunk while the workers handle the rest
+	recordChunk(context, 0);
+
+	std::unique_lock<std::mutex> lock(threads->mutex);
+	threads->done.wait(lock, [&] { return threads->pending == 0; });
+
+	// Workers past the end of the item range recorded nothing
+	secondaries.resize((itemCount + chunk - 1) / chunk);
+}
+
+VkCommandBuffer beginFrameCommandBuffer(struct LHContext& context) {
+	VkResult U_ASSERT_ONLY res;
+	VkCommandBuffer cmd = context.frames[context.currentFrame].cmd;
+
+	VkCommandBufferBeginInfo cmdBufInfo = {};
+	cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	cmdBufInfo.pNext = nullptr;
+	cmdBufInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+	// The frame's pool was reset by acquireFrame, so the buffer is back in the initial state
+	res = vkBeginCommandBuffer(cmd, &cmdBufInfo);
+	assert(res == VK_SUCCESS);
+	return cmd;
+}
+
+//----------------------------> Swap chain recreation
+static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
+	// Not every platform reports a resize through VK_ERROR_OUT_OF_DATE_KHR, so track it here as well
+	struct LHContext* context = (struct LHContext*)glfwGetWindowUserPointer(window);
+	context->framebufferWidth = width;
+	context->framebufferHeight = height;
+	context->swapChainDirty = true;
+	markFrameDirty(*context);
+}
+
+VkResult recreateSwapChain(struct LHContext& context) {
+	VkResult U_ASSERT_ONLY res;
+
+	// A minimized window has no extent to render to, wait until it's restored
+	int width = 0, height = 0;
+	if (context.renderThreaded) {
+		// GLFW may only be called on the main thread, its resize callback keeps the size for us
+		width = context.framebufferWidth;
+		height = context.framebufferHeight;
+		while ((width == 0 || height == 0) && !glfwWindowShouldClose(context.window)) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			width = context.framebufferWidth;
+			height = context.framebufferHeight;
+		}
+		// Closed while minimized, keep the old extent so the render loop can still run out
+		if (width == 0 || height == 0) {
+			width = context.width;
+			height = context.height;
+		}
+	}
+	else {
+		glfwGetFramebufferSize(context.window, &width, &height);
+		while (width == 0 || height == 0) {
+			glfwWaitEvents();
+			glfwGetFramebufferSize(context.window, &width, &height);
+		}
+	}
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Nothing in flight may still reference the size dependent resources
+	vkDeviceWaitIdle(context.device);
+
+	for (auto& frameBuffer : context.frameBuffers) {
+		vkDestroyFramebuffer(context.device, frameBuffer, nullptr);
+	}
+	vkDestroyImageView(context.device, context.depth.view, nullptr);
+	destroyImage(context, context.depth.image);
+	vkFreeCommandBuffers(context.device, context.cmd_pool, (uint32_t)context.cmdBuffer.size(), context.cmdBuffer.data());
+
+	// The device, render pass, pipelines and pipeline cache are kept, viewport and scissor are dynamic state.
+	// The image count may change, the library's per-image state follows below and the application resizes
+	// its own in onSwapChainRecreated
+	context.width = width;
+	context.height = height;
+	res = createSwapChain(context);
+	assert(res == VK_SUCCESS);
+	res = createCommandBuffer(context);
+	assert(res == VK_SUCCESS);
+	res = createSynchPrimitive(context);
+	assert(res == VK_SUCCESS);
+	// Without a render pass of its own the application's render graph owns the attachments
+	if (context.render_pass != VK_NULL_HANDLE) {
+		createDepthBuffers(context);
+		res = createFrameBuffer(context, context.includeDepth);
+		assert(res == VK_SUCCESS);
+	}
+	context.swapChainDirty = false;
+	markFrameDirty(context);
+
+	// Let the application re-record its command buffers against the new frame buffers
+	if (context.onSwapChainRecreated) {
+		context.onSwapChainRecreated();
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	context.frameStats.recreateCount++;
+	context.frameStats.recreateMs += ms;
+
+	return res;
+}
+
+//----------------------------> Timeline synchronization
+// Submits with an extra signal of the next timeline value and returns it, waiting on that value
+// replaces a fence per submission. Safe to call from several threads, the queue is locked from handing
+// out the value until the submission is queued so the values signal in increasing order
+uint64_t submitTimeline(struct LHContext& context, VkSubmitInfo& submitInfo) {
+	VkResult U_ASSERT_ONLY res;
+	std::lock_guard<std::mutex> lock(context.queueMutex);
+	uint64_t value = ++context.timelineValue;
+
+	// Binary semaphores ignore their value, only the timeline entry matters
+	std::vector<VkSemaphore> signalSemaphores(submitInfo.pSignalSemaphores, submitInfo.pSignalSemaphores + submitInfo.signalSemaphoreCount);
+	std::vector<uint64_t> signalValues(submitInfo.signalSemaphoreCount, 0);
+	signalSemaphores.push_back(context.timeline);
+	signalValues.push_back(value);
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.pNext = submitInfo.pNext;
+	timelineInfo.signalSemaphoreValueCount = (uint32_t)signalValues.size();
+	timelineInfo.pSignalSemaphoreValues = signalValues.data();
+
+	VkSubmitInfo timelineSubmit = submitInfo;
+	timelineSubmit.pNext = &timelineInfo;
+	timelineSubmit.signalSemaphoreCount = (uint32_t)signalSemaphores.size();
+	timelineSubmit.pSignalSemaphores = signalSemaphores.data();
+
+	res = vkQueueSubmit(context.queue, 1, &timelineSubmit, VK_NULL_HANDLE);
+	assert(res == VK_SUCCESS);
+	return value;
+}
+
+bool timelineReached(struct LHContext& context, uint64_t value) {
+	VkResult U_ASSERT_ONLY res;
+	uint64_t counter;
+	res = context.fpGetSemaphoreCounterValue(context.device, context.timeline, &counter);
+	assert(res == VK_SUCCESS);
+	return counter >= value;
+}
+
+void waitTimeline(struct LHContext& context, uint64_t value) {
+	VkResult U_ASSERT_ONLY res;
+	VkSemaphoreWaitInfo waitInfo = {};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &context.timeline;
+	waitInfo.pValues = &value;
+	res = context.fpWaitSemaphores(context.device, &waitInfo, UINT64_MAX);
+	assert(res == VK_SUCCESS);
+}
+
+//----------------------------> Render on demand
+static bool inputQueueEmpty(struct LHContext& context);
+
+static void windowRefreshCallback(GLFWwindow* window) {
+	// The window was exposed or damaged, its contents have to be presented again
+	struct LHContext* context = (struct LHContext*)glfwGetWindowUserPointer(window);
+	markFrameDirty(*context);
+}
+
+void waitForEvents(struct LHContext& context) {
+	if (!context.renderOnDemand || context.frameDirty) {
+		// On the render thread the main thread is already pumping the events
+		if (!context.renderThreaded) {
+			glfwPollEvents();
+		}
+		return;
+	}
+
+	// Nothing to draw, sleep until an event arrives. Pending uploads are checked more often so their
+	// results show up as soon as they land
+	double timeout = context.stagingUploads.empty() ? context.idleTimeout : 0.005;
+	auto start = std::chrono::high_resolution_clock::now();
+	if (context.renderThreaded) {
+		std::unique_lock<std::mutex> lock(context.input.mutex);
+		context.input.signal.wait_for(lock, std::chrono::duration<double>(timeout), [&] {
+			return context.frameDirty || !inputQueueEmpty(context);
+		});
+	}
+	else {
+		glfwWaitEventsTimeout(timeout);
+	}
+	context.frameStats.idleMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	context.frameStats.wakeups++;
+
+	size_t pending = context.stagingUploads.size();
+	retireStagingBuffers(context);
+	if (context.stagingUploads.size() != pending) {
+		markFrameDirty(context);
+	}
+}
+
+void markFrameDirty(struct LHContext& context) {
+	context.frameDirty = true;
+	if (context.renderThreaded) {
+		{
+			std::lock_guard<std::mutex> lock(context.input.mutex);
+		}
+		context.input.signal.notify_one();
+	}
+}
+
+bool frameNeeded(struct LHContext& context) {
+	return !context.renderOnDemand || context.frameDirty;
+}
+
+//----------------------------> Render thread
+bool pushInputEvent(struct LHContext& context, const LHInputEvent& event) {
+	LHInputQueue& queue = context.input;
+	uint32_t head = queue.head.load(std::memory_order_relaxed);
+	uint32_t next = (head + 1) % LH_INPUT_QUEUE_SIZE;
+	// Full, the render thread has fallen far behind and the event is dropped
+	if (next == queue.tail.load(std::memory_order_acquire)) {
+		return false;
+	}
+	queue.events[head] = event;
+	queue.head.store(next, std::memory_order_release);
+
+	// Wake a render thread sleeping in waitForEvents(), the lock closes the gap between its check and its wait
+	if (context.renderThreaded) {
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex);
+		}
+		queue.signal.notify_one();
+	}
+	return true;
+}
+
+bool popInputEvent(struct LHContext& context, LHInputEvent& event) {
+	LHInputQueue& queue = context.input;
+	uint32_t tail = queue.tail.load(std::memory_order_relaxed);
+	if (tail == queue.head.load(std::memory_order_acquire)) {
+		return false;
+	}
+	event = queue.events[tail];
+	queue.tail.store((tail + 1) % LH_INPUT_QUEUE_SIZE, std::memory_order_release);
+
+	// The oldest event applied to the next frame, its latency is taken when that frame is presented
+	if (context.inputEventTime == std::chrono::high_resolution_clock::time_point()) {
+		context.inputEventTime = event.time;
+	}
+	return true;
+}
+
+static bool inputQueueEmpty(struct LHContext& context) {
+	return context.input.tail.load(std::memory_order_acquire) == context.input.head.load(std::memory_order_acquire);
+}
+
+void runRenderThread(struct LHContext& context, const std::function<void()>& renderLoop) {
+	// GLFW only processes events on the main thread, which from here on does nothing else
+	context.renderThreaded = true;
+	std::thread render(renderLoop);
+
+	while (!glfwWindowShouldClose(context.window)) {
+		glfwWaitEvents();
+	}
+	// Don't leave the render thread asleep waiting for input that won't come
+	markFrameDirty(context);
+
+	render.join();
+	context.renderThreaded = false;
+}
+
+//----------------------------> Render graph
+uint32_t addGraphImage(struct LHRenderGraph& graph, std::string name, VkFormat format, uint32_t width, uint32_t height) {
+	LHGraphImage image = {};
+	image.name = name;
+	image.format = format;
+	image.width = width;
+	image.height = height;
+	image.backbuffer = false;
+	image.image = VK_NULL_HANDLE;
+	image.view = VK_NULL_HANDLE;
+	image.firstUse = -1;
+	image.lastUse = -1;
+	graph.images.push_back(image);
+	return (uint32_t)graph.images.size() - 1;
+}
+
+uint32_t addGraphBackbuffer(struct LHRenderGraph& graph) {
+	// The format is taken from the swap chain once the graph is compiled
+	uint32_t image = addGraphImage(graph, "backbuffer", VK_FORMAT_UNDEFINED);
+	graph.images[image].backbuffer = true;
+	return image;
+}
+
+uint32_t addGraphPass(struct LHRenderGraph& graph, std::string name, LHGraphRecordFunc record) {
+	LHGraphPass pass = {};
+	pass.name = name;
+	pass.record = record;
+	pass.culled = false;
+	pass.renderPass = VK_NULL_HANDLE;
+	graph.passes.push_back(pass);
+	return (uint32_t)graph.passes.size() - 1;
+}
+
+void graphWriteColor(struct LHRenderGraph& graph, uint32_t pass, uint32_t image, VkClearValue clear) {
+	graph.passes[pass].writes.push_back({ image, LH_GRAPH_COLOR_WRITE, clear });
+}
+
+void graphWriteDepth(struct LHRenderGraph& graph, uint32_t pass, uint32_t image, VkClearValue clear) {
+	graph.passes[pass].writes.push_back({ image, LH_GRAPH_DEPTH_WRITE, clear });
+}
+
+void graphRead(struct LHRenderGraph& graph, uint32_t pass, uint32_t image) {
+	graph.passes[pass].reads.push_back(image);
+}
+
+static bool isDepthFormat(VkFormat format) {
+	return format == VK_FORMAT_D16_UNORM || format == VK_FORMAT_X8_D24_UNORM_PACK32 || format == VK_FORMAT_D32_SFLOAT ||
+		format == VK_FORMAT_D16_UNORM_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT || format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+}
+
+static LHGraphUsage graphPassUsage(const LHGraphPass& pass, uint32_t image) {
+	for (auto& write : pass.writes) {
+		if (write.image == image) {
+			return write.usage;
+		}
+	}
+	for (uint32_t read : pass.reads) {
+		if (read == image) {
+			return LH_GRAPH_SAMPLED_READ;
+		}
+	}
+	return LH_GRAPH_UNUSED;
+}
+
+// Usage of an image by the pass at a position in the execution order
+static LHGraphUsage graphUsageAt(const LHRenderGraph& graph, int32_t position, uint32_t image) {
+	if (position < 0 || position >= (int32_t)graph.order.size()) {
+		return LH_GRAPH_UNUSED;
+	}
+	return graphPassUsage(graph.passes[graph.order[position]], image);
+}
+
+static void graphUsageScope(LHGraphUsage usage, VkPipelineStageFlags& stages, VkAccessFlags& access) {
+	switch (usage) {
+	case LH_GRAPH_COLOR_WRITE:
+		stages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		access = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		break;
+	case LH_GRAPH_DEPTH_WRITE:
+		stages = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+		access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		break;
+	case LH_GRAPH_SAMPLED_READ:
+		stages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		access = VK_ACCESS_SHADER_READ_BIT;
+		break;
+	default:
+		stages = 0;
+		access = 0;
+	}
+}
+
+static VkImageLayout graphUsageLayout(const LHGraphImage& image, LHGraphUsage usage) {
+	switch (usage) {
+	case LH_GRAPH_COLOR_WRITE:
+		return VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	case LH_GRAPH_DEPTH_WRITE:
+		return VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	case LH_GRAPH_SAMPLED_READ:
+		return isDepthFormat(image.format) ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	default:
+		return VK_IMAGE_LAYOUT_UNDEFINED;
+	}
+}
+
+// One render pass per graph pass. Load and store ops, layouts and the dependencies with the passes
+// around it follow from how the images are used before and after it
+static void createGraphRenderPass(struct LHContext& context, struct LHRenderGraph& graph, int32_t position) {
+	VkResult U_ASSERT_ONLY res;
+	LHGraphPass& pass = graph.passes[graph.order[position]];
+	const VkAccessFlags writeAccess = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+	std::vector<VkAttachmentDescription> attachments;
+	std::vector<VkAttachmentReference> colorReferences;
+	VkAttachmentReference depthReference = {};
+	bool hasDepth = false;
+	pass.clearValues.clear();
+
+	for (auto& write : pass.writes) {
+		LHGraphImage& image = graph.images[write.image];
+		LHGraphUsage previous = LH_GRAPH_UNUSED;
+		LHGraphUsage next = LH_GRAPH_UNUSED;
+		for (int32_t p = position - 1; p >= image.firstUse && previous == LH_GRAPH_UNUSED; p--) {
+			previous = graphUsageAt(graph, p, write.image);
+		}
+		for (int32_t p = position + 1; p <= image.lastUse && next == LH_GRAPH_UNUSED; p++) {
+			next = graphUsageAt(graph, p, write.image);
+		}
+
+		VkAttachmentDescription attachment = {};
+		attachment.format = image.format;
+		attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+		// The first writer in the frame clears, later writers keep what's there
+		attachment.loadOp = (previous == LH_GRAPH_UNUSED) ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD;
+		// Only stored when a later pass or the presentation engine looks at it
+		attachment.storeOp = (next != LH_GRAPH_UNUSED || image.backbuffer) ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachment.initialLayout = graphUsageLayout(image, previous);
+		if (next != LH_GRAPH_UNUSED) {
+			attachment.finalLayout = graphUsageLayout(image, next);
+		}
+		else if (image.backbuffer) {
+			attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		}
+		else {
+			attachment.finalLayout = graphUsageLayout(image, write.usage);
+		}
+
+		VkAttachmentReference reference = {};
+		reference.attachment = (uint32_t)attachments.size();
+		reference.layout = graphUsageLayout(image, write.usage);
+		if (write.usage == LH_GRAPH_DEPTH_WRITE) {
+			depthReference = reference;
+			hasDepth = true;
+		}
+		else {
+			colorReferences.push_back(reference);
+		}
+		attachments.push_back(attachment);
+		pass.clearValues.push_back(write.clear);
+	}
+
+	VkSubpassDescription subpass = {};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = (uint32_t)colorReferences.size();
+	subpass.pColorAttachments = colorReferences.empty() ? nullptr : colorReferences.data();
+	subpass.pDepthStencilAttachment = hasDepth ? &depthReference : nullptr;
+
+	// Incoming, everything that happened to the images of this pass before it. Outgoing, images a later
+	// pass samples. Sampling reads other pixels than were written, those can't be by region
+	VkSubpassDependency incoming = {};
+	incoming.srcSubpass = VK_SUBPASS_EXTERNAL;
+	incoming.dstSubpass = 0;
+	incoming.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+	VkSubpassDependency outgoing = {};
+	outgoing.srcSubpass = 0;
+	outgoing.dstSubpass = VK_SUBPASS_EXTERNAL;
+	outgoing.dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+	for (uint32_t i = 0; i < graph.images.size(); i++) {
+		LHGraphImage& image = graph.images[i];
+		LHGraphUsage usage = graphUsageAt(graph, position, i);
+		if (usage == LH_GRAPH_UNUSED) {
+			continue;
+		}
+		VkPipelineStageFlags stages;
+		VkAccessFlags access;
+		graphUsageScope(usage, stages, access);
+
+		std::vector<LHGraphUsage> previous;
+		bool hazard = false;
+		if (image.firstUse < position) {
+			// A read after a write was made visible by the writer's outgoing dependency, reads after reads don't conflict
+			if (usage != LH_GRAPH_SAMPLED_READ) {
+				LHGraphUsage last = LH_GRAPH_UNUSED;
+				for (int32_t p = position - 1; p >= 0 && last == LH_GRAPH_UNUSED; p--) {
+					last = graphUsageAt(graph, p, i);
+				}
+				previous.push_back(last);
+			}
+		}
+		else if (image.backbuffer) {
+			// Handed over by the acquire semaphore, which is waited on at the color output stage
+			incoming.srcStageMask |= VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+			hazard = true;
+		}
+		else {
+			// First use in the frame, the previous frame used this image and every image it may share memory with
+			for (uint32_t j = 0; j < graph.images.size(); j++) {
+				LHGraphImage& other = graph.images[j];
+				if (other.backbuffer || other.firstUse < 0) {
+					continue;
+				}
+				if (j == i || other.lastUse < image.firstUse || other.firstUse > image.lastUse) {
+					for (int32_t p = other.firstUse; p <= other.lastUse; p++) {
+						LHGraphUsage use = graphUsageAt(graph, p, j);
+						if (use != LH_GRAPH_UNUSED) {
+							previous.push_back(use);
+						}
+					}
+				}
+			}
+		}
+		for (LHGraphUsage last : previous) {
+			VkPipelineStageFlags srcStages;
+			VkAccessFlags srcAccess;
+			graphUsageScope(last, srcStages, srcAccess);
+			// Reads only have to be finished, writes also have to be made available
+			incoming.srcStageMask |= srcStages;
+			incoming.srcAccessMask |= srcAccess & writeAccess;
+			if (last == LH_GRAPH_SAMPLED_READ || usage == LH_GRAPH_SAMPLED_READ) {
+				incoming.dependencyFlags = 0;
+			}
+			hazard = true;
+		}
+		if (hazard) {
+			incoming.dstStageMask |= stages;
+			incoming.dstAccessMask |= access;
+		}
+
+		if (usage == LH_GRAPH_SAMPLED_READ) {
+			continue;
+		}
+		LHGraphUsage next = LH_GRAPH_UNUSED;
+		for (int32_t p = position + 1; p <= image.lastUse && next == LH_GRAPH_UNUSED; p++) {
+			next = graphUsageAt(graph, p, i);
+		}
+		if (next == LH_GRAPH_SAMPLED_READ) {
+			VkPipelineStageFlags dstStages;
+			VkAccessFlags dstAccess;
+			graphUsageScope(next, dstStages, dstAccess);
+			outgoing.srcStageMask |= stages;
+			outgoing.srcAccessMask |= access & writeAccess;
+			outgoing.dstStageMask |= dstStages;
+			outgoing.dstAccessMask |= dstAccess;
+			outgoing.dependencyFlags = 0;
+		}
+		else if (next == LH_GRAPH_UNUSED && image.backbuffer) {
+			// Presented after this pass
+			outgoing.srcStageMask |= stages;
+			outgoing.srcAccessMask |= access & writeAccess;
+			outgoing.dstStageMask |= VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+		}
+	}
+
+	std::vector<VkSubpassDependency> dependencies;
+	if (incoming.srcStageMask != 0) {
+		dependencies.push_back(incoming);
+	}
+	if (outgoing.srcStageMask != 0) {
+		dependencies.push_back(outgoing);
+	}
+
+	VkRenderPassCreateInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = (uint32_t)attachments.size();
+	renderPassInfo.pAttachments = attachments.data();
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+	renderPassInfo.dependencyCount = (uint32_t)dependencies.size();
+	renderPassInfo.pDependencies = dependencies.empty() ? nullptr : dependencies.data();
+
+	res = vkCreateRenderPass(context.device, &renderPassInfo, nullptr, &pass.renderPass);
+	assert(res == VK_SUCCESS);
+}
+
+// Creates either the fixed size images or the ones following the swap chain. Images are placed in the
+// memory of an earlier image whose last use comes before their first
+static void createGraphImages(struct LHContext& context, struct LHRenderGraph& graph, bool swapChainSized) {
+	VkResult U_ASSERT_ONLY res;
+
+	std::vector<uint32_t> images;
+	for (uint32_t i = 0; i < graph.images.size(); i++) {
+		LHGraphImage& image = graph.images[i];
+		if (!image.backbuffer && image.firstUse >= 0 && (image.width == 0) == swapChainSized) {
+			images.push_back(i);
+		}
+	}
+	std::sort(images.begin(), images.end(), [&](uint32_t a, uint32_t b) {
+		return graph.images[a].firstUse < graph.images[b].firstUse;
+	});
+
+	struct MemoryGroup {
+		VkMemoryRequirements requirements;
+		int32_t lastUse;
+		std::vector<uint32_t> images;
+	};
+	std::vector<MemoryGroup> groups;
+
+	for (uint32_t i : images) {
+		LHGraphImage& image = graph.images[i];
+		bool depth = isDepthFormat(image.format);
+
+		// An image no pass samples never has to leave the tile memory of tiled GPUs
+		bool sampled = false;
+		for (int32_t p = image.firstUse; p <= image.lastUse; p++) {
+			sampled |= graphUsageAt(graph, p, i) == LH_GRAPH_SAMPLED_READ;
+		}
+
+		VkImageCreateInfo imageInfo = {};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.format = image.format;
+		imageInfo.extent.width = swapChainSized ? context.width : image.width;
+		imageInfo.extent.height = swapChainSized ? context.height : image.height;
+		imageInfo.extent.depth = 1;
+		imageInfo.mipLevels = 1;
+		imageInfo.arrayLayers = 1;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.usage = depth ? VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT : VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+		imageInfo.usage |= sampled ? VK_IMAGE_USAGE_SAMPLED_BIT : VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT;
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		res = vkCreateImage(context.device, &imageInfo, nullptr, &image.image);
+		assert(res == VK_SUCCESS);
+
+		VkMemoryRequirements memReqs;
+		vkGetImageMemoryRequirements(context.device, image.image, &memReqs);
+		MemoryGroup* group = nullptr;
+		for (auto& candidate : groups) {
+			if (candidate.lastUse < image.firstUse && (candidate.requirements.memoryTypeBits & memReqs.memoryTypeBits) != 0) {
+				group = &candidate;
+				break;
+			}
+		}
+		if (group == nullptr) {
+			groups.push_back({ memReqs, -1, {} });
+			group = &groups.back();
+		}
+		else {
+			group->requirements.size = std::max(group->requirements.size, memReqs.size);
+			group->requirements.alignment = std::max(group->requirements.alignment, memReqs.alignment);
+			group->requirements.memoryTypeBits &= memReqs.memoryTypeBits;
+		}
+		group->lastUse = image.lastUse;
+		group->images.push_back(i);
+	}
+
+	for (auto& group : groups) {
+		LHGraphMemory memory = {};
+		memory.swapChainSized = swapChainSized;
+		res = allocateMemory(context, group.requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true, false, memory.allocation);
+		assert(res == VK_SUCCESS);
+
+		for (uint32_t i : group.images) {
+			LHGraphImage& image = graph.images[i];
+			res = vkBindImageMemory(context.device, image.image, memory.allocation.memory, memory.allocation.offset);
+			assert(res == VK_SUCCESS);
+
+			VkImageViewCreateInfo viewInfo = {};
+			viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+			viewInfo.image = image.image;
+			viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+			viewInfo.format = image.format;
+			viewInfo.subresourceRange.aspectMask = isDepthFormat(image.format) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+			viewInfo.subresourceRange.baseMipLevel = 0;
+			viewInfo.subresourceRange.levelCount = 1;
+			viewInfo.subresourceRange.baseArrayLayer = 0;
+			viewInfo.subresourceRange.layerCount = 1;
+			res = vkCreateImageView(context.device, &viewInfo, nullptr, &image.view);
+			assert(res == VK_SUCCESS);
+		}
+		graph.memory.push_back(memory);
+	}
+}
+
+static void destroyGraphImages(struct LHContext& context, struct LHRenderGraph& graph, bool swapChainSized) {
+	for (auto& image : graph.images) {
+		if (image.backbuffer || image.image == VK_NULL_HANDLE || (image.width == 0) != swapChainSized) {
+			continue;
+		}
+		vkDestroyImageView(context.device, image.view, nullptr);
+		vkDestroyImage(context.device, image.image, nullptr);
+		image.view = VK_NULL_HANDLE;
+		image.image = VK_NULL_HANDLE;
+	}
+	for (auto it = graph.memory.begin(); it != graph.memory.end();) {
+		if (it->swapChainSized == swapChainSized) {
+			freeAllocation(context, it->allocation);
+			it = graph.memory.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
+// Passes writing the backbuffer get a frame buffer per swap chain image
+static void createGraphFrameBuffers(struct LHContext& context, struct LHRenderGraph& graph) {
+	VkResult U_ASSERT_ONLY res;
+
+	for (uint32_t p : graph.order) {
+		LHGraphPass& pass = graph.passes[p];
+		bool perImage = false;
+		for (auto& write : pass.writes) {
+			perImage |= graph.images[write.image].backbuffer;
+		}
+		LHGraphImage& first = graph.images[pass.writes[0].image];
+		pass.width = first.width ? first.width : context.width;
+		pass.height = first.height ? first.height : context.height;
+
+		pass.frameBuffers.resize(perImage ? context.swapchainImageCount : 1);
+		for (uint32_t f = 0; f < pass.frameBuffers.size(); f++) {
+			std::vector<VkImageView> views;
+			for (auto& write : pass.writes) {
+				LHGraphImage& image = graph.images[write.image];
+				views.push_back(image.backbuffer ? context.buffers[f].view : image.view);
+			}
+
+			VkFramebufferCreateInfo frameBufferInfo = {};
+			frameBufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+			frameBufferInfo.renderPass = pass.renderPass;
+			frameBufferInfo.attachmentCount = (uint32_t)views.size();
+			frameBufferInfo.pAttachments = views.data();
+			frameBufferInfo.width = pass.width;
+			frameBufferInfo.height = pass.height;
+			frameBufferInfo.layers = 1;
+			res = vkCreateFramebuffer(context.device, &frameBufferInfo, nullptr, &pass.frameBuffers[f]);
+			assert(res == VK_SUCCESS);
+		}
+	}
+}
+
+static void destroyGraphFrameBuffers(struct LHContext& context, struct LHRenderGraph& graph) {
+	for (auto& pass : graph.passes) {
+		for (auto& frameBuffer : pass.frameBuffers) {
+			vkDestroyFramebuffer(context.device, frameBuffer, nullptr);
+		}
+		pass.frameBuffers.clear();
+	}
+}
+
+void compileRenderGraph(struct LHContext& context, struct LHRenderGraph& graph, uint32_t output) {
+	uint32_t passCount = (uint32_t)graph.passes.size();
+	graph.output = output;
+
+	for (auto& image : graph.images) {
+		if (image.backbuffer) {
+			image.format = context.format;
+		}
+	}
+	for (auto& pass : graph.passes) {
+		if (pass.writes.empty()) {
+			std::cout << "Render graph pass " << pass.name << " writes no attachment" << std::endl;
+			exit(-1);
+		}
+		for (uint32_t read : pass.reads) {
+			if (graphPassUsage(pass, read) != LH_GRAPH_SAMPLED_READ) {
+				std::cout << "Render graph pass " << pass.name << " samples " << graph.images[read].name << " while writing it" << std::endl;
+				exit(-1);
+			}
+		}
+	}
+
+	// Cull, a pass is only kept when it writes the output or an image a kept pass samples
+	std::vector<bool> needed(graph.images.size(), false);
+	needed[output] = true;
+	for (auto& pass : graph.passes) {
+		pass.culled = true;
+	}
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (auto& pass : graph.passes) {
+			if (!pass.culled) {
+				continue;
+			}
+			for (auto& write : pass.writes) {
+				if (needed[write.image]) {
+					pass.culled = false;
+				}
+			}
+			if (!pass.culled) {
+				for (uint32_t read : pass.reads) {
+					needed[read] = true;
+				}
+				changed = true;
+			}
+		}
+	}
+
+	// Order the kept passes. Writers of an image run in the order they were added, and a pass that
+	// samples an image runs after all of its writers
+	std::vector<std::vector<uint32_t>> successors(passCount);
+	std::vector<uint32_t> predecessors(passCount, 0);
+	uint32_t liveCount = 0;
+	for (uint32_t p = 0; p < passCount; p++) {
+		if (graph.passes[p].culled) {
+			continue;
+		}
+		liveCount++;
+		for (uint32_t q = 0; q < passCount; q++) {
+			if (q == p || graph.passes[q].culled) {
+				continue;
+			}
+			bool edge = false;
+			for (auto& write : graph.passes[p].writes) {
+				LHGraphUsage usage = graphPassUsage(graph.passes[q], write.image);
+				edge |= usage == LH_GRAPH_SAMPLED_READ || (usage != LH_GRAPH_UNUSED && p < q);
+			}
+			if (edge) {
+				successors[p].push_back(q);
+				predecessors[q]++;
+			}
+		}
+	}
+	// Of the passes that are ready, the one added first runs first
+	graph.order.clear();
+	std::vector<bool> scheduled(passCount, false);
+	for (uint32_t n = 0; n < liveCount; n++) {
+		for (uint32_t p = 0; p < passCount; p++) {
+			if (!graph.passes[p].culled && !scheduled[p] && predecessors[p] == 0) {
+				scheduled[p] = true;
+				graph.order.push_back(p);
+				for (uint32_t q : successors[p]) {
+					predecessors[q]--;
+				}
+				break;
+			}
+		}
+	}
+	if (graph.order.size() != liveCount) {
+		std::cout << "Render graph has a cycle, a pass samples an image it depends on writing" << std::endl;
+		exit(-1);
+	}
+
+	// Lifetimes, an image lives from its first to its last use in the frame
+	for (uint32_t i = 0; i < graph.images.size(); i++) {
+		LHGraphImage& image = graph.images[i];
+		image.firstUse = -1;
+		image.lastUse = -1;
+		for (int32_t position = 0; position < (int32_t)graph.order.size(); position++) {
+			if (graphUsageAt(graph, position, i) != LH_GRAPH_UNUSED) {
+				if (image.firstUse < 0) {
+					image.firstUse = position;
+				}
+				image.lastUse = position;
+			}
+		}
+		if (image.firstUse >= 0 && graphUsageAt(graph, image.firstUse, i) == LH_GRAPH_SAMPLED_READ) {
+			std::cout << "Render graph image " << image.name << " is sampled before any pass writes it" << std::endl;
+			exit(-1);
+		}
+		image.readLayout = graphUsageLayout(image, LH_GRAPH_SAMPLED_READ);
+	}
+
+	for (int32_t position = 0; position < (int32_t)graph.order.size(); position++) {
+		LHGraphPass& pass = graph.passes[graph.order[position]];
+		for (auto& write : pass.writes) {
+			LHGraphImage& image = graph.images[write.image];
+			LHGraphImage& first = graph.images[pass.writes[0].image];
+			if (image.width != first.width || image.height != first.height) {
+				std::cout << "Render graph pass " << pass.name << " writes attachments of different sizes" << std::endl;
+				exit(-1);
+			}
+		}
+		createGraphRenderPass(context, graph, position);
+	}
+	createGraphImages(context, graph, false);
+	createGraphImages(context, graph, true);
+	createGraphFrameBuffers(context, graph);
+	graph.compiled = true;
+
+	std::cout << "Render graph:";
+	for (uint32_t position = 0; position < graph.order.size(); position++) {
+		std::cout << (position ? " -> " : " ") << graph.passes[graph.order[position]].name;
+	}
+	std::cout << ", " << passCount - liveCount << " passes culled, " << graph.memory.size() << " allocations for transient images" << std::endl;
+}
+
+// Only the frame buffers and the images following the swap chain extent are recreated, the render
+// passes and the pipelines built against them stay valid
+void resizeRenderGraph(struct LHContext& context, struct LHRenderGraph& graph) {
+	destroyGraphFrameBuffers(context, graph);
+	destroyGraphImages(context, graph, true);
+	createGraphImages(context, graph, true);
+	createGraphFrameBuffers(context, graph);
+}
+
+void destroyRenderGraph(struct LHContext& context, struct LHRenderGraph& graph) {
+	destroyGraphFrameBuffers(context, graph);
+	destroyGraphImages(context, graph, false);
+	destroyGraphImages(context, graph, true);
+	for (auto& pass : graph.passes) {
+		vkDestroyRenderPass(context.device, pass.renderPass, nullptr);
+		pass.renderPass = VK_NULL_HANDLE;
+	}
+	graph.order.clear();
+	graph.compiled = false;
+}
+
+void beginGraphPass(struct LHContext& context, struct LHRenderGraph& graph, uint32_t pass, VkCommandBuffer cmd, uint32_t image, VkSubpassContents contents) {
+	LHGraphPass& graphPass = graph.passes[pass];
+
+	VkRenderPassBeginInfo renderPassBeginInfo = {};
+	renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderPassBeginInfo.renderPass = graphPass.renderPass;
+	renderPassBeginInfo.framebuffer = graphPass.frameBuffers[graphPass.frameBuffers.size() > 1 ? image : 0];
+	renderPassBeginInfo.renderArea.extent.width = graphPass.width;
+	renderPassBeginInfo.renderArea.extent.height = graphPass.height;
+	renderPassBeginInfo.clearValueCount = (uint32_t)graphPass.clearValues.size();
+	renderPassBeginInfo.pClearValues = graphPass.clearValues.data();
+
+	vkCmdBeginRenderPass(cmd, &renderPassBeginInfo, contents);
+}
+
+// For secondary command buffers recorded inside a graph pass
+VkCommandBufferInheritanceInfo graphInheritance(struct LHRenderGraph& graph, uint32_t pass, uint32_t image) {
+	LHGraphPass& graphPass = graph.passes[pass];
+
+	VkCommandBufferInheritanceInfo inheritance = {};
+	inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+	inheritance.pNext = nullptr;
+	inheritance.renderPass = graphPass.renderPass;
+	inheritance.subpass = 0;
+	inheritance.framebuffer = graphPass.frameBuffers[graphPass.frameBuffers.size() > 1 ? image : 0];
+	return inheritance;
+}
+
+// Records every live pass in order, each pass's callback fills its render pass
+void recordRenderGraph(struct LHContext& context, struct LHRenderGraph& graph, VkCommandBuffer cmd, uint32_t image, VkSubpassContents contents) {
+	for (uint32_t p : graph.order) {
+		beginGraphPass(context, graph, p, cmd, image, contents);
+		graph.passes[p].record(cmd, image, contents);
+		vkCmdEndRenderPass(cmd);
+	}
+}
+
+//----------------------------> SPIR-V cache
+// Entries are named by a hash of everything that decides the SPIR-V: the source text, the stage, the
+// optimizer preset, the device limits and the glslang version. An edited shader or a new compiler gets a new entry, stale ones are never read back
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+	// FNV-1a
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+// Field by field, the padding after the limits bools holds whatever was on the stack and would make
+// the same device hash differently from run to run
+static uint64_t hashShaderResources(uint64_t hash, const TBuiltInResource& resources) {
+	// The integer limits are contiguous ints up to the limits struct, so they carry no padding
+	hash = hashBytes(hash, &resources, offsetof(TBuiltInResource, limits));
+	bool limits[] = {
+		resources.limits.nonInductiveForLoops,
+		resources.limits.whileLoops,
+		resources.limits.doWhileLoops,
+		resources.limits.generalUniformIndexing,
+		resources.limits.generalAttributeMatrixVectorIndexing,
+		resources.limits.generalVaryingIndexing,
+		resources.limits.generalSamplerIndexing,
+		resources.limits.generalVariableIndexing,
+		resources.limits.generalConstantMatrixVectorIndexing,
+	};
+	return hashBytes(hash, limits, sizeof(limits));
+}
+
+static std::string shaderCachePath(struct LHContext& context, const std::string& source, VkShaderStageFlagBits stage) {
+	std::string version = glslang::GetGlslVersionString();
+	int generator = glslang::GetSpirvGeneratorVersion();
+	uint64_t hash = 14695981039346656037ull;
+	hash = hashBytes(hash, source.data(), source.size());
+	hash = hashBytes(hash, &stage, sizeof(stage));
+	hash = hashBytes(hash, &context.shaderOptimization, sizeof(context.shaderOptimization));
+	const TBuiltInResource* resources = deviceShaderResources(context);
+	if (resources) {
+		hash = hashShaderResources(hash, *resources);
+	}
+	hash = hashBytes(hash, version.data(), version.size());
+	hash = hashBytes(hash, &generator, sizeof(generator));
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.spv", (unsigned long long)hash);
+	return context.shaderCacheDir + "/" + name;
+}
+
+static bool loadCachedSpirv(const std::string& path, std::vector<unsigned int>& spirv) {
+	std::ifstream is(path, std::ios::binary | std::ios::ate);
+	if (!is) {
+		return false;
+	}
+	// A truncated or foreign file counts as a miss and is overwritten by the compile
+	std::streamsize size = is.tellg();
+	if (size < 20 || size % sizeof(unsigned int) != 0) {
+		return false;
+	}
+	spirv.resize((size_t)size / sizeof(unsigned int));
+	is.seekg(0);
+	if (!is.read((char*)spirv.data(), size) || spirv[0] != 0x07230203) {
+		spirv.clear();
+		return false;
+	}
+	return true;
+}
+
+// Written beside the file and renamed over it, so a crash or a second instance never leaves a partial file
+static bool writeCacheFile(struct LHContext& context, const std::string& path, const void* data, size_t size) {
+#if _WIN32
+	_mkdir(context.shaderCacheDir.c_str());
+#else
+	mkdir(context.shaderCacheDir.c_str(), 0755);
+#endif
+	std::string temp = path + "." + std::to_string(std::chrono::high_resolution_clock::now().time_since_epoch().count())
+		+ "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+	std::ofstream os(temp, std::ios::binary | std::ios::trunc);
+	if (!os) {
+		// Read-only location, everything is compiled every run
+		return false;
+	}
+	os.write((const char*)data, size);
+	os.close();
+	if (!os) {
+		std::remove(temp.c_str());
+		return false;
+	}
+#if _WIN32
+	bool moved = MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	bool moved = std::rename(temp.c_str(), path.c_str()) == 0;
+#endif
+	if (!moved) {
+		std::remove(temp.c_str());
+	}
+	return moved;
+}
+
+static void storeCachedSpirv(struct LHContext& context, const std::string& path, const std::vector<unsigned int>& spirv) {
+	writeCacheFile(context, path, spirv.data(), spirv.size() * sizeof(unsigned int));
+}
+
+//----------------------------> Pipeline cache on disk
+// One file per GPU and driver, named by everything that decides whether the driver can use the data
+static std::string pipelineCachePath(struct LHContext& context) {
+	const VkPhysicalDeviceProperties& properties = context.deviceProperties;
+	char name[96];
+	snprintf(name, sizeof(name), "pipelines-%04x-%04x-%08x-", properties.vendorID, properties.deviceID, properties.driverVersion);
+	std::string path = context.shaderCacheDir + "/" + name;
+	for (uint32_t i = 0; i < VK_UUID_SIZE; i++) {
+		snprintf(name, sizeof(name), "%02x", properties.pipelineCacheUUID[i]);
+		path += name;
+	}
+	return path + ".bin";
+}
+
+// The data starts with a header naming the GPU it came from (VkPipelineCacheHeaderVersionOne), which has to be
+// this one. Drivers are supposed to reject foreign data themselves, not all of them do
+static bool loadPipelineCacheData(struct LHContext& context, std::vector<char>& data) {
+	if (context.shaderCacheDir.empty()) {
+		return false;
+	}
+	std::ifstream is(pipelineCachePath(context), std::ios::binary | std::ios::ate);
+	if (!is) {
+		return false;
+	}
+	std::streamoff size = is.tellg();
+	const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+	if (size < (std::streamoff)headerSize) {
+		return false;
+	}
+	data.resize((size_t)size);
+	is.seekg(0, std::ios::beg);
+	is.read(data.data(), size);
+	if (!is) {
+		return false;
+	}
+
+	uint32_t header[4];
+	memcpy(header, data.data(), sizeof(header));
+	const VkPhysicalDeviceProperties& properties = context.deviceProperties;
+	bool valid = header[0] >= headerSize && header[0] <= data.size()
+		&& header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+		&& header[2] == properties.vendorID
+		&& header[3] == properties.deviceID
+		&& memcmp(data.data() + sizeof(header), properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+	if (!valid) {
+		std::cout << "Pipeline cache: ignoring " << pipelineCachePath(context) << ", it was written for another device" << std::endl;
+		data.clear();
+	}
+	return valid;
+}
+
+// Call once pipeline creation is over, vkGetPipelineCacheData must not overlap with it
+void savePipelineCache(struct LHContext& context) {
+	if (context.pipelineCache == VK_NULL_HANDLE || context.shaderCacheDir.empty()) {
+		return;
+	}
+	size_t size = 0;
+	if (vkGetPipelineCacheData(context.device, context.pipelineCache, &size, nullptr) != VK_SUCCESS || size == 0) {
+		return;
+	}
+	std::vector<char> data(size);
+	if (vkGetPipelineCacheData(context.device, context.pipelineCache, &size, data.data()) != VK_SUCCESS) {
+		return;
+	}
+	if (writeCacheFile(context, pipelineCachePath(context), data.data(), size)) {
+		context.pipelineCacheStats.savedBytes = size;
+		std::cout << "Pipeline cache: saved " << size << " bytes" << std::endl;
+	}
+}
+
+// Times the startup pipeline creation for printShaderCacheStats, including any shaders compiled along the way
+void timePipelineCreation(struct LHContext& context, const std::function<void()>& create) {
+	auto start = std::chrono::high_resolution_clock::now();
+	create();
+	context.pipelineCacheStats.createMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void printShaderCacheStats(struct LHContext& context) {
+	LHShaderCacheStats& stats = context.shaderCacheStats;
+	if (stats.hits + stats.misses > 0) {
+		std::cout << "Shader cache: " << stats.hits << " hits (" << stats.hitMs << " ms), "
+			<< stats.misses << " misses (" << stats.missMs << " ms compiling)" << std::endl;
+		if (stats.batchThreads > 0) {
+			std::cout << "  batches took " << stats.batchMs << " ms on up to " << stats.batchThreads << " threads" << std::endl;
+		}
+		if (stats.optimized.bytesBefore > 0) {
+			std::cout << "  optimizer took the misses from " << stats.optimized.instructionsBefore << " to " << stats.optimized.instructionsAfter
+				<< " instructions, " << stats.optimized.bytesBefore << " to " << stats.optimized.bytesAfter << " bytes" << std::endl;
+		}
+	}
+	if (stats.embedded > 0) {
+		// Against the figures above, the startup cost of compiling GLSL at runtime
+		std::cout << "Build-time SPIR-V: " << stats.embedded << " modules (" << stats.embeddedMs << " ms)" << std::endl;
+	}
+	LHPipelineCacheStats& pipelines = context.pipelineCacheStats;
+	if (pipelines.createMs >= 0.0) {
+		// Run twice to compare, the second run starts from what the first one saved
+		std::cout << "Pipeline cache: " << (pipelines.warm ? "warm start from " + std::to_string(pipelines.loadedBytes) + " bytes" : std::string("cold start"))
+			<< ", pipelines created in " << pipelines.createMs << " ms" << std::endl;
+	}
+	LHPipelineRegistry& registry = context.pipelineRegistry;
+	if (registry.requests > 0) {
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		std::cout << "Pipeline registry: " << registry.requests << " requests, " << registry.hits << " reused ("
+			<< (100 * registry.hits / registry.requests) << "%), " << registry.pipelines.size() << " pipelines" << std::endl;
+	}
+	LHPipelineLibraries& libraries = context.pipelineLibraries;
+	if (libraries.links > 0) {
+		std::lock_guard<std::mutex> lock(libraries.mutex);
+		uint32_t optimized = 0;
+		for (auto& linked : libraries.linked) {
+			optimized += linked.optimized.valid() && pipelineReady(linked.optimized) ? 1 : 0;
+		}
+		std::cout << "Pipeline libraries: " << libraries.links << " links (" << libraries.linkMs << " ms), " << libraries.built << " of "
+			<< libraries.requests << " parts compiled, " << optimized << " relinked with optimization" << std::endl;
+	}
+	LHLayoutCache& layouts = context.layoutCache;
+	if (layouts.requests > 0) {
+		std::cout << "Reflected layouts: " << layouts.requests << " pipeline layouts asked for, " << layouts.pipelineLayouts.size()
+			<< " created with " << layouts.setLayouts.size() << " descriptor set layouts" << std::endl;
+	}
+}
+
+//----------------------------> Parallel shader compilation
+// Stages are independent, so worker threads take the next uncompiled one until none are left.
+// The stages come back in the order of the sources, a stage whose file is missing has no module
+std::vector<VkPipelineShaderStageCreateInfo> createShaderStages(struct LHContext& context, const std::vector<LHShaderSource>& shaders, uint32_t threadCount) {
+	std::vector<VkPipelineShaderStageCreateInfo> stages(shaders.size());
+	if (shaders.empty()) {
+		return stages;
+	}
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	threadCount = std::min(threadCount, (uint32_t)shaders.size());
+
+	auto start = std::chrono::high_resolution_clock::now();
+	// Take the process reference first, so the workers dropping theirs never tears glslang down
+	init_glslang();
+
+	std::atomic<uint32_t> next{ 0 };
+	std::mutex statsMutex;
+	auto compile = [&](bool worker) {
+		// glslang sets up its per thread pool allocator in InitializeProcess, the call is reference counted
+		if (worker) {
+			glslang::InitializeProcess();
+		}
+		LHShaderCacheStats stats;
+		for (uint32_t i = next++; i < shaders.size(); i = next++) {
+			compileShaderStage(context, shaders[i].filename, shaders[i].stage, stages[i], stats);
+		}
+		if (worker) {
+			glslang::FinalizeProcess();
+		}
+
+		std::lock_guard<std::mutex> lock(statsMutex);
+		context.shaderCacheStats.hits += stats.hits;
+		context.shaderCacheStats.misses += stats.misses;
+		context.shaderCacheStats.hitMs += stats.hitMs;
+		context.shaderCacheStats.missMs += stats.missMs;
+		context.shaderCacheStats.optimized.instructionsBefore += stats.optimized.instructionsBefore;
+		context.shaderCacheStats.optimized.instructionsAfter += stats.optimized.instructionsAfter;
+		context.shaderCacheStats.optimized.bytesBefore += stats.optimized.bytesBefore;
+		context.shaderCacheStats.optimized.bytesAfter += stats.optimized.bytesAfter;
+	};
+
+	// The calling thread compiles its share too
+	std::vector<std::thread> threads;
+	for (uint32_t i = 1; i < threadCount; i++) {
+		threads.push_back(std::thread(compile, true));
+	}
+	compile(false);
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	context.shaderCacheStats.batchMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	context.shaderCacheStats.batchThreads = std::max(context.shaderCacheStats.batchThreads, threadCount);
+	return stages;
+}
+
+//----------------------------> Build-time shaders
+VkShaderModule loadSPIRVShader(struct LHContext& context, const uint32_t* code, size_t codeSize) {
+	VkResult U_ASSERT_ONLY res;
+	assert(codeSize > 0 && codeSize % sizeof(uint32_t) == 0 && code[0] == 0x07230203);
+
+	// The words stay in the executable's read only data, Vulkan copies what it needs
+	VkShaderModuleCreateInfo moduleCreateInfo = {};
+	moduleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleCreateInfo.pNext = NULL;
+	moduleCreateInfo.flags = 0;
+	moduleCreateInfo.codeSize = codeSize;
+	moduleCreateInfo.pCode = code;
+
+	VkShaderModule shaderModule;
+	res = vkCreateShaderModule(context.device, &moduleCreateInfo, NULL, &shaderModule);
+	assert(res == VK_SUCCESS);
+	return shaderModule;
+}
+
+void createShaderStage(struct LHContext& context, const uint32_t* code, size_t codeSize, VkShaderStageFlagBits flag, VkPipelineShaderStageCreateInfo& shaderStage) {
+	auto start = std::chrono::high_resolution_clock::now();
+
+	shaderStage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStage.pNext = NULL;
+	shaderStage.pSpecializationInfo = NULL;
+	shaderStage.flags = 0;
+	shaderStage.stage = flag;
+	shaderStage.pName = "main";
+	shaderStage.module = loadSPIRVShader(context, code, codeSize);
+	recordShaderReflection(context, shaderStage.module, flag, code, codeSize);
+
+	context.shaderCacheStats.embedded++;
+	context.shaderCacheStats.embeddedMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+//----------------------------> Shader hot reload
+// A thread watches the shader directory. When a file is written it compiles just that file, rebuilds
+// the pipelines using it through the pipeline cache and hands them to the frame loop, which swaps them in
+// between frames. The pipelines they replace are destroyed once the timeline shows their frames are done,
+// so nothing waits for the device
+static void unregisterPipeline(struct LHContext& context, VkPipeline pipeline);
+static bool linkedPipeline(struct LHContext& context, VkPipeline pipeline);
+
+static std::string shaderFileName(const std::string& filename) {
+	size_t slash = filename.find_last_of("/\\");
+	return slash == std::string::npos ? filename : filename.substr(slash + 1);
+}
+
+static time_t shaderModifiedTime(const std::string& path) {
+	struct stat info;
+	return stat(path.c_str(), &info) == 0 ? info.st_mtime : 0;
+}
+
+// Waits up to timeoutMs and adds the names of the files written in the meantime
+static void waitShaderChanges(LHShaderReloader& reloader, std::set<std::string>& changed, int timeoutMs) {
+#ifdef __linux__
+	pollfd fd = { reloader.notify, POLLIN, 0 };
+	if (poll(&fd, 1, timeoutMs) <= 0) {
+		return;
+	}
+	// Events are packed back to back, each followed by its name
+	alignas(inotify_event) char buffer[4096];
+	ssize_t size;
+	while ((size = read(reloader.notify, buffer, sizeof(buffer))) > 0) {
+		for (char* p = buffer; p < buffer + size; p += sizeof(inotify_event) + ((inotify_event*)p)->len) {
+			inotify_event* event = (inotify_event*)p;
+			if (event->len > 0) {
+				changed.insert(event->name);
+			}
+		}
+	}
+#else
+	// No change notification, the modification times of the watched files are polled instead
+	std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+	std::lock_guard<std::mutex> lock(reloader.mutex);
+	for (auto& shader : reloader.shaders) {
+		time_t modified = shaderModifiedTime(reloader.directory + "/" + shader.first);
+		if (modified != shader.second.modified) {
+			shader.second.modified = modified;
+			changed.insert(shader.first);
+		}
+	}
+#endif
+}
+
+// A shader that fails to compile keeps its previous module, glslang has printed why
+static VkShaderModule compileReloadedShader(struct LHContext& context, const std::string& path, VkShaderStageFlagBits stage) {
+	VkResult U_ASSERT_ONLY res;
+
+	std::ifstream is(path);
+	std::string source((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+	std::vector<unsigned int> spirv;
+	if (source.empty() || !GLSLtoSPV(stage, source.c_str(), spirv, context.shaderOptimization, nullptr, deviceShaderResources(context))) {
+		std::cout << "Shader reload: " << path << " did not compile, keeping the previous version" << std::endl;
+		return VK_NULL_HANDLE;
+	}
+
+	VkShaderModuleCreateInfo moduleCreateInfo = {};
+	moduleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleCreateInfo.pNext = NULL;
+	moduleCreateInfo.flags = 0;
+	moduleCreateInfo.codeSize = spirv.size() * sizeof(unsigned int);
+	moduleCreateInfo.pCode = spirv.data();
+
+	VkShaderModule module;
+	res = vkCreateShaderModule(context.device, &moduleCreateInfo, NULL, &module);
+	assert(res == VK_SUCCESS);
+	recordShaderReflection(context, module, stage, spirv.data(), moduleCreateInfo.codeSize);
+	return module;
+}
+
+static void reloadShader(struct LHContext& context, const std::string& name) {
+	LHShaderReloader& reloader = *context.shaderReloader;
+	auto start = std::chrono::high_resolution_clock::now();
+
+	VkShaderStageFlagBits stage;
+	{
+		std::lock_guard<std::mutex> lock(reloader.mutex);
+		auto shader = reloader.shaders.find(name);
+		if (shader == reloader.shaders.end()) {
+			// Not used by a watched pipeline
+			return;
+		}
+		stage = shader->second.stage;
+	}
+	VkShaderModule module = compileReloadedShader(context, reloader.directory + "/" + name, stage);
+	if (module == VK_NULL_HANDLE) {
+		return;
+	}
+
+	// Only the pipelines using the file are rebuilt, their other stages keep their current modules
+	std::vector<std::pair<LHReloadPipeline, std::vector<VkPipelineShaderStageCreateInfo>>> affected;
+	VkShaderModule old;
+	{
+		std::lock_guard<std::mutex> lock(reloader.mutex);
+		old = reloader.shaders[name].module;
+		reloader.shaders[name].module = module;
+		for (auto& pipeline : reloader.pipelines) {
+			bool uses = false;
+			std::vector<VkPipelineShaderStageCreateInfo> stages;
+			for (auto& source : pipeline.sources) {
+				std::string sourceName = shaderFileName(source.filename);
+				uses |= sourceName == name;
+
+				VkPipelineShaderStageCreateInfo info = {};
+				info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+				info.pNext = NULL;
+				info.flags = 0;
+				info.stage = source.stage;
+				info.module = reloader.shaders[sourceName].module;
+				info.pName = "main";
+				stages.push_back(info);
+			}
+			if (uses) {
+				affected.push_back({ pipeline, stages });
+			}
+		}
+	}
+
+	for (auto& pipeline : affected) {
+		VkPipeline rebuilt = pipeline.first.build(pipeline.second);
+		std::lock_guard<std::mutex> lock(reloader.mutex);
+		reloader.ready.push_back({ pipeline.first.pipeline, rebuilt });
+	}
+
+	// Permutations not built yet are made from the new module. One being built right now may still
+	// read the old module, it is waited for before the module goes
+	std::vector<LHPipelinePermutations*> permutationSets;
+	{
+		std::lock_guard<std::mutex> lock(reloader.mutex);
+		permutationSets = reloader.permutations;
+	}
+	std::vector<std::shared_future<VkPipeline>> building;
+	for (auto permutations : permutationSets) {
+		std::lock_guard<std::mutex> lock(permutations->mutex);
+		for (auto& stage : permutations->stages) {
+			if (stage.module == old) {
+				stage.module = module;
+			}
+		}
+		for (auto& pending : permutations->building) {
+			building.push_back(pending.second);
+		}
+	}
+	for (auto& pending : building) {
+		pending.wait();
+	}
+	// Pipelines keep working after the module they were made from is destroyed
+	vkDestroyShaderModule(context.device, old, nullptr);
+
+	std::cout << "Shader reload: " << name << " rebuilt " << affected.size() << " pipelines in "
+		<< std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms" << std::endl;
+	// Wake a frame loop sleeping in render-on-demand mode
+	markFrameDirty(context);
+	if (!context.renderThreaded) {
+		glfwPostEmptyEvent();
+	}
+}
+
+static void shaderReloadLoop(struct LHContext* context) {
+	LHShaderReloader* reloader = context->shaderReloader;
+
+	// glslang's per thread state, the process reference taken by init_glslang() outlives this one
+	glslang::InitializeProcess();
+	while (!reloader->quit) {
+		std::set<std::string> changed;
+		waitShaderChanges(*reloader, changed, 250);
+		if (changed.empty()) {
+			continue;
+		}
+		// Editors save in several steps, give them a moment and fold the events together
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		waitShaderChanges(*reloader, changed, 0);
+		for (auto& name : changed) {
+			reloadShader(*context, name);
+		}
+	}
+	glslang::FinalizeProcess();
+}
+
+void createShaderReloader(struct LHContext& context, const std::string& directory) {
+	init_glslang();
+	context.shaderReloader = new LHShaderReloader();
+	LHShaderReloader* reloader = context.shaderReloader;
+	reloader->directory = directory;
+
+#ifdef __linux__
+	// Editors often write a temporary file and rename it over the shader, so a rename counts as a write
+	reloader->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (reloader->notify < 0 || inotify_add_watch(reloader->notify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		std::cout << "Shader reload: cannot watch " << directory << std::endl;
+		return;
+	}
+#endif
+	reloader->thread = std::thread(shaderReloadLoop, &context);
+}
+
+void destroyShaderReloader(struct LHContext& context) {
+	LHShaderReloader* reloader = context.shaderReloader;
+	if (reloader == nullptr) {
+		return;
+	}
+
+	reloader->quit = true;
+	if (reloader->thread.joinable()) {
+		reloader->thread.join();
+	}
+#ifdef __linux__
+	if (reloader->notify >= 0) {
+		close(reloader->notify);
+	}
+#endif
+
+	// Called once the device is idle
+	for (auto& swap : reloader->ready) {
+		unregisterPipeline(context, swap.second);
+		vkDestroyPipeline(context.device, swap.second, nullptr);
+	}
+	for (auto& old : reloader->retired) {
+		vkDestroyPipeline(context.device, old.pipeline, nullptr);
+	}
+	// Whoever held a rebuilt pipeline is left with VK_NULL_HANDLE and must not destroy it again.
+	// Linked ones stay with the pipeline libraries
+	for (auto pipeline : reloader->replaced) {
+		if (!linkedPipeline(context, *pipeline)) {
+			vkDestroyPipeline(context.device, *pipeline, nullptr);
+		}
+		*pipeline = VK_NULL_HANDLE;
+	}
+	for (auto& shader : reloader->shaders) {
+		vkDestroyShaderModule(context.device, shader.second.module, nullptr);
+	}
+	delete reloader;
+	context.shaderReloader = nullptr;
+}
+
+// The reloader takes over the stages' modules. Stages made from the same file have to share its module
+void watchPipeline(struct LHContext& context, VkPipeline& pipeline, const std::vector<LHShaderSource>& sources,
+	const std::vector<VkPipelineShaderStageCreateInfo>& stages, LHPipelineBuild build) {
+	LHShaderReloader* reloader = context.shaderReloader;
+	assert(reloader != nullptr && sources.size() == stages.size());
+
+	std::lock_guard<std::mutex> lock(reloader->mutex);
+	for (size_t i = 0; i < sources.size(); i++) {
+		std::string name = shaderFileName(sources[i].filename);
+		if (reloader->shaders.count(name) == 0) {
+			LHReloadShader shader;
+			shader.stage = sources[i].stage;
+			shader.module = stages[i].module;
+			shader.modified = shaderModifiedTime(reloader->directory + "/" + name);
+			reloader->shaders[name] = shader;
+		}
+	}
+	LHReloadPipeline watched;
+	watched.pipeline = &pipeline;
+	watched.sources = sources;
+	watched.build = build;
+	reloader->pipelines.push_back(watched);
+}
+
+// Keys built after a reload use the reloaded modules. The permutation stages' modules must be ones the
+// reloader has taken over through watchPipeline()
+void watchPipelinePermutations(struct LHContext& context, struct LHPipelinePermutations& permutations) {
+	LHShaderReloader* reloader = context.shaderReloader;
+	assert(reloader != nullptr);
+
+	std::lock_guard<std::mutex> lock(reloader->mutex);
+	if (std::find(reloader->permutations.begin(), reloader->permutations.end(), &permutations) == reloader->permutations.end()) {
+		reloader->permutations.push_back(&permutations);
+	}
+}
+
+// Called by the frame loop between frames, returns true when pipelines were replaced so
+// command buffers recorded ahead of time can be recorded again
+bool applyShaderReloads(struct LHContext& context) {
+	LHShaderReloader* reloader = context.shaderReloader;
+	if (reloader == nullptr) {
+		return false;
+	}
+
+	auto done = std::remove_if(reloader->retired.begin(), reloader->retired.end(), [&](const LHRetiredPipeline& old) {
+		if (!timelineReached(context, old.timelineValue)) {
+			return false;
+		}
+		vkDestroyPipeline(context.device, old.pipeline, nullptr);
+		return true;
+	});
+	reloader->retired.erase(done, reloader->retired.end());
+
+	std::vector<std::pair<VkPipeline*, VkPipeline>> ready;
+	{
+		std::lock_guard<std::mutex> lock(reloader->mutex);
+		ready.swap(reloader->ready);
+	}
+	// Frames submitted so far may still use the old pipelines
+	for (auto& swap : ready) {
+		LHRetiredPipeline old;
+		old.pipeline = *swap.first;
+		old.timelineValue = context.timelineValue;
+		reloader->retired.push_back(old);
+		unregisterPipeline(context, old.pipeline);
+		*swap.first = swap.second;
+		reloader->replaced.insert(swap.first);
+	}
+	if (ready.empty()) {
+		return false;
+	}
+	markFrameDirty(context);
+	return true;
+}
+
+//----------------------------> SPIR-V reflection
+// Just enough of the SPIR-V binary to find a module's interface: decorations, types and global variables.
+// Numbers from the SPIR-V specification
+enum {
+	LH_SPV_OP_TYPE_INT = 21,
+	LH_SPV_OP_TYPE_FLOAT = 22,
+	LH_SPV_OP_TYPE_VECTOR = 23,
+	LH_SPV_OP_TYPE_MATRIX = 24,
+	LH_SPV_OP_TYPE_IMAGE = 25,
+	LH_SPV_OP_TYPE_SAMPLER = 26,
+	LH_SPV_OP_TYPE_SAMPLED_IMAGE = 27,
+	LH_SPV_OP_TYPE_ARRAY = 28,
+	LH_SPV_OP_TYPE_RUNTIME_ARRAY = 29,
+	LH_SPV_OP_TYPE_STRUCT = 30,
+	LH_SPV_OP_TYPE_POINTER = 32,
+	LH_SPV_OP_CONSTANT = 43,
+	LH_SPV_OP_SPEC_CONSTANT_TRUE = 48,
+	LH_SPV_OP_SPEC_CONSTANT_FALSE = 49,
+	LH_SPV_OP_SPEC_CONSTANT = 50,
+	LH_SPV_OP_VARIABLE = 59,
+	LH_SPV_OP_DECORATE = 71,
+	LH_SPV_OP_MEMBER_DECORATE = 72,
+
+	LH_SPV_DECORATION_SPEC_ID = 1,
+	LH_SPV_DECORATION_BUFFER_BLOCK = 3,
+	LH_SPV_DECORATION_ARRAY_STRIDE = 6,
+	LH_SPV_DECORATION_MATRIX_STRIDE = 7,
+	LH_SPV_DECORATION_BUILT_IN = 11,
+	LH_SPV_DECORATION_LOCATION = 30,
+	LH_SPV_DECORATION_BINDING = 33,
+	LH_SPV_DECORATION_DESCRIPTOR_SET = 34,
+	LH_SPV_DECORATION_OFFSET = 35,
+
+	LH_SPV_STORAGE_UNIFORM_CONSTANT = 0,
+	LH_SPV_STORAGE_INPUT = 1,
+	LH_SPV_STORAGE_UNIFORM = 2,
+	LH_SPV_STORAGE_PUSH_CONSTANT = 9,
+	LH_SPV_STORAGE_STORAGE_BUFFER = 12,
+
+	LH_SPV_DIM_BUFFER = 5,
+	LH_SPV_DIM_SUBPASS_DATA = 6,
+};
+
+struct LHSpirvModule {
+	std::vector<const uint32_t*> defs;												// Instruction defining each id, types, constants and variables
+	std::map<uint32_t, std::map<uint32_t, uint32_t>> decorations;					// id, decoration, first literal
+	std::map<std::pair<uint32_t, uint32_t>, std::map<uint32_t, uint32_t>> memberDecorations;
+	std::vector<const uint32_t*> variables;
+	std::vector<uint32_t> specConstants;											// Result ids
+};
+
+static bool parseSpirv(const uint32_t* code, size_t wordCount, LHSpirvModule& module) {
+	if (wordCount < 5 || code[0] != 0x07230203) {
+		return false;
+	}
+	module.defs.assign(code[3], nullptr);
+	// Every instruction starts with its word count in the high half and the opcode in the low half
+	for (size_t i = 5; i < wordCount;) {
+		const uint32_t* op = code + i;
+		uint32_t count = op[0] >> 16;
+		uint32_t opcode = op[0] & 0xffff;
+		if (count == 0 || i + count > wordCount) {
+			return false;
+		}
+		if (opcode == LH_SPV_OP_DECORATE && count >= 3) {
+			module.decorations[op[1]][op[2]] = count > 3 ? op[3] : 0;
+		}
+		else if (opcode == LH_SPV_OP_MEMBER_DECORATE && count >= 4) {
+			module.memberDecorations[{ op[1], op[2] }][op[3]] = count > 4 ? op[4] : 0;
+		}
+		else if (opcode >= LH_SPV_OP_TYPE_INT && opcode <= LH_SPV_OP_TYPE_POINTER && count >= 2 && op[1] < code[3]) {
+			module.defs[op[1]] = op;
+		}
+		else if ((opcode == LH_SPV_OP_CONSTANT || opcode == LH_SPV_OP_VARIABLE) && count >= 4 && op[2] < code[3]) {
+			module.defs[op[2]] = op;
+			if (opcode == LH_SPV_OP_VARIABLE) {
+				module.variables.push_back(op);
+			}
+		}
+		else if (opcode >= LH_SPV_OP_SPEC_CONSTANT_TRUE && opcode <= LH_SPV_OP_SPEC_CONSTANT && count >= 3) {
+			module.specConstants.push_back(op[2]);
+		}
+		i += count;
+	}
+	return true;
+}
+
+static const uint32_t* spirvDef(const LHSpirvModule& module, uint32_t id) {
+	return id < module.defs.size() ? module.defs[id] : nullptr;
+}
+
+static uint32_t spirvOpcode(const uint32_t* op) {
+	return op ? op[0] & 0xffff : 0;
+}
+
+static bool spirvDecorated(const LHSpirvModule& module, uint32_t id, uint32_t decoration, uint32_t* value = nullptr) {
+	auto decorations = module.decorations.find(id);
+	if (decorations == module.decorations.end()) {
+		return false;
+	}
+	auto found = decorations->second.find(decoration);
+	if (found == decorations->second.end()) {
+		return false;
+	}
+	if (value) {
+		*value = found->second;
+	}
+	return true;
+}
+
+static uint32_t spirvMemberDecoration(const LHSpirvModule& module, uint32_t id, uint32_t member, uint32_t decoration) {
+	auto decorations = module.memberDecorations.find({ id, member });
+	if (decorations == module.memberDecorations.end()) {
+		return 0;
+	}
+	auto found = decorations->second.find(decoration);
+	return found == decorations->second.end() ? 0 : found->second;
+}
+
+static uint32_t spirvArrayLength(const LHSpirvModule& module, const uint32_t* array) {
+	const uint32_t* length = spirvDef(module, array[3]);
+	return spirvOpcode(length) == LH_SPV_OP_CONSTANT ? length[3] : 1;
+}
+
+// Bytes a type takes in a block, following its Offset, ArrayStride and MatrixStride decorations
+static uint32_t spirvTypeSize(const LHSpirvModule& module, uint32_t id, uint32_t matrixStride) {
+	const uint32_t* type = spirvDef(module, id);
+	switch (spirvOpcode(type)) {
+	case LH_SPV_OP_TYPE_INT:
+	case LH_SPV_OP_TYPE_FLOAT:
+		return type[2] / 8;
+	case LH_SPV_OP_TYPE_VECTOR:
+		return type[3] * spirvTypeSize(module, type[2], 0);
+	case LH_SPV_OP_TYPE_MATRIX:
+		return type[3] * (matrixStride ? matrixStride : spirvTypeSize(module, type[2], 0));
+	case LH_SPV_OP_TYPE_ARRAY: {
+		uint32_t stride = 0;
+		spirvDecorated(module, id, LH_SPV_DECORATION_ARRAY_STRIDE, &stride);
+		return spirvArrayLength(module, type) * (stride ? stride : spirvTypeSize(module, type[2], matrixStride));
+	}
+	case LH_SPV_OP_TYPE_STRUCT: {
+		uint32_t size = 0;
+		uint32_t members = (type[0] >> 16) - 2;
+		for (uint32_t member = 0; member < members; member++) {
+			uint32_t offset = spirvMemberDecoration(module, id, member, LH_SPV_DECORATION_OFFSET);
+			uint32_t stride = spirvMemberDecoration(module, id, member, LH_SPV_DECORATION_MATRIX_STRIDE);
+			size = std::max(size, offset + spirvTypeSize(module, type[2 + member], stride));
+		}
+		return size;
+	}
+	default:
+		return 0;
+	}
+}
+
+// Format of a 32 bit scalar or vector input, matrices take one location per column
+static VkFormat spirvVertexFormat(const LHSpirvModule& module, uint32_t id, uint32_t& size) {
+	static const VkFormat floats[4] = { VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32G32_SFLOAT, VK_FORMAT_R32G32B32_SFLOAT, VK_FORMAT_R32G32B32A32_SFLOAT };
+	static const VkFormat sints[4] = { VK_FORMAT_R32_SINT, VK_FORMAT_R32G32_SINT, VK_FORMAT_R32G32B32_SINT, VK_FORMAT_R32G32B32A32_SINT };
+	static const VkFormat uints[4] = { VK_FORMAT_R32_UINT, VK_FORMAT_R32G32_UINT, VK_FORMAT_R32G32B32_UINT, VK_FORMAT_R32G32B32A32_UINT };
+
+	const uint32_t* type = spirvDef(module, id);
+	uint32_t components = 1;
+	if (spirvOpcode(type) == LH_SPV_OP_TYPE_VECTOR) {
+		components = type[3];
+		type = spirvDef(module, type[2]);
+	}
+	size = 0;
+	if (components < 1 || components > 4 || (spirvOpcode(type) != LH_SPV_OP_TYPE_FLOAT && spirvOpcode(type) != LH_SPV_OP_TYPE_INT) || type[2] != 32) {
+		return VK_FORMAT_UNDEFINED;
+	}
+	size = components * sizeof(uint32_t);
+	if (spirvOpcode(type) == LH_SPV_OP_TYPE_FLOAT) {
+		return floats[components - 1];
+	}
+	return type[3] ? sints[components - 1] : uints[components - 1];
+}
+
+static bool spirvDescriptorType(const LHSpirvModule& module, const uint32_t* type, uint32_t storage, VkDescriptorType& descriptorType) {
+	switch (spirvOpcode(type)) {
+	case LH_SPV_OP_TYPE_SAMPLED_IMAGE:
+		descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		return true;
+	case LH_SPV_OP_TYPE_SAMPLER:
+		descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+		return true;
+	case LH_SPV_OP_TYPE_IMAGE: {
+		// Sampled is 1 for images read through a sampler and 2 for storage images
+		bool storageImage = type[7] == 2;
+		if (type[3] == LH_SPV_DIM_BUFFER) {
+			descriptorType = storageImage ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+		}
+		else if (type[3] == LH_SPV_DIM_SUBPASS_DATA) {
+			descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+		}
+		else {
+			descriptorType = storageImage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+		}
+		return true;
+	}
+	case LH_SPV_OP_TYPE_STRUCT:
+		// Older SPIR-V marks storage buffers as BufferBlock in the Uniform storage class
+		if (storage == LH_SPV_STORAGE_STORAGE_BUFFER || spirvDecorated(module, type[1], LH_SPV_DECORATION_BUFFER_BLOCK)) {
+			descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		}
+		else {
+			descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool reflectSpirv(const uint32_t* code, size_t codeSize, VkShaderStageFlagBits stage, LHShaderReflection& reflection) {
+	LHSpirvModule module;
+	if (!parseSpirv(code, codeSize / sizeof(uint32_t), module)) {
+		return false;
+	}
+	reflection = LHShaderReflection();
+	reflection.stage = stage;
+
+	for (const uint32_t* variable : module.variables) {
+		uint32_t id = variable[2];
+		uint32_t storage = variable[3];
+		const uint32_t* pointer = spirvDef(module, variable[1]);
+		if (spirvOpcode(pointer) != LH_SPV_OP_TYPE_POINTER) {
+			continue;
+		}
+		uint32_t typeId = pointer[3];
+
+		if (storage == LH_SPV_STORAGE_INPUT) {
+			uint32_t location;
+			if (stage != VK_SHADER_STAGE_VERTEX_BIT || spirvDecorated(module, id, LH_SPV_DECORATION_BUILT_IN) ||
+				!spirvDecorated(module, id, LH_SPV_DECORATION_LOCATION, &location)) {
+				continue;
+			}
+			const uint32_t* type = spirvDef(module, typeId);
+			uint32_t columns = 1;
+			if (spirvOpcode(type) == LH_SPV_OP_TYPE_MATRIX) {
+				columns = type[3];
+				typeId = type[2];
+			}
+			for (uint32_t column = 0; column < columns; column++) {
+				VkVertexInputAttributeDescription attribute = {};
+				uint32_t size;
+				attribute.location = location + column;
+				attribute.binding = 0;
+				attribute.format = spirvVertexFormat(module, typeId, size);
+				attribute.offset = size;													// Turned into offsets once sorted
+				if (attribute.format == VK_FORMAT_UNDEFINED) {
+					std::cout << "Reflection: vertex input at location " << attribute.location << " has no 32 bit format" << std::endl;
+					continue;
+				}
+				reflection.vertexInputs.push_back(attribute);
+			}
+		}
+		else if (storage == LH_SPV_STORAGE_PUSH_CONSTANT) {
+			reflection.pushConstantSize = std::max(reflection.pushConstantSize, spirvTypeSize(module, typeId, 0));
+		}
+		else if (storage == LH_SPV_STORAGE_UNIFORM_CONSTANT || storage == LH_SPV_STORAGE_UNIFORM || storage == LH_SPV_STORAGE_STORAGE_BUFFER) {
+			// Arrays of resources are one binding with several descriptors
+			uint32_t count = 1;
+			const uint32_t* type = spirvDef(module, typeId);
+			while (spirvOpcode(type) == LH_SPV_OP_TYPE_ARRAY || spirvOpcode(type) == LH_SPV_OP_TYPE_RUNTIME_ARRAY) {
+				if (spirvOpcode(type) == LH_SPV_OP_TYPE_ARRAY) {
+					count *= spirvArrayLength(module, type);
+				}
+				type = spirvDef(module, type[2]);
+			}
+
+			LHReflectedBinding reflected = {};
+			if (!spirvDescriptorType(module, type, storage, reflected.binding.descriptorType)) {
+				continue;
+			}
+			spirvDecorated(module, id, LH_SPV_DECORATION_DESCRIPTOR_SET, &reflected.set);
+			spirvDecorated(module, id, LH_SPV_DECORATION_BINDING, &reflected.binding.binding);
+			reflected.binding.descriptorCount = count;
+			reflected.binding.stageFlags = stage;
+			reflected.binding.pImmutableSamplers = nullptr;
+			reflection.bindings.push_back(reflected);
+		}
+	}
+
+	for (uint32_t id : module.specConstants) {
+		uint32_t constantID;
+		if (spirvDecorated(module, id, LH_SPV_DECORATION_SPEC_ID, &constantID)) {
+			reflection.specializationConstants.push_back(constantID);
+		}
+	}
+
+	// Inputs are laid out one after the other in location order
+	std::sort(reflection.vertexInputs.begin(), reflection.vertexInputs.end(),
+		[](const VkVertexInputAttributeDescription& a, const VkVertexInputAttributeDescription& b) { return a.location < b.location; });
+	for (auto& attribute : reflection.vertexInputs) {
+		uint32_t size = attribute.offset;
+		attribute.offset = reflection.vertexStride;
+		reflection.vertexStride += size;
+	}
+	return true;
+}
+
+static void recordShaderReflection(struct LHContext& context, VkShaderModule module, VkShaderStageFlagBits stage, const uint32_t* code, size_t codeSize) {
+	LHShaderReflection reflection;
+	if (!reflectSpirv(code, codeSize, stage, reflection)) {
+		return;
+	}
+	reflection.codeHash = hashBytes(14695981039346656037ull, code, codeSize);
+	std::lock_guard<std::mutex> lock(context.reflectionMutex);
+	context.shaderReflections[module] = reflection;
+}
+
+bool reflectShaderStage(struct LHContext& context, const VkPipelineShaderStageCreateInfo& stage, LHShaderReflection& reflection) {
+	std::lock_guard<std::mutex> lock(context.reflectionMutex);
+	auto found = context.shaderReflections.find(stage.module);
+	if (found == context.shaderReflections.end()) {
+		return false;
+	}
+	reflection = found->second;
+	return true;
+}
+
+static VkDescriptorSetLayout cachedSetLayout(struct LHContext& context, const std::vector<VkDescriptorSetLayoutBinding>& bindings) {
+	VkResult U_ASSERT_ONLY res;
+
+	std::vector<uint32_t> signature;
+	for (auto& binding : bindings) {
+		signature.push_back(binding.binding);
+		signature.push_back(binding.descriptorType);
+		signature.push_back(binding.descriptorCount);
+		signature.push_back(binding.stageFlags);
+	}
+	auto cached = context.layoutCache.setLayouts.find(signature);
+	if (cached != context.layoutCache.setLayouts.end()) {
+		return cached->second;
+	}
+
+	VkDescriptorSetLayoutCreateInfo descriptorLayout = {};
+	descriptorLayout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	descriptorLayout.pNext = nullptr;
+	descriptorLayout.bindingCount = static_cast<uint32_t>(bindings.size());
+	descriptorLayout.pBindings = bindings.data();
+
+	VkDescriptorSetLayout layout;
+	res = vkCreateDescriptorSetLayout(context.device, &descriptorLayout, nullptr, &layout);
+	assert(res == VK_SUCCESS);
+	context.layoutCache.setLayouts[signature] = layout;
+	context.layoutCache.setBindings[layout] = bindings;
+	return layout;
+}
+
+// Merges what the stages declare into descriptor set layouts and a pipeline layout. A binding several stages
+// use gets all their stage flags, dynamicUniforms turns uniform buffers into dynamic ones. Pipelines with the
+// same signature get the same layout objects back, the cache owns them
+VkPipelineLayout createReflectedPipelineLayout(struct LHContext& context, const std::vector<VkPipelineShaderStageCreateInfo>& stages,
+	bool dynamicUniforms, std::vector<VkDescriptorSetLayout>* setLayouts) {
+	VkResult U_ASSERT_ONLY res;
+
+	std::map<uint32_t, std::map<uint32_t, VkDescriptorSetLayoutBinding>> sets;
+	VkPushConstantRange pushConstants = {};
+	for (auto& stage : stages) {
+		LHShaderReflection reflection;
+		if (!reflectShaderStage(context, stage, reflection)) {
+			std::cout << "Reflection: a stage was not made by createShaderStage and is left out of the layout" << std::endl;
+			continue;
+		}
+		for (auto& reflected : reflection.bindings) {
+			VkDescriptorSetLayoutBinding binding = reflected.binding;
+			if (dynamicUniforms && binding.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+				binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			}
+			auto found = sets[reflected.set].find(binding.binding);
+			if (found == sets[reflected.set].end()) {
+				sets[reflected.set][binding.binding] = binding;
+				continue;
+			}
+			if (found->second.descriptorType != binding.descriptorType) {
+				std::cout << "Reflection: set " << reflected.set << " binding " << binding.binding << " has a different type in another stage" << std::endl;
+			}
+			found->second.stageFlags |= binding.stageFlags;
+			found->second.descriptorCount = std::max(found->second.descriptorCount, binding.descriptorCount);
+		}
+		// One range covers the push constants of every stage
+		if (reflection.pushConstantSize > 0) {
+			pushConstants.stageFlags |= stage.stage;
+			pushConstants.size = std::max(pushConstants.size, reflection.pushConstantSize);
+		}
+	}
+
+	// Sets are numbered without gaps, a set no stage uses gets an empty layout
+	std::vector<VkDescriptorSetLayout> layouts;
+	uint32_t setCount = sets.empty() ? 0 : sets.rbegin()->first + 1;
+	for (uint32_t set = 0; set < setCount; set++) {
+		std::vector<VkDescriptorSetLayoutBinding> bindings;
+		for (auto& binding : sets[set]) {
+			bindings.push_back(binding.second);
+		}
+		layouts.push_back(cachedSetLayout(context, bindings));
+	}
+	if (setLayouts) {
+		*setLayouts = layouts;
+	}
+
+	std::vector<uint32_t> signature;
+	for (auto layout : layouts) {
+		uint64_t handle = (uint64_t)layout;
+		signature.push_back((uint32_t)handle);
+		signature.push_back((uint32_t)(handle >> 32));
+	}
+	signature.push_back(pushConstants.stageFlags);
+	signature.push_back(pushConstants.size);
+
+	context.layoutCache.requests++;
+	auto cached = context.layoutCache.pipelineLayouts.find(signature);
+	if (cached != context.layoutCache.pipelineLayouts.end()) {
+		return cached->second;
+	}
+
+	VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = {};
+	pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutCreateInfo.pNext = nullptr;
+	pipelineLayoutCreateInfo.setLayoutCount = static_cast<uint32_t>(layouts.size());
+	pipelineLayoutCreateInfo.pSetLayouts = layouts.data();
+	pipelineLayoutCreateInfo.pushConstantRangeCount = pushConstants.size > 0 ? 1 : 0;
+	pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstants;
+
+	VkPipelineLayout layout;
+	res = vkCreatePipelineLayout(context.device, &pipelineLayoutCreateInfo, nullptr, &layout);
+	assert(res == VK_SUCCESS);
+	context.layoutCache.pipelineLayouts[signature] = layout;
+	return layout;
+}
+
+// The vertex stage's inputs as attributes of binding 0, assuming the buffer interleaves them in location order.
+// stride is the vertex size when the buffer holds more than the stage reads, 0 packs the vertex tightly
+uint32_t reflectVertexInput(struct LHContext& context, const VkPipelineShaderStageCreateInfo& vertexStage,
+	std::vector<VkVertexInputAttributeDescription>& attributes, VkVertexInputBindingDescription& binding, uint32_t stride) {
+	LHShaderReflection reflection;
+	attributes.clear();
+	if (!reflectShaderStage(context, vertexStage, reflection)) {
+		return 0;
+	}
+	attributes = reflection.vertexInputs;
+	binding.binding = 0;
+	binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+	binding.stride = std::max(stride, reflection.vertexStride);
+	return static_cast<uint32_t>(attributes.size());
+}
+
+// Adds what setCount sets of a reflected layout need to the pool sizes
+void addDescriptorPoolSizes(struct LHContext& context, VkDescriptorSetLayout layout, uint32_t setCount, std::vector<VkDescriptorPoolSize>& sizes) {
+	for (auto& binding : context.layoutCache.setBindings[layout]) {
+		auto size = std::find_if(sizes.begin(), sizes.end(), [&](const VkDescriptorPoolSize& s) { return s.type == binding.descriptorType; });
+		if (size == sizes.end()) {
+			sizes.push_back({ binding.descriptorType, 0 });
+			size = sizes.end() - 1;
+		}
+		size->descriptorCount += binding.descriptorCount * setCount;
+	}
+}
+
+void destroyLayoutCache(struct LHContext& context) {
+	for (auto& layout : context.layoutCache.pipelineLayouts) {
+		vkDestroyPipelineLayout(context.device, layout.second, nullptr);
+	}
+	for (auto& layout : context.layoutCache.setLayouts) {
+		vkDestroyDescriptorSetLayout(context.device, layout.second, nullptr);
+	}
+	context.layoutCache = LHLayoutCache();
+}
+
+//----------------------------> Pipeline permutations
+// Declares the specialization constants the stages expose. Reflection tells which stage declares which constant,
+// a stage created without it gets all of them
+void createPipelinePermutations(struct LHContext& context, struct LHPipelinePermutations& permutations, const std::vector<VkPipelineShaderStageCreateInfo>& stages,
+	const std::vector<uint32_t>& constantIDs, LHPermutationBuild build) {
+	permutations.stages = stages;
+	permutations.constantIDs = constantIDs;
+	permutations.build = build;
+	permutations.stageConstants.assign(stages.size(), std::vector<uint32_t>());
+
+	std::vector<bool> declared(constantIDs.size(), false);
+	for (size_t s = 0; s < stages.size(); s++) {
+		LHShaderReflection reflection;
+		bool reflected = reflectShaderStage(context, stages[s], reflection);
+		for (uint32_t c = 0; c < constantIDs.size(); c++) {
+			auto& ids = reflection.specializationConstants;
+			if (!reflected || std::find(ids.begin(), ids.end(), constantIDs[c]) != ids.end()) {
+				permutations.stageConstants[s].push_back(c);
+				declared[c] = true;
+			}
+		}
+	}
+	for (uint32_t c = 0; c < constantIDs.size(); c++) {
+		if (!declared[c]) {
+			std::cout << "Permutations: no stage declares constant_id " << constantIDs[c] << std::endl;
+		}
+	}
+}
+
+// Builds the permutation for key out of stages, which are permutations.stages or rebuilt versions of them.
+// Nothing is memoized, the shader reloader uses this to rebuild a permutation it watches. Every permutation
+// allows derivatives, a rebuilt one may become the parent of those built later
+VkPipeline buildPipelinePermutation(struct LHContext& context, struct LHPipelinePermutations& permutations, const std::vector<uint32_t>& key,
+	const std::vector<VkPipelineShaderStageCreateInfo>& stages, VkPipelineCreateFlags flags, VkPipeline basePipeline) {
+	assert(key.size() == permutations.constantIDs.size());
+	assert(stages.size() == permutations.stageConstants.size());
+
+	// Every stage points at its own entries within the same key
+	std::vector<std::vector<VkSpecializationMapEntry>> entries(stages.size());
+	std::vector<VkSpecializationInfo> specializations(stages.size());
+	std::vector<VkPipelineShaderStageCreateInfo> specialized = stages;
+	for (size_t s = 0; s < stages.size(); s++) {
+		for (uint32_t c : permutations.stageConstants[s]) {
+			VkSpecializationMapEntry entry = {};
+			entry.constantID = permutations.constantIDs[c];
+			entry.offset = c * sizeof(uint32_t);
+			entry.size = sizeof(uint32_t);
+			entries[s].push_back(entry);
+		}
+		if (entries[s].empty()) {
+			continue;
+		}
+		specializations[s].mapEntryCount = static_cast<uint32_t>(entries[s].size());
+		specializations[s].pMapEntries = entries[s].data();
+		specializations[s].dataSize = key.size() * sizeof(uint32_t);
+		specializations[s].pData = key.data();
+		specialized[s].pSpecializationInfo = &specializations[s];
+	}
+	return permutations.build(specialized, flags | VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT, basePipeline);
+}
+
+// The pipeline for key, built on first use. Permutations built once the first one is in place are created as its
+// derivatives, so the driver can share what does not depend on the constants.
+// The reference stays valid until destroyPipelinePermutations(), watchPipeline() can swap it in place
+VkPipeline& getPipelinePermutation(struct LHContext& context, struct LHPipelinePermutations& permutations, const std::vector<uint32_t>& key) {
+	std::unique_lock<std::mutex> lock(permutations.mutex);
+	permutations.requests++;
+	for (;;) {
+		auto found = permutations.pipelines.find(key);
+		if (found != permutations.pipelines.end()) {
+			return found->second;
+		}
+		// Another thread is building this key, wait for it rather than building it twice
+		auto building = permutations.building.find(key);
+		if (building == permutations.building.end()) {
+			break;
+		}
+		std::shared_future<VkPipeline> pending = building->second;
+		lock.unlock();
+		pending.wait();
+		lock.lock();
+	}
+
+	// The key is reserved and the pipeline created outside the lock, so different keys build side by side.
+	// Looked up by key, the shader reloader may have replaced the parent since. A parent still being built
+	// is not waited for, the permutation is then created without one
+	std::promise<VkPipeline> promise;
+	permutations.building[key] = promise.get_future().share();
+	VkPipelineCreateFlags flags = 0;
+	VkPipeline base = VK_NULL_HANDLE;
+	if (permutations.baseKey.empty()) {
+		permutations.baseKey = key;
+	}
+	else {
+		auto parent = permutations.pipelines.find(permutations.baseKey);
+		if (parent != permutations.pipelines.end()) {
+			flags = VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+			base = parent->second;
+		}
+	}
+	std::vector<VkPipelineShaderStageCreateInfo> stages = permutations.stages;
+	lock.unlock();
+
+	VkPipeline pipeline = buildPipelinePermutation(context, permutations, key, stages, flags, base);
+
+	lock.lock();
+	permutations.building.erase(key);
+	promise.set_value(pipeline);
+	return permutations.pipelines[key] = pipeline;
+}
+
+// The set owns the pipelines it built. Keys rebuilt by the shader reloader were emptied by destroyShaderReloader(),
+// pipelines linked from libraries belong to those and are left for destroyPipelineLibraries()
+void destroyPipelinePermutations(struct LHContext& context, struct LHPipelinePermutations& permutations) {
+	for (auto& pipeline : permutations.pipelines) {
+		if (pipeline.second != VK_NULL_HANDLE && !linkedPipeline(context, pipeline.second)) {
+			vkDestroyPipeline(context.device, pipeline.second, nullptr);
+		}
+	}
+	permutations.pipelines.clear();
+	permutations.baseKey.clear();
+}
+
+//----------------------------> Pipeline compiler
+// Points the create info at the desc's own members. Specialization info is copied first, so the stages may
+// come from short lived VkSpecializationInfo. Call it again after the desc is copied or moved
+const VkGraphicsPipelineCreateInfo& pipelineDescCreateInfo(struct LHGraphicsPipelineDesc& desc) {
+	std::vector<VkSpecializationInfo> specializations(desc.stages.size());
+	std::vector<std::vector<VkSpecializationMapEntry>> entries(desc.stages.size());
+	std::vector<std::vector<char>> data(desc.stages.size());
+	for (size_t i = 0; i < desc.stages.size(); i++) {
+		const VkSpecializationInfo* specialization = desc.stages[i].pSpecializationInfo;
+		if (specialization == nullptr) {
+			continue;
+		}
+		entries[i].assign(specialization->pMapEntries, specialization->pMapEntries + specialization->mapEntryCount);
+		data[i].assign((const char*)specialization->pData, (const char*)specialization->pData + specialization->dataSize);
+	}
+	// Moving keeps the heap buffers, so the pointers below survive these assignments
+	desc.specializationEntries = std::move(entries);
+	desc.specializationData = std::move(data);
+	desc.specializations = std::move(specializations);
+	for (size_t i = 0; i < desc.stages.size(); i++) {
+		if (desc.stages[i].pSpecializationInfo == nullptr) {
+			continue;
+		}
+		VkSpecializationInfo& specialization = desc.specializations[i];
+		specialization.mapEntryCount = static_cast<uint32_t>(desc.specializationEntries[i].size());
+		specialization.pMapEntries = desc.specializationEntries[i].data();
+		specialization.dataSize = desc.specializationData[i].size();
+		specialization.pData = desc.specializationData[i].data();
+		desc.stages[i].pSpecializationInfo = &specialization;
+	}
+
+	desc.vertexInputState.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	desc.vertexInputState.vertexBindingDescriptionCount = static_cast<uint32_t>(desc.vertexBindings.size());
+	desc.vertexInputState.pVertexBindingDescriptions = desc.vertexBindings.data();
+	desc.vertexInputState.vertexAttributeDescriptionCount = static_cast<uint32_t>(desc.vertexAttributes.size());
+	desc.vertexInputState.pVertexAttributeDescriptions = desc.vertexAttributes.data();
+	desc.inputAssemblyState.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	desc.rasterizationState.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	desc.colorBlendState.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	desc.colorBlendState.attachmentCount = static_cast<uint32_t>(desc.blendAttachments.size());
+	desc.colorBlendState.pAttachments = desc.blendAttachments.data();
+	desc.viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	desc.dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	desc.dynamicState.dynamicStateCount = static_cast<uint32_t>(desc.dynamicStates.size());
+	desc.dynamicState.pDynamicStates = desc.dynamicStates.data();
+	desc.depthStencilState.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	desc.multisampleState.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+
+	VkGraphicsPipelineCreateInfo& info = desc.info;
+	info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	info.stageCount = static_cast<uint32_t>(desc.stages.size());
+	info.pStages = desc.stages.data();
+	info.pVertexInputState = &desc.vertexInputState;
+	info.pInputAssemblyState = &desc.inputAssemblyState;
+	info.pRasterizationState = &desc.rasterizationState;
+	info.pColorBlendState = &desc.colorBlendState;
+	info.pMultisampleState = &desc.multisampleState;
+	info.pViewportState = &desc.viewportState;
+	info.pDepthStencilState = &desc.depthStencilState;
+	info.pDynamicState = &desc.dynamicState;
+	return info;
+}
+
+static void pipelineCompilerLoop(struct LHContext* context) {
+	LHPipelineCompiler& compiler = *context->pipelineCompiler;
+	std::unique_lock<std::mutex> lock(compiler.mutex);
+	while (true) {
+		compiler.wake.wait(lock, [&] { return compiler.quit || !compiler.jobs.empty(); });
+		if (compiler.jobs.empty()) {
+			return;
+		}
+		std::function<void()> job = std::move(compiler.jobs.front());
+		compiler.jobs.pop_front();
+		compiler.busy++;
+		lock.unlock();
+		job();
+		lock.lock();
+		compiler.busy--;
+		if (compiler.busy == 0 && compiler.jobs.empty()) {
+			std::cout << "Pipeline compiler: " << compiler.pipelines << " pipelines from " << compiler.calls << " calls on " << compiler.threads.size() << " threads in "
+				<< std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - compiler.start).count() << " ms" << std::endl;
+			compiler.pipelines = 0;
+			compiler.calls = 0;
+		}
+		// Wake a frame loop sleeping in render-on-demand mode, it collects the pipeline between frames
+		markFrameDirty(*context);
+		if (!context->renderThreaded) {
+			glfwPostEmptyEvent();
+		}
+	}
+}
+
+void createPipelineCompiler(struct LHContext& context, uint32_t threadCount) {
+	if (threadCount == 0) {
+		threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	context.pipelineCompiler = new LHPipelineCompiler();
+	for (uint32_t i = 0; i < threadCount; i++) {
+		context.pipelineCompiler->threads.push_back(std::thread(pipelineCompilerLoop, &context));
+	}
+}
+
+// Finishes the pipelines already handed over before the threads exit
+void destroyPipelineCompiler(struct LHContext& context) {
+	LHPipelineCompiler* compiler = context.pipelineCompiler;
+	if (compiler == nullptr) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(compiler->mutex);
+		compiler->quit = true;
+	}
+	compiler->wake.notify_all();
+	for (auto& thread : compiler->threads) {
+		thread.join();
+	}
+	delete compiler;
+	context.pipelineCompiler = nullptr;
+}
+
+// Without a compiler the job runs right away and the future is ready on return
+static void queuePipelineJob(struct LHContext& context, std::function<void()> job, uint32_t pipelines) {
+	LHPipelineCompiler* compiler = context.pipelineCompiler;
+	if (compiler == nullptr) {
+		job();
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(compiler->mutex);
+		if (compiler->busy == 0 && compiler->jobs.empty()) {
+			compiler->start = std::chrono::high_resolution_clock::now();
+		}
+		compiler->jobs.push_back(std::move(job));
+		compiler->pipelines += pipelines;
+		compiler->calls++;
+	}
+	compiler->wake.notify_one();
+}
+
+//----------------------------> Pipeline registry
+template <typename T>
+static void appendKey(std::string& key, const T& value) {
+	key.append((const char*)&value, sizeof(value));
+}
+
+// Serializes everything about one part of a pipeline that decides what the driver compiles, field by field so
+// struct padding stays out of it. Shader modules count by their SPIR-V, two modules made from the same code are
+// the same shader. Returns false when the part has extension structs it can't see into
+static bool pipelinePartKey(struct LHContext& context, const LHGraphicsPipelineDesc& desc, LHPipelineLibraryPart part, std::string& key) {
+	if (desc.dynamicState.pNext) {
+		return false;
+	}
+	appendKey(key, part);
+	appendKey(key, desc.dynamicStates.size());
+	for (auto dynamic : desc.dynamicStates) {
+		appendKey(key, dynamic);
+	}
+	if (part != LH_LIBRARY_VERTEX_INPUT) {
+		appendKey(key, desc.info.renderPass);
+		appendKey(key, desc.info.subpass);
+	}
+
+	if (part == LH_LIBRARY_VERTEX_INPUT) {
+		if (desc.vertexInputState.pNext || desc.inputAssemblyState.pNext) {
+			return false;
+		}
+		appendKey(key, desc.vertexBindings.size());
+		for (auto& binding : desc.vertexBindings) {
+			appendKey(key, binding.binding);
+			appendKey(key, binding.stride);
+			appendKey(key, binding.inputRate);
+		}
+		appendKey(key, desc.vertexAttributes.size());
+		for (auto& attribute : desc.vertexAttributes) {
+			appendKey(key, attribute.location);
+			appendKey(key, attribute.binding);
+			appendKey(key, attribute.format);
+			appendKey(key, attribute.offset);
+		}
+		appendKey(key, desc.inputAssemblyState.flags);
+		appendKey(key, desc.inputAssemblyState.topology);
+		appendKey(key, desc.inputAssemblyState.primitiveRestartEnable);
+		return true;
+	}
+
+	if (part == LH_LIBRARY_PRE_RASTERIZATION || part == LH_LIBRARY_FRAGMENT_SHADER) {
+		appendKey(key, desc.info.layout);
+		for (auto& stage : desc.stages) {
+			if ((stage.stage == VK_SHADER_STAGE_FRAGMENT_BIT) != (part == LH_LIBRARY_FRAGMENT_SHADER)) {
+				continue;
+			}
+			if (stage.pNext) {
+				return false;
+			}
+			LHShaderReflection reflection;
+			appendKey(key, stage.flags);
+			appendKey(key, stage.stage);
+			if (reflectShaderStage(context, stage, reflection)) {
+				appendKey(key, reflection.codeHash);
+			}
+			else {
+				appendKey(key, stage.module);
+			}
+			key.append(stage.pName ? stage.pName : "");
+			key.push_back('\0');
+			const VkSpecializationInfo* specialization = stage.pSpecializationInfo;
+			appendKey(key, specialization ? specialization->mapEntryCount : 0u);
+			if (specialization) {
+				for (uint32_t i = 0; i < specialization->mapEntryCount; i++) {
+					appendKey(key, specialization->pMapEntries[i].constantID);
+					appendKey(key, specialization->pMapEntries[i].offset);
+					appendKey(key, specialization->pMapEntries[i].size);
+				}
+				appendKey(key, specialization->dataSize);
+				key.append((const char*)specialization->pData, specialization->dataSize);
+			}
+		}
+	}
+
+	if (part == LH_LIBRARY_PRE_RASTERIZATION) {
+		if (desc.info.pTessellationState || desc.viewportState.pNext || desc.rasterizationState.pNext ||
+			desc.viewportState.pViewports || desc.viewportState.pScissors) {
+			return false;
+		}
+		appendKey(key, desc.viewportState.viewportCount);
+		appendKey(key, desc.viewportState.scissorCount);
+
+		const VkPipelineRasterizationStateCreateInfo& rasterization = desc.rasterizationState;
+		appendKey(key, rasterization.depthClampEnable);
+		appendKey(key, rasterization.rasterizerDiscardEnable);
+		appendKey(key, rasterization.polygonMode);
+		appendKey(key, rasterization.cullMode);
+		appendKey(key, rasterization.frontFace);
+		appendKey(key, rasterization.depthBiasEnable);
+		appendKey(key, rasterization.depthBiasConstantFactor);
+		appendKey(key, rasterization.depthBiasClamp);
+		appendKey(key, rasterization.depthBiasSlopeFactor);
+		appendKey(key, rasterization.lineWidth);
+		return true;
+	}
+
+	// Both fragment parts see the multisample state
+	const VkPipelineMultisampleStateCreateInfo& multisample = desc.multisampleState;
+	if (multisample.pNext || multisample.pSampleMask) {
+		return false;
+	}
+	appendKey(key, multisample.rasterizationSamples);
+	appendKey(key, multisample.sampleShadingEnable);
+	appendKey(key, multisample.minSampleShading);
+	appendKey(key, multisample.alphaToCoverageEnable);
+	appendKey(key, multisample.alphaToOneEnable);
+
+	if (part == LH_LIBRARY_FRAGMENT_SHADER) {
+		// VkStencilOpState and VkPipelineColorBlendAttachmentState are all 32 bit fields, without padding
+		const VkPipelineDepthStencilStateCreateInfo& depthStencil = desc.depthStencilState;
+		if (depthStencil.pNext) {
+			return false;
+		}
+		appendKey(key, depthStencil.depthTestEnable);
+		appendKey(key, depthStencil.depthWriteEnable);
+		appendKey(key, depthStencil.depthCompareOp);
+		appendKey(key, depthStencil.depthBoundsTestEnable);
+		appendKey(key, depthStencil.stencilTestEnable);
+		appendKey(key, depthStencil.front);
+		appendKey(key, depthStencil.back);
+		appendKey(key, depthStencil.minDepthBounds);
+		appendKey(key, depthStencil.maxDepthBounds);
+		return true;
+	}
+
+	if (desc.colorBlendState.pNext) {
+		return false;
+	}
+	appendKey(key, desc.colorBlendState.logicOpEnable);
+	appendKey(key, desc.colorBlendState.logicOp);
+	appendKey(key, desc.colorBlendState.blendConstants);
+	appendKey(key, desc.blendAttachments.size());
+	for (auto& attachment : desc.blendAttachments) {
+		appendKey(key, attachment);
+	}
+	return true;
+}
+
+// The whole pipeline is the sum of its parts. Derivative flags and base pipelines only affect how the
+// pipeline is made, not what it is
+static bool pipelineStateKey(struct LHContext& context, const LHGraphicsPipelineDesc& desc, std::string& key) {
+	if (desc.info.pNext) {
+		return false;
+	}
+	key.clear();
+	appendKey(key, desc.info.flags & ~(VK_PIPELINE_CREATE_DERIVATIVE_BIT | VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT));
+	for (uint32_t part = 0; part < LH_LIBRARY_PART_COUNT; part++) {
+		if (!pipelinePartKey(context, desc, (LHPipelineLibraryPart)part, key)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Drops a pipeline that is about to be destroyed, the shader reloader retires pipelines it replaced
+static void unregisterPipeline(struct LHContext& context, VkPipeline pipeline) {
+	LHPipelineRegistry& registry = context.pipelineRegistry;
+	{
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (auto entry = registry.pipelines.begin(); entry != registry.pipelines.end();) {
+			if (pipelineReady(entry->second) && entry->second.get() == pipeline) {
+				entry = registry.pipelines.erase(entry);
+			}
+			else {
+				++entry;
+			}
+		}
+	}
+
+	LHPipelineLibraries& libraries = context.pipelineLibraries;
+	std::lock_guard<std::mutex> lock(libraries.mutex);
+	for (auto& linked : libraries.linked) {
+		if (linked.fast == pipeline) {
+			linked.fast = VK_NULL_HANDLE;
+		}
+		else if (linked.optimized.valid() && pipelineReady(linked.optimized) && linked.optimized.get() == pipeline) {
+			linked.optimizedRetired = true;
+		}
+	}
+}
+
+void destroyPipelineRegistry(struct LHContext& context) {
+	LHPipelineRegistry& registry = context.pipelineRegistry;
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	for (auto& entry : registry.pipelines) {
+		VkPipeline pipeline = entry.second.get();
+		if (pipeline != VK_NULL_HANDLE) {
+			vkDestroyPipeline(context.device, pipeline, nullptr);
+		}
+	}
+	registry.pipelines.clear();
+}
+
+//----------------------------> Pipeline libraries
+// Creates one part of the pipeline from the full create info, taking only the state that part owns
+static VkPipeline createPipelineLibrary(struct LHContext& context, const VkGraphicsPipelineCreateInfo& full, VkPipelineCreateFlags flags,
+	LHPipelineLibraryPart part) {
+	VkResult U_ASSERT_ONLY res;
+	static const VkGraphicsPipelineLibraryFlagsEXT partFlags[LH_LIBRARY_PART_COUNT] = {
+		VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT,
+		VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT,
+		VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT,
+		VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT
+	};
+
+	VkGraphicsPipelineLibraryCreateInfoEXT libraryInfo = {};
+	libraryInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT;
+	libraryInfo.flags = partFlags[part];
+
+	// Keeping the link time optimization info lets the optimized relink see into every part
+	VkGraphicsPipelineCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	info.pNext = &libraryInfo;
+	info.flags = flags | VK_PIPELINE_CREATE_LIBRARY_BIT_KHR | VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT;
+	info.pDynamicState = full.pDynamicState;
+	info.basePipelineIndex = -1;
+
+	std::vector<VkPipelineShaderStageCreateInfo> stages;
+	switch (part) {
+	case LH_LIBRARY_VERTEX_INPUT:
+		info.pVertexInputState = full.pVertexInputState;
+		info.pInputAssemblyState = full.pInputAssemblyState;
+		break;
+	case LH_LIBRARY_PRE_RASTERIZATION:
+	case LH_LIBRARY_FRAGMENT_SHADER:
+		for (uint32_t i = 0; i < full.stageCount; i++) {
+			if ((full.pStages[i].stage == VK_SHADER_STAGE_FRAGMENT_BIT) == (part == LH_LIBRARY_FRAGMENT_SHADER)) {
+				stages.push_back(full.pStages[i]);
+			}
+		}
+		info.stageCount = static_cast<uint32_t>(stages.size());
+		info.pStages = stages.data();
+		info.layout = full.layout;
+		info.renderPass = full.renderPass;
+		info.subpass = full.subpass;
+		if (part == LH_LIBRARY_PRE_RASTERIZATION) {
+			info.pViewportState = full.pViewportState;
+			info.pRasterizationState = full.pRasterizationState;
+			info.pTessellationState = full.pTessellationState;
+		}
+		else {
+			info.pMultisampleState = full.pMultisampleState;
+			info.pDepthStencilState = full.pDepthStencilState;
+		}
+		break;
+	default:
+		info.pColorBlendState = full.pColorBlendState;
+		info.pMultisampleState = full.pMultisampleState;
+		info.renderPass = full.renderPass;
+		info.subpass = full.subpass;
+		break;
+	}
+
+	VkPipeline library;
+	res = vkCreateGraphicsPipelines(context.device, context.pipelineCache, 1, &info, nullptr, &library);
+	assert(res == VK_SUCCESS);
+	return library;
+}
+
+static VkPipeline linkPipelineLibraries(struct LHContext& context, const VkPipeline* parts, VkPipelineLayout layout, VkPipelineCreateFlags flags) {
+	VkResult U_ASSERT_ONLY res;
+	VkPipelineLibraryCreateInfoKHR linkInfo = {};
+	linkInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR;
+	linkInfo.libraryCount = LH_LIBRARY_PART_COUNT;
+	linkInfo.pLibraries = parts;
+
+	VkGraphicsPipelineCreateInfo info = {};
+	info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	info.pNext = &linkInfo;
+	info.flags = flags;
+	info.layout = layout;
+	info.basePipelineIndex = -1;
+
+	VkPipeline pipeline;
+	res = vkCreateGraphicsPipelines(context.device, context.pipelineCache, 1, &info, nullptr, &pipeline);
+	assert(res == VK_SUCCESS);
+	return pipeline;
+}
+
+// Builds the pipeline from its four parts, compiling only the parts no earlier pipeline had, and links them
+// without optimization so it can be drawn with this frame. With optimize the same parts are linked again with
+// link time optimization on the pipeline compiler, upgradeLinkedPipeline() swaps that one in once it is done.
+// Only for devices with context.pipelineLibrary, the pipeline belongs to the libraries
+VkPipeline linkPipeline(struct LHContext& context, const LHGraphicsPipelineDesc& desc, bool optimize) {
+	assert(context.pipelineLibrary);
+	auto start = std::chrono::high_resolution_clock::now();
+	LHGraphicsPipelineDesc copy = desc;
+	const VkGraphicsPipelineCreateInfo& full = pipelineDescCreateInfo(copy);
+	// Libraries can't take part in derivatives
+	VkPipelineCreateFlags flags = full.flags & ~(VK_PIPELINE_CREATE_DERIVATIVE_BIT | VK_PIPELINE_CREATE_ALLOW_DERIVATIVES_BIT);
+
+	LHPipelineLibraries& libraries = context.pipelineLibraries;
+	std::vector<VkPipeline> parts(LH_LIBRARY_PART_COUNT, VK_NULL_HANDLE);
+	std::string key;
+	for (uint32_t part = 0; part < LH_LIBRARY_PART_COUNT; part++) {
+		key.clear();
+		bool keyed = !desc.info.pNext && pipelinePartKey(context, desc, (LHPipelineLibraryPart)part, key);
+		{
+			std::lock_guard<std::mutex> lock(libraries.mutex);
+			libraries.requests++;
+			auto found = keyed ? libraries.parts[part].find(key) : libraries.parts[part].end();
+			if (found != libraries.parts[part].end()) {
+				parts[part] = found->second;
+				continue;
+			}
+		}
+
+		// Compiled outside the lock, another thread may have made the same part meanwhile
+		VkPipeline library = createPipelineLibrary(context, full, flags, (LHPipelineLibraryPart)part);
+		std::lock_guard<std::mutex> lock(libraries.mutex);
+		libraries.built++;
+		if (!keyed) {
+			libraries.unshared.push_back(library);
+		}
+		else {
+			auto inserted = libraries.parts[part].insert(std::make_pair(key, library));
+			if (!inserted.second) {
+				vkDestroyPipeline(context.device, library, nullptr);
+				library = inserted.first->second;
+			}
+		}
+		parts[part] = library;
+	}
+
+	LHLinkedPipeline linked;
+	linked.fast = linkPipelineLibraries(context, parts.data(), full.layout, flags);
+	if (optimize) {
+		VkPipelineLayout layout = full.layout;
+		linked.optimized = compilePipeline(context, [&context, parts, layout, flags]() {
+			return linkPipelineLibraries(context, parts.data(), layout, flags | VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT);
+		});
+	}
+
+	std::lock_guard<std::mutex> lock(libraries.mutex);
+	libraries.links++;
+	libraries.linkMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	libraries.linked.push_back(linked);
+	return linked.fast;
+}
+
+// Replaces a fast linked pipeline with its optimized relink when that is done, returns true if it did.
+// Frames in flight may still use the fast one, it stays until destroyPipelineLibraries()
+bool upgradeLinkedPipeline(struct LHContext& context, VkPipeline& pipeline) {
+	LHPipelineLibraries& libraries = context.pipelineLibraries;
+	std::lock_guard<std::mutex> lock(libraries.mutex);
+	for (auto& linked : libraries.linked) {
+		if (pipeline == VK_NULL_HANDLE || linked.fast != pipeline) {
+			continue;
+		}
+		if (!linked.optimized.valid() || !pipelineReady(linked.optimized) || linked.optimized.get() == VK_NULL_HANDLE) {
+			return false;
+		}
+		pipeline = linked.optimized.get();
+		return true;
+	}
+	return false;
+}
+
+// True for a fast or optimized link the libraries still own, the shader reloader takes retired ones over
+static bool linkedPipeline(struct LHContext& context, VkPipeline pipeline) {
+	LHPipelineLibraries& libraries = context.pipelineLibraries;
+	std::lock_guard<std::mutex> lock(libraries.mutex);
+	for (auto& linked : libraries.linked) {
+		if (linked.fast == pipeline) {
+			return true;
+		}
+		if (linked.optimized.valid() && !linked.optimizedRetired && pipelineReady(linked.optimized) && linked.optimized.get() == pipeline) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Called once the device is idle and the pipeline compiler is gone, after destroyPipelinePermutations()
+// and destroyShaderReloader() since both ask which of their pipelines are linked
+void destroyPipelineLibraries(struct LHContext& context) {
+	LHPipelineLibraries& libraries = context.pipelineLibraries;
+	std::lock_guard<std::mutex> lock(libraries.mutex);
+	for (auto& linked : libraries.linked) {
+		if (linked.fast != VK_NULL_HANDLE) {
+			vkDestroyPipeline(context.device, linked.fast, nullptr);
+		}
+		if (linked.optimized.valid() && !linked.optimizedRetired && linked.optimized.get() != VK_NULL_HANDLE) {
+			vkDestroyPipeline(context.device, linked.optimized.get(), nullptr);
+		}
+	}
+	for (auto& parts : libraries.parts) {
+		for (auto& part : parts) {
+			vkDestroyPipeline(context.device, part.second, nullptr);
+		}
+		parts.clear();
+	}
+	for (auto library : libraries.unshared) {
+		vkDestroyPipeline(context.device, library, nullptr);
+	}
+	libraries.unshared.clear();
+	libraries.linked.clear();
+}
+
+//----------------------------> Pipeline compiler (batches)
+// Creates the pipelines with as few vkCreateGraphicsPipelines calls as there are compiler threads to run them.
+// A desc deriving from another one by basePipelineIndex stays in the same call as its parent. Every desc goes
+// through the pipeline registry first, one that matches a pipeline made before gets that pipeline's future
+std::vector<std::shared_future<VkPipeline>> compilePipelines(struct LHContext& context, const std::vector<LHGraphicsPipelineDesc>& descs) {
+	std::vector<std::shared_future<VkPipeline>> futures(descs.size());
+	std::vector<std::shared_ptr<std::promise<VkPipeline>>> promises(descs.size());
+	std::vector<bool> created(descs.size(), false);
+	{
+		LHPipelineRegistry& registry = context.pipelineRegistry;
+		std::string key;
+		for (size_t i = 0; i < descs.size(); i++) {
+			bool keyed = pipelineStateKey(context, descs[i], key);
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.requests++;
+			auto found = keyed ? registry.pipelines.find(key) : registry.pipelines.end();
+			if (found != registry.pipelines.end()) {
+				registry.hits++;
+				futures[i] = found->second;
+				continue;
+			}
+			promises[i] = std::make_shared<std::promise<VkPipeline>>();
+			futures[i] = promises[i]->get_future().share();
+			created[i] = true;
+			if (keyed) {
+				registry.pipelines[key] = futures[i];
+			}
+			else {
+				registry.unkeyed++;
+			}
+		}
+	}
+
+	// Derivatives are grouped under the desc at the root of their chain
+	std::map<size_t, std::vector<size_t>> groups;
+	for (size_t i = 0; i < descs.size(); i++) {
+		if (!created[i]) {
+			continue;
+		}
+		size_t root = i;
+		while ((descs[root].info.flags & VK_PIPELINE_CREATE_DERIVATIVE_BIT) && descs[root].info.basePipelineIndex >= 0 &&
+			(size_t)descs[root].info.basePipelineIndex < descs.size() && (size_t)descs[root].info.basePipelineIndex != root &&
+			created[descs[root].info.basePipelineIndex]) {
+			root = descs[root].info.basePipelineIndex;
+		}
+		groups[root].push_back(i);
+	}
+	if (groups.empty()) {
+		return futures;
+	}
+
+	size_t threadCount = context.pipelineCompiler ? context.pipelineCompiler->threads.size() : 1;
+	std::vector<std::vector<size_t>> batches(std::min(std::max<size_t>(threadCount, 1), groups.size()));
+	size_t next = 0;
+	for (auto& group : groups) {
+		auto& batch = batches[next++ % batches.size()];
+		// Parents come before their derivatives
+		std::sort(group.second.begin(), group.second.end());
+		batch.insert(batch.end(), group.second.begin(), group.second.end());
+	}
+
+	for (auto& batch : batches) {
+		// The batch owns copies of its descs, specialization info included, by the time this returns
+		auto owned = std::make_shared<std::vector<LHGraphicsPipelineDesc>>();
+		std::vector<std::shared_ptr<std::promise<VkPipeline>>> batchPromises;
+		for (size_t index : batch) {
+			owned->push_back(descs[index]);
+			batchPromises.push_back(promises[index]);
+			LHGraphicsPipelineDesc& desc = owned->back();
+			pipelineDescCreateInfo(desc);
+			if (desc.info.basePipelineIndex >= 0) {
+				auto parent = std::find(batch.begin(), batch.end(), (size_t)desc.info.basePipelineIndex);
+				if (parent != batch.end()) {
+					desc.info.basePipelineIndex = (int32_t)(parent - batch.begin());
+				}
+				else {
+					// The parent was already registered, so this one is made on its own
+					desc.info.flags &= ~VK_PIPELINE_CREATE_DERIVATIVE_BIT;
+					desc.info.basePipelineIndex = -1;
+				}
+			}
+		}
+
+		queuePipelineJob(context, [&context, owned, batchPromises]() {
+			std::vector<VkGraphicsPipelineCreateInfo> infos;
+			for (auto& desc : *owned) {
+				infos.push_back(pipelineDescCreateInfo(desc));
+			}
+			std::vector<VkPipeline> pipelines(infos.size(), VK_NULL_HANDLE);
+			VkResult res = vkCreateGraphicsPipelines(context.device, context.pipelineCache, static_cast<uint32_t>(infos.size()), infos.data(), nullptr, pipelines.data());
+			if (res != VK_SUCCESS) {
+				std::cout << "Pipeline compiler: vkCreateGraphicsPipelines failed (" << res << ")" << std::endl;
+			}
+			for (size_t i = 0; i < pipelines.size(); i++) {
+				batchPromises[i]->set_value(pipelines[i]);
+			}
+		}, static_cast<uint32_t>(batch.size()));
+	}
+	return futures;
+}
+
+// Runs a job that creates one pipeline its own way, for pipelines not described by a desc (permutations for one)
+std::shared_future<VkPipeline> compilePipeline(struct LHContext& context, LHPipelineJob job) {
+	auto promise = std::make_shared<std::promise<VkPipeline>>();
+	std::shared_future<VkPipeline> future = promise->get_future().share();
+	queuePipelineJob(context, [promise, job]() {
+		promise->set_value(job());
+	}, 1);
+	return future;
+}
+
+bool pipelineReady(const std::shared_future<VkPipeline>& pipeline) {
+	return pipeline.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+//--------------IGNORE FROM HERE---------------------------------------------------------------------->
+
+//TODO: Move all of this to a helper file
+bool memory_type_from_properties(struct LHContext& context, uint32_t typeBits, VkFlags requirements_mask, uint32_t* typeIndex) {
+	// Search memtypes to find first index with those properties
+	for (uint32_t i = 0; i < context.memory_properties.memoryTypeCount; i++) {
+		if ((typeBits & 1) == 1) {
+			// Type is available, does it match user properties?
+			if ((context.memory_properties.memoryTypes[i].propertyFlags & requirements_mask) == requirements_mask) {
+				*typeIndex = i;
+				return true;
+			}
+		}
+		typeBits >>= 1;
+	}
+	// No memory types matched, return failure
+	return false;
+}
+
+void createClearColor(struct LHContext& context, VkClearValue* clear_values) {
+	clear_values[0].color = { { 0.0f, 0.0f, 0.2f, 1.0f } };
+	clear_values[1].depthStencil = { 1.0f, 0 };
+}
+
+void createRenderPassCreateInfo(struct LHContext& context, VkRenderPassBeginInfo& rp_begin) {
+	rp_begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	rp_begin.pNext = nullptr;
+	rp_begin.renderPass = context.render_pass;
+	rp_begin.renderArea.offset.x = 0;
+	rp_begin.renderArea.offset.y = 0;
+	rp_begin.renderArea.extent.width = context.width;
+	rp_begin.renderArea.extent.height = context.height;
+}
+
+
+void setupRenderPass(struct LHContext& context, bool useStagingBuffers) {
+	VkResult U_ASSERT_ONLY res;
+	// This example will use a single render pass with one subpass
+
+	// Descriptors for the attachments used by this renderpass
+	std::array<VkAttachmentDescription, 2> attachments = {};
+	/*VkAttachmentDescription *attachments;
+	createAttachmentDescription(context, attachments);*/
+	// Color attachment
+	attachments[0].format = context.format;									// Use the color format selected by the swapchain
+	attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;									// We don't use multi sampling in this example
+	attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;							// Clear this attachment at the start of the render pass
+	attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;							// Keep it's contents after the render pass is finished (for displaying it)
+	attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;					// We don't use stencil, so don't care for load
+	attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;				// Same for store
+	attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;						// Layout at render pass start. Initial doesn't matter, so we use undefined
+	attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;					// Layout to which the attachment is transitioned when the render pass is finished
+																					// As we want to present the color buffer to the swapchain, we transition to PRESENT_KHR	
+	// Depth attachment
+	attachments[1].format = context.depth.format;											// A proper depth format is selected in the example base
+	attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
+	attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;							// Clear depth at start of first subpass
+	attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;						// We don't need depth after render pass has finished (DONT_CARE may result in better performance)
+	attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;					// No stencil
+	attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;				// No Stencil
+	attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;						// Layout at render pass start. Initial doesn't matter, so we use undefined
+	attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;	// Transition to depth/stencil attachment
+
+	// Setup attachment references
+	VkAttachmentReference colorReference = {};
+	colorReference.attachment = 0;													// Attachment 0 is color
+	colorReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;				// Attachment layout used as color during the subpass
+
+	VkAttachmentReference depthReference = {};
+	depthReference.attachment = 1;													// Attachment 1 is color
+	depthReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;		// Attachment used as depth/stemcil used during the subpass
+
+	// Setup a single subpass reference
+	VkSubpassDescription subpassDescription = {};
+	subpassDescription.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpassDescription.colorAttachmentCount = 1;									// Subpass uses one color attachment
+	subpassDescription.pColorAttachments = &colorReference;							// Reference to the color attachment in slot 0
+	subpassDescription.pDepthStencilAttachment = &depthReference;					// Reference to the depth attachment in slot 1
+	subpassDescription.inputAttachmentCount = 0;									// Input attachments can be used to sample from contents of a previous subpass
+	subpassDescription.pInputAttachments = nullptr;									// (Input attachments not used by this example)
+	subpassDescription.preserveAttachmentCount = 0;									// Preserved attachments can be used to loop (and preserve) attachments through subpasses
+	subpassDescription.pPreserveAttachments = nullptr;								// (Preserve attachments not used by this example)
+	subpassDescription.pResolveAttachments = nullptr;								// Resolve attachments are resolved at the end of a sub pass and can be used for e.g. multi sampling
+
+	// Setup subpass dependencies
+	// These will add the implicit ttachment layout transitionss specified by the attachment descriptions
+	// The actual usage layout is preserved through the layout specified in the attachment reference		
+	// Each subpass dependency will introduce a memory and execution dependency between the source and dest subpass described by
+	// srcStageMask, dstStageMask, srcAccessMask, dstAccessMask (and dependencyFlags is set)
+	// Note: VK_SUBPASS_EXTERNAL is a special constant that refers to all commands executed outside of the actual renderpass)
+	std::array<VkSubpassDependency, 2> dependencies;
+
+	// First dependency at the start of the renderpass
+	// Does the transition from final to initial layout 
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;								// Producer of the dependency 
+	dependencies[0].dstSubpass = 0;													// Consumer is our single subpass that will wait for the execution depdendency
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+	// Second dependency at the end the renderpass
+	// Does the transition from the initial to the final layout
+	dependencies[1].srcSubpass = 0;													// Producer of the dependency is our single subpass
+	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;								// Consumer are all commands outside of the renderpass
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+	dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+
+	// Create the actual renderpass
+	VkRenderPassCreateInfo renderPassInfo = {};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());		// Number of attachments used by this render pass
+	renderPassInfo.pAttachments = attachments.data();								// Descriptions of the attachments used by the render pass
+	renderPassInfo.subpassCount = 1;												// We only use one subpass in this example
+	renderPassInfo.pSubpasses = &subpassDescription;								// Description of that subpass
+	renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());	// Number of subpass dependencies
+	renderPassInfo.pDependencies = dependencies.data();								// Subpass dependencies used by the render pass
+
+	res = (vkCreateRenderPass(context.device, &renderPassInfo, nullptr, &context.render_pass));
+}
+
+void createViewports(struct LHContext& context, VkCommandBuffer& cmd, VkViewport& vp) {
+	vp.height = (float)context.height;
+	vp.width = (float)context.width;
+	vp.minDepth = (float)0.0f;
+	vp.maxDepth = (float)1.0f;
+	vp.x = 0;
+	vp.y = 0;
+	vkCmdSetViewport(cmd, 0, 1, &vp);
+}
+void createScisscor(struct LHContext& context, VkCommandBuffer& cmd, VkRect2D& sc) {
 	sc.extent.width = context.width;
 	sc.extent.height = context.height;
 	sc.offset.x = 0;
@@ -1171,18 +5152,27 @@ void cleanUpResources(struct LHContext& context) {
 	}
 
 	vkDestroyImageView(context.device, context.depth.view, nullptr);
-	vkDestroyImage(context.device, context.depth.image, nullptr);
-	vkFreeMemory(context.device, context.depth.mem, nullptr);
+	destroyImage(context, context.depth.image);
 
+	savePipelineCache(context);
 	vkDestroyPipelineCache(context.device, context.pipelineCache, nullptr);
 
+	retireStagingBuffers(context, true);
 	vkDestroyCommandPool(context.device, context.cmd_pool, nullptr);
 
-	vkDestroySemaphore(context.device, context.semaphores.presentComplete, nullptr);
-	vkDestroySemaphore(context.device, context.semaphores.renderComplete, nullptr);
-	for (auto& fence : context.waitFences) {
-		vkDestroyFence(context.device, fence, nullptr);
+	destroyRecordThreads(context);
+	destroyFrames(context);
+	for (auto& semaphore : context.renderComplete) {
+		vkDestroySemaphore(context.device, semaphore, nullptr);
+	}
+	for (auto& retired : context.retiredSemaphores) {
+		for (auto semaphore : retired.semaphores) {
+			vkDestroySemaphore(context.device, semaphore, nullptr);
+		}
 	}
+	vkDestroySemaphore(context.device, context.timeline, nullptr);
+
+	destroyMemoryAllocator(context);
 
 	vkDestroyInstance(context.instance, nullptr);
 }
@@ -1200,8 +5190,15 @@ std::string physicalDeviceTypeString(VkPhysicalDeviceType type) {
 	}
 }
 
+// glslang is brought up by the first compile and stays up for the life of the process,
+// initializing it around every shader cost more than compiling most of them
+static std::once_flag glslangInit;
+
 void init_glslang() {
-	glslang::InitializeProcess();
+	std::call_once(glslangInit, []() {
+		glslang::InitializeProcess();
+		std::atexit(finalize_glslang);
+	});
 }
 
 void finalize_glslang() {
@@ -1213,13 +5210,19 @@ void finalize_glslang() {
 // Return value of false means an error was encountered.
 //
 bool GLSLtoSPV(const VkShaderStageFlagBits shader_type, const char* pshader,
-	std::vector<unsigned int>& spirv) {
+	std::vector<unsigned int>& spirv, LHSpirvOptimization optimization, LHSpirvOptimizeReport* report, const TBuiltInResource* resources) {
 	EShLanguage stage = FindLanguage(shader_type);
 	glslang::TShader shader(stage);
 	glslang::TProgram program;
 	const char* shaderStrings[1];
+	// Without the device's limits glslang checks against generic ones
 	TBuiltInResource Resources;
-	init_resources(Resources);
+	if (resources) {
+		Resources = *resources;
+	}
+	else {
+		init_resources(Resources);
+	}
 
 	// Enable SPIR-V and Vulkan rules when parsing GLSL
 	EShMessages messages = (EShMessages)(EShMsgSpvRules | EShMsgVulkanRules);
@@ -1249,9 +5252,53 @@ bool GLSLtoSPV(const VkShaderStageFlagBits shader_type, const char* pshader,
 
 	glslang::GlslangToSpv(*program.getIntermediate(stage), spirv);
 
+	if (optimization != LH_SPIRV_OPTIMIZE_NONE) {
+		optimizeSpirv(spirv, optimization, report);
+	}
 	return true;
 }
 
+static uint32_t spirvInstructionCount(const std::vector<unsigned int>& spirv) {
+	uint32_t count = 0;
+	for (size_t i = 5; i < spirv.size() && (spirv[i] >> 16) > 0; i += spirv[i] >> 16) {
+		count++;
+	}
+	return count;
+}
+
+// Runs the preset over spirv in place. When a pass fails the module is left as glslang made it
+bool optimizeSpirv(std::vector<unsigned int>& spirv, LHSpirvOptimization optimization, LHSpirvOptimizeReport* report) {
+	spvtools::Optimizer optimizer(SPV_ENV_VULKAN_1_0);
+	optimizer.SetMessageConsumer([](spv_message_level_t level, const char*, const spv_position_t& position, const char* message) {
+		if (level <= SPV_MSG_ERROR) {
+			std::cout << "SPIR-V optimizer: " << message << " (word " << position.index << ")" << std::endl;
+		}
+	});
+	optimizer.RegisterPass(spvtools::CreateStripDebugInfoPass());
+	if (optimization == LH_SPIRV_OPTIMIZE_SIZE) {
+		optimizer.RegisterSizePasses();
+	}
+	else {
+		optimizer.RegisterPerformancePasses();
+	}
+	optimizer.RegisterPass(spvtools::CreateRemoveDuplicatesPass());
+
+	std::vector<uint32_t> optimized;
+	bool done = optimizer.Run(spirv.data(), spirv.size(), &optimized);
+	if (report) {
+		report->instructionsBefore = spirvInstructionCount(spirv);
+		report->bytesBefore = spirv.size() * sizeof(unsigned int);
+	}
+	if (done) {
+		spirv.assign(optimized.begin(), optimized.end());
+	}
+	if (report) {
+		report->instructionsAfter = spirvInstructionCount(spirv);
+		report->bytesAfter = spirv.size() * sizeof(unsigned int);
+	}
+	return done;
+}
+
 EShLanguage FindLanguage(const VkShaderStageFlagBits shader_type) {
 	switch (shader_type) {
 	case VK_SHADER_STAGE_VERTEX_BIT:
@@ -1372,6 +5419,88 @@ void init_resources(TBuiltInResource& Resources) {
 	Resources.limits.generalConstantMatrixVectorIndexing = 1;
 }
 
+// Some drivers report "unlimited" as UINT32_MAX, which glslang's int fields cannot hold
+static int resourceLimit(uint32_t value) {
+	return (int)std::min<uint32_t>(value, (uint32_t)std::numeric_limits<int>::max());
+}
+
+static int highestSampleCount(VkSampleCountFlags counts) {
+	int samples = 1;
+	while (counts >> 1) {
+		counts >>= 1;
+		samples <<= 1;
+	}
+	return samples;
+}
+
+// The defaults above with everything Vulkan reports replaced by the GPU's own limits. Limits that only exist in
+// OpenGL (lights, uniform components, atomic counters) keep their defaults
+void init_resources(TBuiltInResource& Resources, const VkPhysicalDeviceLimits& limits) {
+	init_resources(Resources);
+
+	Resources.maxVertexAttribs = resourceLimit(limits.maxVertexInputAttributes);
+	Resources.maxVertexOutputComponents = resourceLimit(limits.maxVertexOutputComponents);
+	Resources.maxVertexOutputVectors = resourceLimit(limits.maxVertexOutputComponents / 4);
+	Resources.maxVaryingComponents = resourceLimit(limits.maxVertexOutputComponents);
+	Resources.maxVaryingFloats = resourceLimit(limits.maxVertexOutputComponents);
+	Resources.maxVaryingVectors = resourceLimit(limits.maxVertexOutputComponents / 4);
+	Resources.maxFragmentInputComponents = resourceLimit(limits.maxFragmentInputComponents);
+	Resources.maxFragmentInputVectors = resourceLimit(limits.maxFragmentInputComponents / 4);
+	Resources.maxDrawBuffers = resourceLimit(limits.maxFragmentOutputAttachments);
+	Resources.maxCombinedShaderOutputResources = resourceLimit(limits.maxFragmentCombinedOutputResources);
+	Resources.minProgramTexelOffset = limits.minTexelOffset;
+	Resources.maxProgramTexelOffset = resourceLimit(limits.maxTexelOffset);
+
+	Resources.maxComputeWorkGroupCountX = resourceLimit(limits.maxComputeWorkGroupCount[0]);
+	Resources.maxComputeWorkGroupCountY = resourceLimit(limits.maxComputeWorkGroupCount[1]);
+	Resources.maxComputeWorkGroupCountZ = resourceLimit(limits.maxComputeWorkGroupCount[2]);
+	Resources.maxComputeWorkGroupSizeX = resourceLimit(limits.maxComputeWorkGroupSize[0]);
+	Resources.maxComputeWorkGroupSizeY = resourceLimit(limits.maxComputeWorkGroupSize[1]);
+	Resources.maxComputeWorkGroupSizeZ = resourceLimit(limits.maxComputeWorkGroupSize[2]);
+
+	Resources.maxGeometryInputComponents = resourceLimit(limits.maxGeometryInputComponents);
+	Resources.maxGeometryOutputComponents = resourceLimit(limits.maxGeometryOutputComponents);
+	Resources.maxGeometryOutputVertices = resourceLimit(limits.maxGeometryOutputVertices);
+	Resources.maxGeometryTotalOutputComponents = resourceLimit(limits.maxGeometryTotalOutputComponents);
+
+	Resources.maxTessControlInputComponents = resourceLimit(limits.maxTessellationControlPerVertexInputComponents);
+	Resources.maxTessControlOutputComponents = resourceLimit(limits.maxTessellationControlPerVertexOutputComponents);
+	Resources.maxTessControlTotalOutputComponents = resourceLimit(limits.maxTessellationControlTotalOutputComponents);
+	Resources.maxTessEvaluationInputComponents = resourceLimit(limits.maxTessellationEvaluationInputComponents);
+	Resources.maxTessEvaluationOutputComponents = resourceLimit(limits.maxTessellationEvaluationOutputComponents);
+	Resources.maxTessPatchComponents = resourceLimit(limits.maxTessellationControlPerPatchOutputComponents);
+	Resources.maxPatchVertices = resourceLimit(limits.maxTessellationPatchSize);
+	Resources.maxTessGenLevel = resourceLimit(limits.maxTessellationGenerationLevel);
+
+	// Per stage descriptor limits stand in for GL's texture and image units
+	int sampledImages = resourceLimit(limits.maxPerStageDescriptorSampledImages);
+	int storageImages = resourceLimit(limits.maxPerStageDescriptorStorageImages);
+	Resources.maxTextureImageUnits = sampledImages;
+	Resources.maxVertexTextureImageUnits = sampledImages;
+	Resources.maxGeometryTextureImageUnits = sampledImages;
+	Resources.maxTessControlTextureImageUnits = sampledImages;
+	Resources.maxTessEvaluationTextureImageUnits = sampledImages;
+	Resources.maxComputeTextureImageUnits = sampledImages;
+	Resources.maxCombinedTextureImageUnits = resourceLimit(limits.maxDescriptorSetSampledImages);
+	Resources.maxImageUnits = storageImages;
+	Resources.maxFragmentImageUniforms = storageImages;
+	Resources.maxComputeImageUniforms = storageImages;
+	Resources.maxCombinedImageUniforms = resourceLimit(limits.maxDescriptorSetStorageImages);
+	Resources.maxCombinedImageUnitsAndFragmentOutputs = resourceLimit(limits.maxFragmentCombinedOutputResources);
+
+	Resources.maxViewports = resourceLimit(limits.maxViewports);
+	Resources.maxClipDistances = resourceLimit(limits.maxClipDistances);
+	Resources.maxCullDistances = resourceLimit(limits.maxCullDistances);
+	Resources.maxCombinedClipAndCullDistances = resourceLimit(limits.maxCombinedClipAndCullDistances);
+	Resources.maxSamples = highestSampleCount(limits.framebufferColorSampleCounts & limits.framebufferDepthSampleCounts);
+	Resources.maxImageSamples = highestSampleCount(limits.storageImageSampleCounts);
+}
+
+static const TBuiltInResource* deviceShaderResources(struct LHContext& context) {
+	// Shaders compiled before createDeviceInfo use the defaults
+	return context.physicalDevice != VK_NULL_HANDLE ? &context.shaderResources : nullptr;
+}
+
 VkShaderModule loadSPIRVShader(struct LHContext& context, std::string filename) {
 	VkResult U_ASSERT_ONLY res;
 	size_t shaderSize;
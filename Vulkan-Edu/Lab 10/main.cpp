@@ -24,12 +24,12 @@ struct appState {
 	struct indices i[2];
 	float* vBuffer;
 
-	// Uniform buffer block object
+	// Uniform buffer block objects, slices of every frame region in the ring
 	struct {
-		VkDeviceMemory memory;
-		VkBuffer buffer;
+		uint32_t slice;
 		VkDescriptorBufferInfo descriptor;
 	}  uniformBufferVS[2];
+	struct LHUniformRing uniformRing;
 
 
 
@@ -122,7 +122,11 @@ void buildCommandBuffers(struct LHContext& context, struct appState& state) {
 
 		vkCmdSetLineWidth(context.cmdBuffer[i], 1.0f);
 
-		vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayout, 0, 1, &state.descriptorSet, 0, nullptr);
+		// Dynamic offsets (in binding order) select the ring region that belongs to this command buffer
+		uint32_t dynamicOffsets[2] = {
+			uniformRingOffset(state.uniformRing, i, state.uniformBufferVS[0].slice),
+			uniformRingOffset(state.uniformRing, i, state.uniformBufferVS[1].slice) };
+		vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayout, 0, 1, &state.descriptorSet, 2, dynamicOffsets);
 
 		VkDeviceSize offsets[1] = { 0 };
 		//Plane
@@ -154,10 +158,10 @@ void setupDescriptorPool(struct LHContext& context, struct appState& state) {
 	// We need to tell the API the number of max. requested descriptors per type
 	VkDescriptorPoolSize typeCounts[2];
 	// This example only uses one descriptor type (uniform buffer) and only requests one descriptor of this type
-	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	typeCounts[0].descriptorCount = 1;
 
-	typeCounts[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	typeCounts[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	typeCounts[1].descriptorCount = 1;
 
 	// Create the global descriptor pool
@@ -200,14 +204,14 @@ void setupDescriptorSetLayout(struct LHContext& context, struct appState& state)
 
 	// Binding 0: Uniform buffer (Geometry shader)
 	std::array<VkDescriptorSetLayoutBinding, 2>layoutBinding = {};
-	layoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	layoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	layoutBinding[0].descriptorCount = 1;
 	layoutBinding[0].binding = 0;
 	layoutBinding[0].stageFlags = VK_SHADER_STAGE_GEOMETRY_BIT;
 	layoutBinding[0].pImmutableSamplers = nullptr;
 
 	// Binding 0: Uniform buffer (Geometry shader)
-	layoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	layoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	layoutBinding[1].descriptorCount = 1;
 	layoutBinding[1].binding = 1;
 	layoutBinding[1].stageFlags = VK_SHADER_STAGE_GEOMETRY_BIT;
@@ -253,7 +257,7 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 	writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	writeDescriptorSet[0].dstSet = state.descriptorSet;
 	writeDescriptorSet[0].descriptorCount = 1;
-	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	writeDescriptorSet[0].pBufferInfo = &state.uniformBufferVS[0].descriptor;
 	// Binds this uniform buffer to binding point 0
 	writeDescriptorSet[0].dstBinding = 0;
@@ -262,7 +266,7 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 	writeDescriptorSet[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	writeDescriptorSet[1].dstSet = state.descriptorSet;
 	writeDescriptorSet[1].descriptorCount = 1;
-	writeDescriptorSet[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	writeDescriptorSet[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	writeDescriptorSet[1].pBufferInfo = &state.uniformBufferVS[1].descriptor;
 	// Binds this uniform buffer to binding point 0
 	writeDescriptorSet[1].dstBinding = 1;
@@ -411,7 +415,6 @@ void preparePipelines(struct LHContext& context, struct appState& state) {
 }
 
 void updateUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
 
 	// Calculate some variables
 	float aspectRatio = (float)(context.width * 0.5f) / (float)context.height;
@@ -457,62 +460,32 @@ void updateUniformBuffers(struct LHContext& context, struct appState& state) {
 	state.uboVS.projectionMatrix[1] = glm::frustum(left, right, bottom, top, zNear, zFar);
 	state.uboVS.modelMatrix[1] = rotM * transM;
 
-	// Map uniform buffer and update it
-	uint8_t* pData;
-	res = (vkMapMemory(context.device, state.uniformBufferVS[0].memory, 0, sizeof(state.uboVS), 0, (void**)&pData));
-	memcpy(pData, &state.uboVS, sizeof(state.uboVS));
-	// Unmap after data has been copied
-	// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-	vkUnmapMemory(context.device, state.uniformBufferVS[0].memory);
+	// Write into the current frame's slice, the ring stays mapped and is host coherent so no map/unmap or flush is needed
+	memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, state.uniformBufferVS[0].slice), &state.uboVS, sizeof(state.uboVS));
 
 	state.uboFS.lightPos = glm::vec4(1.0, -0.5, 0.0, 1.0);
 	state.uboFS.ambientStrenght = 0.1;
 	state.uboFS.specularStrenght = 0.5;
 
-	res = (vkMapMemory(context.device, state.uniformBufferVS[1].memory, 0, sizeof(state.uboFS), 0, (void**)&pData));
-	memcpy(pData, &state.uboFS, sizeof(state.uboFS));
-	// Unmap after data has been copied
-	// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-	vkUnmapMemory(context.device, state.uniformBufferVS[1].memory);
+	memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, state.uniformBufferVS[1].slice), &state.uboFS, sizeof(state.uboFS));
 }
 
 void prepareUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
 	// Prepare and initialize a uniform buffer block containing shader uniforms
 	// Single uniforms like in OpenGL are no longer present in Vulkan. All Shader uniforms are passed via uniform buffer blocks
-	VkMemoryRequirements memReqs;
 
-	// Vertex shader uniform buffer block
-	VkBufferCreateInfo bufferInfo = {};
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.pNext = nullptr;
-	allocInfo.allocationSize = 0;
-	allocInfo.memoryTypeIndex = 0;
-
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = sizeof(state.uboVS);
-	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-
-	bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		state.uniformBufferVS[0].buffer, state.uniformBufferVS[0].memory);
+	// Vertex and fragment shader uniform buffer blocks, one aligned slice each per frame in flight
+	state.uniformBufferVS[0].slice = reserveUniformSlice(context, state.uniformRing, sizeof(state.uboVS));
+	state.uniformBufferVS[1].slice = reserveUniformSlice(context, state.uniformRing, sizeof(state.uboFS));
+	createUniformRing(context, state.uniformRing, context.swapchainImageCount);
 
 	// Store information in the uniform's descriptor that is used by the descriptor set
-	state.uniformBufferVS[0].descriptor.buffer = state.uniformBufferVS[0].buffer;
+	// The offsets stay 0, the frame region is selected with dynamic offsets when binding
+	state.uniformBufferVS[0].descriptor.buffer = state.uniformRing.buffer;
 	state.uniformBufferVS[0].descriptor.offset = 0;
 	state.uniformBufferVS[0].descriptor.range = sizeof(state.uboVS);
 
-	bufferInfo = {};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = sizeof(state.uboFS);
-	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-
-	bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		state.uniformBufferVS[1].buffer, state.uniformBufferVS[1].memory);
-
-	// Store information in the uniform's descriptor that is used by the descriptor set
-	state.uniformBufferVS[1].descriptor.buffer = state.uniformBufferVS[1].buffer;
+	state.uniformBufferVS[1].descriptor.buffer = state.uniformRing.buffer;
 	state.uniformBufferVS[1].descriptor.offset = 0;
 	state.uniformBufferVS[1].descriptor.range = sizeof(state.uboFS);
 
@@ -575,8 +548,8 @@ void prepareVerticesPlane(struct LHContext& context, struct appState& state, boo
 
 	state.i[0].count = 6;
 
-	mapIndiciesToGPU(context, indexes, sizeof(indexes), state.i[0].buffer, state.i[0].memory);
-	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v[0].buffer, state.v[0].memory);
+	mapIndiciesToGPU(context, indexes, sizeof(indexes), state.i[0].buffer, state.i[0].memory, useStagingBuffers);
+	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v[0].buffer, state.v[0].memory, useStagingBuffers);
 
 	//// Vertex input descriptions 
 	//// Specifies the vertex input parameters for a pipeline
@@ -678,8 +651,8 @@ void prepareVertices(struct LHContext& context, struct appState& state, bool use
 
 	state.i[1].count = ni;
 
-	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.i[1].buffer, state.i[1].memory);
-	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v[1].buffer, state.v[1].memory);
+	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.i[1].buffer, state.i[1].memory, useStagingBuffers);
+	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v[1].buffer, state.v[1].memory, useStagingBuffers);
 
 	//// Vertex input descriptions 
 	//// Specifies the vertex input parameters for a pipeline
@@ -713,14 +686,26 @@ void prepareVertices(struct LHContext& context, struct appState& state, bool use
 void renderLoop(struct LHContext& context, struct appState& state) {
 
 	while (!glfwWindowShouldClose(context.window)) {
-		glfwPollEvents();
-		draw(context);
+		waitForEvents(context);
 		if (update) {
-			updateUniformBuffers(context, state);
+			markUniformRingDirty(state.uniformRing);
+			markFrameDirty(context);
 			update = false;
 		}
+		// Nothing changed since the last presented image, keep sleeping
+		if (!frameNeeded(context)) {
+			continue;
+		}
+		acquireFrame(context);
+		// Each ring region is rewritten once its previous frame has finished, never while the GPU reads it
+		if (uniformRingStale(state.uniformRing, context.currentBuffer)) {
+			updateUniformBuffers(context, state);
+		}
+		submitFrame(context);
 	}
 
+	printFrameStats(context);
+
 	// Flush device to make sure all resources can be freed
 	if (context.device != VK_NULL_HANDLE) {
 		vkDeviceWaitIdle(context.device);
@@ -787,14 +772,24 @@ int main() {
 	prepareVerticesPlane(context, state, false);
 	prepareUniformBuffers(context, state);
 	setupDescriptorSetLayout(context, state);
-	preparePipelines(context, state);
+	timePipelineCreation(context, [&]() { preparePipelines(context, state); });
+	printShaderCacheStats(context);
 	setupDescriptorPool(context, state);
 	setupDescriptorSet(context, state);
 	buildCommandBuffers(context, state);
 
 	glfwSetKeyCallback(context.window, key_callback);
+	// Only redraw when the view changes
+	context.renderOnDemand = true;
+	// The new frame buffers need new command buffers, and the projection follows the aspect ratio
+	context.onSwapChainRecreated = [&]() {
+		buildCommandBuffers(context, state);
+		markUniformRingDirty(state.uniformRing);
+	};
 
 	renderLoop(context, state);
+	// The next run starts with these pipelines already compiled
+	savePipelineCache(context);
 
 	return 0;
 }
\ No newline at end of file
@@ -23,12 +23,12 @@ struct appState {
 	struct indices i;
 	float* vBuffer;
 
-	// Uniform buffer block object
+	// Uniform buffer block object, a slice of every frame region in the ring
 	struct {
-		VkDeviceMemory memory;
-		VkBuffer buffer;
+		uint32_t slice;
 		VkDescriptorBufferInfo descriptor;
 	}  uniformBufferVS;
+	struct LHUniformRing uniformRing;
 
 	struct {
 		glm::mat4 projectionMatrix;
@@ -91,7 +91,9 @@ void buildCommandBuffers(struct LHContext& context, struct appState& state) {
 		VkRect2D scissor = {};
 		createScisscor(context, context.cmdBuffer[i], scissor);
 
-		vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayout, 0, 1, &state.descriptorSet, 0, nullptr);
+		// The dynamic offset selects the ring region that belongs to this command buffer
+		uint32_t dynamicOffset = uniformRingOffset(state.uniformRing, i, state.uniformBufferVS.slice);
+		vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayout, 0, 1, &state.descriptorSet, 1, &dynamicOffset);
 		vkCmdBindPipeline(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipeline);
 
 		VkDeviceSize offsets[1] = { 0 };
@@ -118,7 +120,7 @@ void setupDescriptorPool(struct LHContext& context, struct appState& state) {
 	// We need to tell the API the number of max. requested descriptors per type
 	VkDescriptorPoolSize typeCounts[1];
 	// This example only uses one descriptor type (uniform buffer) and only requests one descriptor of this type
-	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	typeCounts[0].descriptorCount = 1;
 
 	// Create the global descriptor pool
@@ -144,7 +146,7 @@ void setupDescriptorSetLayout(struct LHContext& context, struct appState& state)
 
 	// Binding 0: Uniform buffer (Vertex shader)
 	VkDescriptorSetLayoutBinding layoutBinding = {};
-	layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	layoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	layoutBinding.descriptorCount = 1;
 	layoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 	layoutBinding.pImmutableSamplers = nullptr;
@@ -189,7 +191,7 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 	writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	writeDescriptorSet.dstSet = state.descriptorSet;
 	writeDescriptorSet.descriptorCount = 1;
-	writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	writeDescriptorSet.pBufferInfo = &state.uniformBufferVS.descriptor;
 	// Binds this uniform buffer to binding point 0
 	writeDescriptorSet.dstBinding = 0;
@@ -309,7 +311,6 @@ void preparePipelines(struct LHContext& context, struct appState& state) {
 }
 
 void updateUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
 	// Update matrices
 	state.uboVS.projectionMatrix = glm::perspective(glm::radians(60.0f), (float)context.width / (float)context.height, 0.1f, 256.0f);
 
@@ -322,39 +323,21 @@ void updateUniformBuffers(struct LHContext& context, struct appState& state) {
 	state.uboVS.modelMatrix = glm::rotate(state.uboVS.modelMatrix, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
 	state.uboVS.modelMatrix = glm::rotate(state.uboVS.modelMatrix, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
 
-	// Map uniform buffer and update it
-	uint8_t* pData;
-	res = (vkMapMemory(context.device, state.uniformBufferVS.memory, 0, sizeof(state.uboVS), 0, (void**)&pData));
-	memcpy(pData, &state.uboVS, sizeof(state.uboVS));
-	// Unmap after data has been copied
-	// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-	vkUnmapMemory(context.device, state.uniformBufferVS.memory);
+	// Write into the current frame's slice, the ring stays mapped and is host coherent so no map/unmap or flush is needed
+	memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, state.uniformBufferVS.slice), &state.uboVS, sizeof(state.uboVS));
 }
 
 void prepareUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
 	// Prepare and initialize a uniform buffer block containing shader uniforms
 	// Single uniforms like in OpenGL are no longer present in Vulkan. All Shader uniforms are passed via uniform buffer blocks
-	VkMemoryRequirements memReqs;
-
-	// Vertex shader uniform buffer block
-	VkBufferCreateInfo bufferInfo = {};
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.pNext = nullptr;
-	allocInfo.allocationSize = 0;
-	allocInfo.memoryTypeIndex = 0;
-
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = sizeof(state.uboVS);
-	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
 
-	bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		state.uniformBufferVS.buffer, state.uniformBufferVS.memory);
+	// Vertex shader uniform buffer block, one aligned slice per frame in flight
+	state.uniformBufferVS.slice = reserveUniformSlice(context, state.uniformRing, sizeof(state.uboVS));
+	createUniformRing(context, state.uniformRing, context.swapchainImageCount);
 
 	// Store information in the uniform's descriptor that is used by the descriptor set
-	state.uniformBufferVS.descriptor.buffer = state.uniformBufferVS.buffer;
+	// The offset stays 0, the frame region is selected with a dynamic offset when binding
+	state.uniformBufferVS.descriptor.buffer = state.uniformRing.buffer;
 	state.uniformBufferVS.descriptor.offset = 0;
 	state.uniformBufferVS.descriptor.range = sizeof(state.uboVS);
 
@@ -595,8 +578,8 @@ void prepareVertices(struct LHContext& context, struct appState& state, bool use
 
 	state.i.count = ni;
 
-	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.i.buffer, state.i.memory);
-	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v.buffer, state.v.memory);
+	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.i.buffer, state.i.memory, useStagingBuffers);
+	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v.buffer, state.v.memory, useStagingBuffers);
 
 	//// Vertex input descriptions 
 	//// Specifies the vertex input parameters for a pipeline
@@ -630,14 +613,26 @@ void prepareVertices(struct LHContext& context, struct appState& state, bool use
 void renderLoop(struct LHContext& context, struct appState& state) {
 
 	while (!glfwWindowShouldClose(context.window)) {
-		glfwPollEvents();
-		draw(context);
+		waitForEvents(context);
 		if (update) {
-			updateUniformBuffers(context, state);
+			markUniformRingDirty(state.uniformRing);
+			markFrameDirty(context);
 			update = false;
 		}
+		// Nothing changed since the last presented image, keep sleeping
+		if (!frameNeeded(context)) {
+			continue;
+		}
+		acquireFrame(context);
+		// Each ring region is rewritten once its previous frame has finished, never while the GPU reads it
+		if (uniformRingStale(state.uniformRing, context.currentBuffer)) {
+			updateUniformBuffers(context, state);
+		}
+		submitFrame(context);
 	}
 
+	printFrameStats(context);
+
 	// Flush device to make sure all resources can be freed
 	if (context.device != VK_NULL_HANDLE) {
 		vkDeviceWaitIdle(context.device);
@@ -717,14 +712,24 @@ int main() {
 	prepareUniformBuffers(context, state);
 	setupDescriptorSetLayout(context, state);
 	prepareShaders(context, state);
-	preparePipelines(context, state);
+	timePipelineCreation(context, [&]() { preparePipelines(context, state); });
+	printShaderCacheStats(context);
 	setupDescriptorPool(context, state);
 	setupDescriptorSet(context, state);
 	buildCommandBuffers(context, state);
 
 	glfwSetKeyCallback(context.window, key_callback);
+	// Only redraw when the view changes
+	context.renderOnDemand = true;
+	// The new frame buffers need new command buffers, and the projection follows the aspect ratio
+	context.onSwapChainRecreated = [&]() {
+		buildCommandBuffers(context, state);
+		markUniformRingDirty(state.uniformRing);
+	};
 
 	renderLoop(context, state);
+	// The next run starts with these pipelines already compiled
+	savePipelineCache(context);
 
 	return 0;
 }
\ No newline at end of file
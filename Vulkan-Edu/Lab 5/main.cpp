@@ -3,12 +3,24 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <fstream>
+#include <chrono>
 
 #include "LHVulkan.h"
 #include "cube_data.h"
 #include "tiny_obj_loader.h"
 
 #define OBJ_MESH
+// Number of cubes drawn from the shared dynamic uniform buffer, raise (e.g. to 10000) to measure CPU frame time
+#define CUBE_COUNT 2
+// Frames the CPU may queue ahead of the GPU, 3 hides more GPU time at the cost of a frame of input latency
+#define FRAMES_IN_FLIGHT 2
+// LH_PRESENT_LOW_LATENCY, LH_PRESENT_VSYNC or LH_PRESENT_POWER_SAVER, and the limit of queued frames (0 = frames in flight)
+#define PRESENT_POLICY LH_PRESENT_LOW_LATENCY
+#define MAX_FRAME_LATENCY 0
+// Draw only when something changes (e.g. with animation off) instead of continuously
+#define RENDER_ON_DEMAND false
+// Render on its own thread while the main thread only pumps window events, false keeps the single thread loop
+#define RENDER_THREAD false
 #define WIDTH 512
 #define HEIGHT 512
 
@@ -22,26 +34,28 @@ struct appState {
 			glm::mat4 modelMatrix;
 		}uboVS;
 
-		struct vertices v;
-		struct indices i;
-		float* vBuffer;
-
-		VkDescriptorSet descriptorSet;
-
-		// Uniform buffer block object
-		struct UniformBuffer {
-			VkDeviceMemory memory;
-			VkBuffer buffer;
-			VkDescriptorBufferInfo descriptor;
-		}  uniformBuffer[2];
-
 		struct Lighting {
 			glm::vec3 lightPos;
 			float ambientStrenght;
 			float specularStrenght;
 		}uboFS;
+
+		glm::vec3 position;
+		// Offsets of the cube's VS and FS blocks inside a frame region of the shared uniform buffer
+		uint32_t uniformSlice[2];
 	};
-	std::array<Model, 2> cubes;
+	std::vector<Model> cubes;
+
+	// Every cube draws the same mesh
+	struct vertices v;
+	struct indices i;
+	float* vBuffer;
+
+	// One dynamic uniform buffer holds the blocks of all cubes, a single descriptor set points at it
+	// and each draw selects its cube with dynamic offsets
+	struct LHUniformRing uniformRing;
+	VkDescriptorBufferInfo uniformDescriptor[2];
+	VkDescriptorSet descriptorSet;
 
 	VkPipelineLayout pipelineLayout;
 	VkPipeline pipeline;
@@ -57,6 +71,7 @@ glm::vec3 cameraPos = glm::vec3();
 glm::vec2 mousePos;
 
 bool update = false;
+bool animate = false;	// Rotate the cubes every frame, so every frame rewrites all uniform blocks
 float eyex, eyey, eyez;	// current user position
 
 double theta, phi;		// user's position  on a sphere centered on the object
@@ -99,13 +114,17 @@ void buildCommandBuffers(struct LHContext& context, struct appState& state) {
 		createScisscor(context, context.cmdBuffer[i], scissor);
 
 		VkDeviceSize offsets[1] = { 0 };
-		vkCmdBindVertexBuffers(context.cmdBuffer[i], 0, 1, &state.cubes[0].v.buffer, offsets);
-		vkCmdBindIndexBuffer(context.cmdBuffer[i], state.cubes[0].i.buffer, 0, VK_INDEX_TYPE_UINT32);
+		vkCmdBindVertexBuffers(context.cmdBuffer[i], 0, 1, &state.v.buffer, offsets);
+		vkCmdBindIndexBuffer(context.cmdBuffer[i], state.i.buffer, 0, VK_INDEX_TYPE_UINT32);
 
 		for (auto& cube : state.cubes) {
-			// Bind the cube's descriptor set. This tells the command buffer to use the uniform buffer and image set for this cube
-			vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayout, 0, 1, &cube.descriptorSet, 0, nullptr);
-			vkCmdDrawIndexed(context.cmdBuffer[i], state.cubes[0].i.count, 1, 0, 0, 0);
+			// Rebind the shared descriptor set, only the dynamic offsets (in binding order) change from cube to cube.
+			// They select the cube's blocks in the ring region of this command buffer
+			uint32_t dynamicOffsets[2] = {
+				uniformRingOffset(state.uniformRing, i, cube.uniformSlice[0]),
+				uniformRingOffset(state.uniformRing, i, cube.uniformSlice[1]) };
+			vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayout, 0, 1, &state.descriptorSet, 2, dynamicOffsets);
+			vkCmdDrawIndexed(context.cmdBuffer[i], state.i.count, 1, 0, 0, 0);
 		}
 
 		vkCmdEndRenderPass(context.cmdBuffer[i]);
@@ -134,13 +153,13 @@ void setupDescriptorPool(struct LHContext& context, struct appState& state) {
 
 
 	// We need to tell the API the number of max. requested descriptors per type
+	// All cubes share one set with two dynamic uniform buffers, independent of the cube count
 	VkDescriptorPoolSize typeCounts[2];
-	// This example only uses one descriptor type (uniform buffer) and only requests one descriptor of this type
-	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	typeCounts[0].descriptorCount = 1 + static_cast<uint32_t>(state.cubes.size());
+	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	typeCounts[0].descriptorCount = 1;
 
-	typeCounts[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	typeCounts[1].descriptorCount = static_cast<uint32_t>(state.cubes.size());
+	typeCounts[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	typeCounts[1].descriptorCount = 1;
 
 	// Create the global descriptor pool
 	// All descriptors used in this example are allocated from this pool
@@ -150,7 +169,7 @@ void setupDescriptorPool(struct LHContext& context, struct appState& state) {
 	descriptorPoolInfo.poolSizeCount = 2;
 	descriptorPoolInfo.pPoolSizes = typeCounts;
 	// Set the max. number of descriptor sets that can be requested from this pool (requesting beyond this limit will result in an error)
-	descriptorPoolInfo.maxSets = static_cast<uint32_t>(state.cubes.size());
+	descriptorPoolInfo.maxSets = 1;
 
 	res = (vkCreateDescriptorPool(context.device, &descriptorPoolInfo, nullptr, &context.descriptorPool));
 	assert(res == VK_SUCCESS);
@@ -182,14 +201,14 @@ void setupDescriptorSetLayout(struct LHContext& context, struct appState& state)
 
 	// Binding 0: Uniform buffer (Vertex shader)
 	std::array<VkDescriptorSetLayoutBinding, 2>layoutBinding = {};
-	layoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	layoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	layoutBinding[0].descriptorCount = 1;
 	layoutBinding[0].binding = 0;
 	layoutBinding[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 	layoutBinding[0].pImmutableSamplers = nullptr;
 
 	// Binding 1: Uniform buffer (Fragment shader)
-	layoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	layoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	layoutBinding[1].descriptorCount = 1;
 	layoutBinding[1].binding = 1;
 	layoutBinding[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
@@ -212,50 +231,44 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 
 	Descriptor sets
 
-	Using the shared descriptor set layout and the descriptor pool we will now allocate the descriptor sets.
+	Using the shared descriptor set layout and the descriptor pool we will now allocate the descriptor set.
 
 	Descriptor sets contain the actual descriptor fo the objects (buffers, images) used at render time.
+	A single set is shared by all cubes, the cube is picked with dynamic offsets at bind time.
 
 	*/
 
-	for (auto& cube : state.cubes) {
-		// Allocate a new descriptor set from the global descriptor pool
-		VkDescriptorSetAllocateInfo allocInfo = {};
-		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-		allocInfo.descriptorPool = context.descriptorPool;
-		allocInfo.descriptorSetCount = 1;
-		allocInfo.pSetLayouts = &state.descriptorSetLayout;
-
-		res = (vkAllocateDescriptorSets(context.device, &allocInfo, &cube.descriptorSet));
-		assert(res == VK_SUCCESS);
+	// Allocate a new descriptor set from the global descriptor pool
+	VkDescriptorSetAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = context.descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &state.descriptorSetLayout;
 
-		std::array<VkWriteDescriptorSet, 2> writeDescriptorSet = {};
-
-		// Binding 0 : Uniform buffer VS
-		writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		writeDescriptorSet[0].dstSet = cube.descriptorSet;
-		writeDescriptorSet[0].descriptorCount = 1;
-		writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		writeDescriptorSet[0].pBufferInfo = &cube.uniformBuffer[0].descriptor;
-		// Binds this uniform buffer to binding point 0
-		writeDescriptorSet[0].dstBinding = 0;
-
-		// Binding 0 : Uniform buffer FS
-		writeDescriptorSet[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		writeDescriptorSet[1].dstSet = cube.descriptorSet;
-		writeDescriptorSet[1].descriptorCount = 1;
-		writeDescriptorSet[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		writeDescriptorSet[1].pBufferInfo = &cube.uniformBuffer[1].descriptor;
-		// Binds this uniform buffer to binding point 0
-		writeDescriptorSet[1].dstBinding = 1;
-
-		// Execute the writes to update descriptors for this set
-		// Note that it's also possible to gather all writes and only run updates once, even for multiple sets
-		// This is possible because each VkWriteDescriptorSet also contains the destination set to be updated
-		// For simplicity we will update once per set instead
-
-		vkUpdateDescriptorSets(context.device, static_cast<uint32_t>(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, nullptr);
-	}
+	res = (vkAllocateDescriptorSets(context.device, &allocInfo, &state.descriptorSet));
+	assert(res == VK_SUCCESS);
+
+	std::array<VkWriteDescriptorSet, 2> writeDescriptorSet = {};
+
+	// Binding 0 : Uniform buffer VS
+	writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writeDescriptorSet[0].dstSet = state.descriptorSet;
+	writeDescriptorSet[0].descriptorCount = 1;
+	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	writeDescriptorSet[0].pBufferInfo = &state.uniformDescriptor[0];
+	// Binds this uniform buffer to binding point 0
+	writeDescriptorSet[0].dstBinding = 0;
+
+	// Binding 1 : Uniform buffer FS
+	writeDescriptorSet[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writeDescriptorSet[1].dstSet = state.descriptorSet;
+	writeDescriptorSet[1].descriptorCount = 1;
+	writeDescriptorSet[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	writeDescriptorSet[1].pBufferInfo = &state.uniformDescriptor[1];
+	// Binds this uniform buffer to binding point 1
+	writeDescriptorSet[1].dstBinding = 1;
+
+	vkUpdateDescriptorSets(context.device, static_cast<uint32_t>(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, nullptr);
 }
 
 void preparePipelines(struct LHContext& context, struct appState& state) {
@@ -382,83 +395,99 @@ void preparePipelines(struct LHContext& context, struct appState& state) {
 	assert(res == VK_SUCCESS);
 }
 
-void updateUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-	uint8_t* pData;
-
-	state.cubes[0].uboVS.modelMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(-2.0f, 0.0f, 0.0f));
-	state.cubes[1].uboVS.modelMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(2.0f, 0.0f, 0.0f));
+// Lays the cubes out on a grid around the origin and alternates between two lighting setups,
+// with two cubes this gives the original pair at x = -2 and x = 2
+void arrangeCubes(struct appState& state) {
+	const float spacing = 4.0f;
+	uint32_t count = static_cast<uint32_t>(state.cubes.size());
+	uint32_t columns = static_cast<uint32_t>(ceil(sqrt((double)count)));
+	uint32_t rows = (count + columns - 1) / columns;
+
+	for (uint32_t n = 0; n < count; n++) {
+		auto& cube = state.cubes[n];
+		cube.position = glm::vec3(((n % columns) - (columns - 1) * 0.5f) * spacing, ((n / columns) - (rows - 1) * 0.5f) * spacing, 0.0f);
+
+		if (n % 2 == 0) {
+			cube.uboFS.lightPos = glm::vec3(1.0, -0.5, 0.0);
+			cube.uboFS.ambientStrenght = 0.1;
+			cube.uboFS.specularStrenght = 0.5;
+		}
+		else {
+			cube.uboFS.lightPos = glm::vec3(0.0, -0.5, 1.0);
+			cube.uboFS.ambientStrenght = 0.3;
+			cube.uboFS.specularStrenght = 0.5;
+		}
+	}
+}
 
-	state.cubes[0].uboFS.lightPos = glm::vec3(1.0, -0.5, 0.0);
-	state.cubes[0].uboFS.ambientStrenght = 0.1;
-	state.cubes[0].uboFS.specularStrenght = 0.5;
+void updateUniformBuffers(struct LHContext& context, struct appState& state) {
+	// The camera is the same for every cube
+	glm::mat4 projectionMatrix = glm::perspective(glm::radians(60.0f), (float)context.width / (float)context.height, 0.1f, 256.0f);
+	glm::mat4 viewMatrix = glm::lookAt(glm::vec3(eyex, eyey, eyez),
+		glm::vec3(0.0f, 0.0f, 0.0f),
+		glm::vec3(0.0f, 0.0f, 1.0f));
 
-	state.cubes[1].uboFS.lightPos = glm::vec3(0.0, -0.5, 1.0);
-	state.cubes[1].uboFS.ambientStrenght = 0.3;
-	state.cubes[1].uboFS.specularStrenght = 0.5;
-	
 	for (auto& cube : state.cubes) {
-		cube.uboVS.projectionMatrix = glm::perspective(glm::radians(60.0f), (float)context.width / (float)context.height, 0.1f, 256.0f);
-		cube.uboVS.viewMatrix = glm::lookAt(glm::vec3(eyex, eyey, eyez),
-			glm::vec3(0.0f, 0.0f, 0.0f),
-			glm::vec3(0.0f, 0.0f, 1.0f));
+		cube.uboVS.projectionMatrix = projectionMatrix;
+		cube.uboVS.viewMatrix = viewMatrix;
 
+		cube.uboVS.modelMatrix = glm::translate(glm::mat4(1.0f), cube.position);
 		cube.uboVS.modelMatrix = glm::translate(cube.uboVS.modelMatrix, glm::vec3(1.0, 0.0, 0.0));
 		cube.uboVS.modelMatrix = glm::rotate(cube.uboVS.modelMatrix, glm::radians(rotation.x), glm::vec3(1.0f, 0.0f, 0.0f));
 		cube.uboVS.modelMatrix = glm::rotate(cube.uboVS.modelMatrix, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
 		cube.uboVS.modelMatrix = glm::rotate(cube.uboVS.modelMatrix, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
 	
-		// Map uniform buffer and update it
-		res = (vkMapMemory(context.device, cube.uniformBuffer[0].memory, 0, sizeof(cube.uboVS), 0, (void**)&pData));
-		memcpy(pData, &cube.uboVS, sizeof(cube.uboVS));
-		// Unmap after data has been copied
-		// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-		vkUnmapMemory(context.device, cube.uniformBuffer[0].memory);
-
-		res = (vkMapMemory(context.device, cube.uniformBuffer[1].memory, 0, sizeof(cube.uboFS), 0, (void**)&pData));
-		memcpy(pData, &cube.uboFS, sizeof(cube.uboFS));
-		// Unmap after data has been copied
-		// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-		vkUnmapMemory(context.device, cube.uniformBuffer[1].memory);
+		// Write into the current frame's slices, the ring stays mapped and is host coherent so no map/unmap or flush is needed.
+		// Cubes were reserved in order, so the copies walk the (write-combined) memory front to back and never read it
+		memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, cube.uniformSlice[0]), &cube.uboVS, sizeof(cube.uboVS));
+		memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, cube.uniformSlice[1]), &cube.uboFS, sizeof(cube.uboFS));
 	}
 }
 
 void prepareUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
 	// Prepare and initialize a uniform buffer block containing shader uniforms
 	// Single uniforms like in OpenGL are no longer present in Vulkan. All Shader uniforms are passed via uniform buffer blocks
-	VkMemoryRequirements memReqs;
-	// Vertex shader uniform buffer block
-	VkBufferCreateInfo bufferInfo = {};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
 
+	arrangeCubes(state);
+
+	// Vertex and fragment shader uniform blocks of every cube, back to back in one shared buffer.
+	// Each block is aligned to minUniformBufferOffsetAlignment and the buffer holds one copy per frame in flight
 	for (auto& cube : state.cubes) {
-		bufferInfo.size = sizeof(cube.uboVS);
-		bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			cube.uniformBuffer[0].buffer, cube.uniformBuffer[0].memory);
-	
-		// Store information in the uniform's descriptor that is used by the descriptor set
-		cube.uniformBuffer[0].descriptor.buffer = cube.uniformBuffer[0].buffer;
-		cube.uniformBuffer[0].descriptor.offset = 0;
-		cube.uniformBuffer[0].descriptor.range = sizeof(cube.uboVS);
-
-		bufferInfo.size = sizeof(cube.uboFS);
-		bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			cube.uniformBuffer[1].buffer, cube.uniformBuffer[1].memory);
-	
-		// Store information in the uniform's descriptor that is used by the descriptor set
-		cube.uniformBuffer[1].descriptor.buffer = cube.uniformBuffer[1].buffer;
-		cube.uniformBuffer[1].descriptor.offset = 0;
-		cube.uniformBuffer[1].descriptor.range = sizeof(cube.uboFS);
+		cube.uniformSlice[0] = reserveUniformSlice(context, state.uniformRing, sizeof(cube.uboVS));
+		cube.uniformSlice[1] = reserveUniformSlice(context, state.uniformRing, sizeof(cube.uboFS));
 	}
+	createUniformRing(context, state.uniformRing, context.swapchainImageCount);
+
+	// Store information in the uniform's descriptor that is used by the descriptor set
+	// The offsets stay 0, the cube and frame region are selected with dynamic offsets when binding
+	state.uniformDescriptor[0].buffer = state.uniformRing.buffer;
+	state.uniformDescriptor[0].offset = 0;
+	state.uniformDescriptor[0].range = sizeof(appState::Model::Matricies);
+
+	state.uniformDescriptor[1].buffer = state.uniformRing.buffer;
+	state.uniformDescriptor[1].offset = 0;
+	state.uniformDescriptor[1].range = sizeof(appState::Model::Lighting);
 
 	updateUniformBuffers(context, state);
 }
 
+// The uniform ring gets a new buffer when the swap chain comes back with a different number of images
+void rebindUniformRing(struct LHContext& context, struct appState& state) {
+	std::array<VkWriteDescriptorSet, 2> writeDescriptorSet = {};
+	for (uint32_t i = 0; i < writeDescriptorSet.size(); i++) {
+		state.uniformDescriptor[i].buffer = state.uniformRing.buffer;
+		writeDescriptorSet[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSet[i].dstSet = state.descriptorSet;
+		writeDescriptorSet[i].descriptorCount = 1;
+		writeDescriptorSet[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+		writeDescriptorSet[i].pBufferInfo = &state.uniformDescriptor[i];
+		writeDescriptorSet[i].dstBinding = i;
+	}
+	vkUpdateDescriptorSets(context.device, static_cast<uint32_t>(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, nullptr);
+}
+
 #ifdef OBJ_MESH
-void prepareVertices(struct LHContext& context, struct appState& state, int index,bool useStagingBuffers) {
+void prepareVertices(struct LHContext& context, struct appState& state, bool useStagingBuffers) {
 	VkResult U_ASSERT_ONLY res;
 	bool U_ASSERT_ONLY pass;
 
@@ -510,24 +539,24 @@ void prepareVertices(struct LHContext& context, struct appState& state, int inde
 	}
 
 
-	state.cubes[index].vBuffer = new float[nv + nn];
+	state.vBuffer = new float[nv + nn];
 	int k = 0;
 	for (i = 0; i < nv / 3; i++) {
-		state.cubes[index].vBuffer[k++] = vertices[3 * i];
-		state.cubes[index].vBuffer[k++] = vertices[3 * i + 1];
-		state.cubes[index].vBuffer[k++] = vertices[3 * i + 2];
-		state.cubes[index].vBuffer[k++] = normals[3 * i];
-		state.cubes[index].vBuffer[k++] = normals[3 * i + 1];
-		state.cubes[index].vBuffer[k++] = normals[3 * i + 2];
+		state.vBuffer[k++] = vertices[3 * i];
+		state.vBuffer[k++] = vertices[3 * i + 1];
+		state.vBuffer[k++] = vertices[3 * i + 2];
+		state.vBuffer[k++] = normals[3 * i];
+		state.vBuffer[k++] = normals[3 * i + 1];
+		state.vBuffer[k++] = normals[3 * i + 2];
 	}
 
-	uint32_t dataSize = (nv + nn) * sizeof(state.cubes[index].vBuffer[0]);
+	uint32_t dataSize = (nv + nn) * sizeof(state.vBuffer[0]);
 	uint32_t dataStride = 6 * (sizeof(float));
 
-	state.cubes[index].i.count = ni;
+	state.i.count = ni;
 
-	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.cubes[index].i.buffer, state.cubes[index].i.memory);
-	mapVerticiesToGPU(context, state.cubes[index].vBuffer, dataSize, state.cubes[index].v.buffer, state.cubes[index].v.memory);
+	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.i.buffer, state.i.memory, useStagingBuffers);
+	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v.buffer, state.v.memory, useStagingBuffers);
 
 	//// Vertex input descriptions 
 	//// Specifies the vertex input parameters for a pipeline
@@ -558,48 +587,105 @@ void prepareVertices(struct LHContext& context, struct appState& state, int inde
 }
 #endif // OBJ_MESH
 
+// Apply the key events queued by key_callback, on the thread that renders
+void handleInput(struct LHContext& context) {
+	LHInputEvent event;
+	while (popInputEvent(context, event)) {
+		if (event.action != GLFW_PRESS) {
+			continue;
+		}
+		switch (event.key) {
+		case GLFW_KEY_SPACE:
+			animate = !animate;
+			break;
+		case GLFW_KEY_A:
+			phi -= 0.1;
+			break;
+		case GLFW_KEY_D:
+			phi += 0.1;
+			break;
+		case GLFW_KEY_W:
+			theta += 0.1;
+			break;
+		case GLFW_KEY_S:
+			theta -= 0.1;
+			break;
+		default:
+			continue;
+		}
+		update = true;
+
+		eyex = (float)(r * sin(theta) * cos(phi));
+		eyey = (float)(r * sin(theta) * sin(phi));
+		eyez = (float)(r * cos(theta));
+	}
+}
+
 void renderLoop(struct LHContext& context, struct appState& state) {
 
+	// CPU time per frame, averaged and printed once a second
+	double frameTime = 0.0;
+	double uniformTime = 0.0;
+	uint32_t frames = 0;
+	auto lastReport = std::chrono::high_resolution_clock::now();
+
 	while (!glfwWindowShouldClose(context.window)) {
-		glfwPollEvents();
-		draw(context);
+		waitForEvents(context);
+		handleInput(context);
+		if (animate) {
+			rotation.z += 0.5f;
+			update = true;
+		}
 		if (update) {
-			updateUniformBuffers(context, state);
+			markUniformRingDirty(state.uniformRing);
+			markFrameDirty(context);
 			update = false;
 		}
+		// Nothing changed since the last presented image, keep sleeping
+		if (!frameNeeded(context)) {
+			continue;
+		}
+		acquireFrame(context);
+		// Waiting for a free frame and image is not CPU work, the frame time counts from here
+		auto frameStart = std::chrono::high_resolution_clock::now();
+		// Each ring region is rewritten once its previous frame has finished, never while the GPU reads it
+		if (uniformRingStale(state.uniformRing, context.currentBuffer)) {
+			auto uniformStart = std::chrono::high_resolution_clock::now();
+			updateUniformBuffers(context, state);
+			uniformTime += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - uniformStart).count();
+		}
+		submitFrame(context);
+
+		auto frameEnd = std::chrono::high_resolution_clock::now();
+		frameTime += std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+		frames++;
+		if (std::chrono::duration<double>(frameEnd - lastReport).count() >= 1.0) {
+			std::cout << state.cubes.size() << " cubes: " << frameTime / frames << " ms CPU per frame, "
+				<< uniformTime / frames << " ms of it writing uniforms" << std::endl;
+			frameTime = 0.0;
+			uniformTime = 0.0;
+			frames = 0;
+			lastReport = frameEnd;
+		}
 	}
 
+	printFrameStats(context);
+
 	// Flush device to make sure all resources can be freed
 	if (context.device != VK_NULL_HANDLE) {
 		vkDeviceWaitIdle(context.device);
 	}
 }
 
+// Runs on the main thread, the keys are only queued here so both loops see the same input path
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods) {
 	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, GLFW_TRUE);
 
-	if (key == GLFW_KEY_A && action == GLFW_PRESS) {
-		phi -= 0.1;
-		update = true;
-	}
-	if (key == GLFW_KEY_D && action == GLFW_PRESS) {
-		phi += 0.1;
-		update = true;
-	}
-	if (key == GLFW_KEY_W && action == GLFW_PRESS) {
-		theta += 0.1;
-		update = true;
-	}
-	if (key == GLFW_KEY_S && action == GLFW_PRESS) {
-		theta -= 0.1;
-		update = true;
-	}
-
-	eyex = (float)(r * sin(theta) * cos(phi));
-	eyey = (float)(r * sin(theta) * sin(phi));
-	eyez = (float)(r * cos(theta));
-
+	struct LHContext* context = (struct LHContext*)glfwGetWindowUserPointer(window);
+	LHInputEvent event = { key, scancode, action, mods, std::chrono::high_resolution_clock::now() };
+	// A full queue drops the key, printing from the event callback would only stall the main thread further
+	pushInputEvent(*context, event);
 }
 
 int main() {
@@ -619,6 +705,8 @@ int main() {
 	createSwapChainExtention(context);
 	createDevice(context);
 	createDeviceQueue(context);
+	context.framesInFlight = FRAMES_IN_FLIGHT;
+	setPresentPolicy(context, PRESENT_POLICY, MAX_FRAME_LATENCY);
 	createSynchObject(context);
 	createCommandPool(context);
 	createSwapChain(context);
@@ -631,19 +719,35 @@ int main() {
 	prepareSynchronizationPrimitives(context);
 
 	//---> Implement our own functions
-	for (int i = 0; i < state.cubes.size(); i++) {
-		prepareVertices(context, state, i,false);
-	}
+	state.cubes.resize(CUBE_COUNT);
+	prepareVertices(context, state, false);
 	prepareUniformBuffers(context, state);
 	setupDescriptorSetLayout(context, state);
-	preparePipelines(context, state);
+	timePipelineCreation(context, [&]() { preparePipelines(context, state); });
+	printShaderCacheStats(context);
 	setupDescriptorPool(context, state);
 	setupDescriptorSet(context, state);
 	buildCommandBuffers(context, state);
 
 	glfwSetKeyCallback(context.window, key_callback);
+	context.renderOnDemand = RENDER_ON_DEMAND;
+	// The new frame buffers need new command buffers, and the projection follows the aspect ratio
+	context.onSwapChainRecreated = [&]() {
+		if (resizeUniformRing(context, state.uniformRing, context.swapchainImageCount)) {
+			rebindUniformRing(context, state);
+		}
+		buildCommandBuffers(context, state);
+		markUniformRingDirty(state.uniformRing);
+	};
 
-	renderLoop(context, state);
+	if (RENDER_THREAD) {
+		runRenderThread(context, [&]() { renderLoop(context, state); });
+	}
+	else {
+		renderLoop(context, state);
+	}
+	// The next run starts with these pipelines already compiled
+	savePipelineCache(context);
 
 	return 0;
 }
\ No newline at end of file
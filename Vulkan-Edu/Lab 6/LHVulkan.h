@@ -16,6 +16,7 @@
 #include <glm/glm.hpp>
 #include <vulkan/vulkan.h>
 #include <SPIRV/GlslangToSpv.h>
+#include <spirv-tools/optimizer.hpp>
 #include <iostream>
 #include <fstream>
 #include <limits>
@@ -27,11 +28,35 @@
 #if _WIN32
 #include <Windows.h>
 #include <vulkan/vulkan_win32.h>
+#include <direct.h>
+#endif
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
 #endif
 
 #include <string>
+#include <string.h>
 #include <assert.h>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <deque>
+#include <cmath>
+#include <cstdio>
+#include <cstddef>
 
 #define GET_INSTANCE_PROC_ADDR(inst, entrypoint)                               \
     {                                                                          \
@@ -87,6 +112,424 @@ struct indices {
 	uint16_t* indices;
 };
 
+// Device memory sub-allocation
+// Large VkDeviceMemory blocks are allocated per memory type and split with a buddy allocator,
+// so a scene with many meshes only costs a handful of vkAllocateMemory calls
+struct LHMemoryBlock {
+	VkDeviceMemory memory;
+	VkDeviceSize size;
+	void* mapped;																	// Persistent host pointer for HOST_VISIBLE blocks
+	std::vector<std::set<VkDeviceSize>> freeLists;									// Free node offsets, indexed by order
+	std::map<VkDeviceSize, uint32_t> used;											// Offset -> order of every live node
+	VkDeviceSize usedBytes;
+};
+
+struct LHAllocation {
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	uint32_t memoryTypeIndex = 0;
+	struct LHMemoryBlock* block = nullptr;											// NULL for dedicated allocations
+	void* mapped = nullptr;															// Host pointer at offset (sub-allocated HOST_VISIBLE only)
+};
+
+struct LHMemoryAllocator {
+	VkDeviceSize blockSize = 64 * 1024 * 1024;
+	VkDeviceSize minNodeSize = 256;
+	VkDeviceSize bufferImageGranularity = 1;
+	uint32_t maxAllocationCount = 4096;
+	// Linear resources (buffers, linear images) and optimal images never share a block, so bufferImageGranularity can't be violated
+	std::vector<LHMemoryBlock*> pools[2 * VK_MAX_MEMORY_TYPES];
+	std::map<VkBuffer, LHAllocation> buffers;
+	std::map<VkImage, LHAllocation> images;
+	std::mutex mutex;
+
+	uint32_t deviceAllocationCount = 0;												// Live vkAllocateMemory allocations
+	uint32_t subAllocationCount = 0;												// Live resources placed in blocks
+	uint32_t dedicatedAllocationCount = 0;											// Live resources with an allocation of their own
+	VkDeviceSize allocatedBytes = 0;
+	VkDeviceSize usedBytes = 0;
+};
+
+// Persistently mapped uniform ring
+// One region per swap chain image, every region has the same layout of aligned slices so the dynamic
+// offsets recorded into a command buffer stay valid. Slices are only rewritten once the frame that last
+// used that image has finished on the GPU, so the CPU never writes into memory the GPU may still be reading
+struct LHUniformRing {
+	VkBuffer buffer = VK_NULL_HANDLE;
+	uint8_t* mapped = nullptr;
+	VkDeviceSize alignment = 0;														// minUniformBufferOffsetAlignment
+	VkDeviceSize frameSize = 0;														// Aligned bytes of one region
+	uint32_t frameCount = 0;
+	uint64_t version = 1;															// Bumped when the uniform data changes
+	std::vector<uint64_t> frameVersion;												// Version each region was last written with
+};
+
+// Staging copy still in flight, the staging buffer is retired once the timeline reaches its value
+struct LHStagingUpload {
+	VkBuffer buffer;
+	VkCommandBuffer cmd;															// NULL for the other staging buffers of a batch
+	uint64_t timelineValue;
+};
+
+// Copies and layout transitions recorded into one command buffer and submitted together
+struct LHUploadBatch {
+	VkCommandBuffer cmd = VK_NULL_HANDLE;
+	std::vector<VkBuffer> stagingBuffers;
+	std::vector<VkBufferMemoryBarrier> bufferBarriers;								// Hand the data to its readers at submission
+	std::vector<VkImageMemoryBarrier> imageBarriers;
+	VkPipelineStageFlags srcStages = 0;
+	VkPipelineStageFlags dstStages = 0;
+};
+
+
+// Requested trade-off between latency, tearing and power, createSwapChain derives the present mode and image count from it
+enum LHPresentPolicy {
+	LH_PRESENT_LOW_LATENCY,															// MAILBOX, else IMMEDIATE, one image above the minimum
+	LH_PRESENT_VSYNC,																// FIFO, one image above the minimum
+	LH_PRESENT_POWER_SAVER															// FIFO with the minimum image count
+};
+
+// renderComplete semaphores of a swap chain that came back with a different image count. A present may still
+// wait on them, so they are kept until every image of the new swap chain has been acquired once
+struct LHRetiredSemaphores {
+	std::vector<VkSemaphore> semaphores;
+	std::vector<bool> acquired;														// Images of the new swap chain acquired since
+};
+
+// Per-frame resources, framesInFlight of these rotate independently of the swap chain image count
+struct LHFrame {
+	VkCommandPool commandPool;														// Reset whenever the frame comes around again
+	VkCommandBuffer cmd;															// Primary buffer for per-frame recording
+	VkSemaphore imageAcquired;														// Signaled when the acquired image is ready
+	uint64_t timelineValue = 0;														// Signaled on the timeline when the frame has executed
+	std::chrono::high_resolution_clock::time_point inputTime;						// When the frame sampled its input
+	bool pending = false;															// Submitted and not yet seen complete
+};
+
+struct LHFrameStats {
+	uint64_t frames = 0;
+	double frameMs = 0.0;
+	double frameWaitMs = 0.0;														// CPU blocked on the frame's previous submission (GPU bound)
+	double acquireWaitMs = 0.0;														// CPU blocked acquiring an image (present bound)
+	uint64_t queueDepth = 0;														// Sum of frames still queued at every acquire
+	double latencyMs = 0.0;															// Input polled to present queued
+	uint64_t latencySamples = 0;
+	double idleMs = 0.0;															// Asleep waiting for events in render-on-demand mode
+	uint64_t wakeups = 0;
+	double frameMsSq = 0.0;															// Squared frame times, for the jitter
+	double inputLatencyMs = 0.0;													// Key event delivered to its frame presented
+	uint64_t inputSamples = 0;
+	uint32_t recreateCount = 0;
+	double recreateMs = 0.0;														// Time spent rebuilding the swap chain
+	std::chrono::high_resolution_clock::time_point lastFrame;
+	std::chrono::high_resolution_clock::time_point start;
+};
+
+
+// Records a slice [first, first + count) of the caller's draw list into a secondary command buffer
+typedef std::function<void(VkCommandBuffer cmd, uint32_t first, uint32_t count)> LHRecordFunc;
+
+// Command pools of one recording thread, one pool per frame in flight
+struct LHRecordWorker {
+	std::vector<VkCommandPool> pools;
+	std::vector<std::vector<VkCommandBuffer>> cmds;									// Secondaries allocated from pools[frame]
+	std::vector<uint32_t> used;														// Handed out from cmds[frame] since its last reset
+};
+
+// Worker threads splitting a draw list across secondary command buffers
+struct LHRecordThreads {
+	std::vector<std::thread> threads;
+	std::vector<LHRecordWorker> workers;											// Worker 0 is the calling thread
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	uint64_t generation = 0;														// Bumped for every job
+	uint32_t pending = 0;
+	bool quit = false;
+
+	// Current job
+	const LHRecordFunc* record = nullptr;
+	const VkCommandBufferInheritanceInfo* inheritance = nullptr;
+	uint32_t itemCount = 0;
+	uint32_t frame = 0;
+	VkCommandBuffer* out = nullptr;
+};
+
+
+// Key event queued by the thread pumping window events, time is when GLFW delivered it
+struct LHInputEvent {
+	int key;
+	int scancode;
+	int action;
+	int mods;
+	std::chrono::high_resolution_clock::time_point time;
+};
+
+#define LH_INPUT_QUEUE_SIZE 256
+
+// Single producer (event thread), single consumer (render thread) ring, lock free
+struct LHInputQueue {
+	LHInputEvent events[LH_INPUT_QUEUE_SIZE];
+	std::atomic<uint32_t> head{ 0 };												// Next write, only stored by the producer
+	std::atomic<uint32_t> tail{ 0 };												// Next read, only stored by the consumer
+	std::mutex mutex;																// Only used to sleep an idle render thread
+	std::condition_variable signal;
+};
+
+
+// Render graph
+// Passes declare the images they write as attachments and the images they sample. Compiling the graph
+// orders the passes, culls the ones the output doesn't depend on and derives render passes, layouts and
+// the dependencies between passes. The images the graph owns only live within a frame, images that are
+// never in use at the same time share their memory
+typedef std::function<void(VkCommandBuffer cmd, uint32_t image, VkSubpassContents contents)> LHGraphRecordFunc;
+
+enum LHGraphUsage {
+	LH_GRAPH_UNUSED,
+	LH_GRAPH_COLOR_WRITE,
+	LH_GRAPH_DEPTH_WRITE,
+	LH_GRAPH_SAMPLED_READ
+};
+
+struct LHGraphImage {
+	std::string name;
+	VkFormat format;
+	uint32_t width, height;															// 0 follows the swap chain extent
+	bool backbuffer;																// The swap chain images, owned by the context
+	VkImage image;
+	VkImageView view;
+	VkImageLayout readLayout;														// Layout the image is sampled in, for descriptors
+	int32_t firstUse, lastUse;														// Positions in the execution order
+};
+
+struct LHGraphAttachment {
+	uint32_t image;
+	LHGraphUsage usage;
+	VkClearValue clear;
+};
+
+struct LHGraphPass {
+	std::string name;
+	std::vector<LHGraphAttachment> writes;
+	std::vector<uint32_t> reads;
+	LHGraphRecordFunc record;
+	bool culled;
+	uint32_t width, height;
+	VkRenderPass renderPass;
+	std::vector<VkFramebuffer> frameBuffers;										// One per swap chain image when writing the backbuffer
+	std::vector<VkClearValue> clearValues;
+};
+
+struct LHGraphMemory {
+	LHAllocation allocation;
+	bool swapChainSized;															// Reallocated when the swap chain is recreated
+};
+
+struct LHRenderGraph {
+	std::vector<LHGraphImage> images;
+	std::vector<LHGraphPass> passes;
+	std::vector<uint32_t> order;													// Live passes in execution order
+	std::vector<LHGraphMemory> memory;
+	uint32_t output;
+	bool compiled = false;
+};
+
+
+// One stage of a batch handed to createShaderStages()
+struct LHShaderSource {
+	std::string filename;
+	VkShaderStageFlagBits stage;
+};
+
+// Passes run over glslang's output before it becomes a module. Both presets strip debug information
+// and merge duplicate types and decorations
+enum LHSpirvOptimization {
+	LH_SPIRV_OPTIMIZE_NONE,
+	LH_SPIRV_OPTIMIZE_PERFORMANCE,													// Inlining, dead code elimination, constant folding and redundancy elimination
+	LH_SPIRV_OPTIMIZE_SIZE															// The same kind of passes, chosen for the smallest module
+};
+
+struct LHSpirvOptimizeReport {
+	uint32_t instructionsBefore = 0;
+	uint32_t instructionsAfter = 0;
+	size_t bytesBefore = 0;
+	size_t bytesAfter = 0;
+};
+
+struct LHShaderCacheStats {
+	uint32_t hits = 0;
+	uint32_t misses = 0;
+	double hitMs = 0.0;																// Reading cached SPIR-V
+	double missMs = 0.0;															// Compiling with glslang and writing the entry
+	double batchMs = 0.0;															// Wall time in createShaderStages, hitMs and missMs add up its threads
+	uint32_t batchThreads = 0;														// Most threads a batch compiled on
+	uint32_t embedded = 0;															// Modules made from SPIR-V compiled at build time
+	double embeddedMs = 0.0;
+	struct LHSpirvOptimizeReport optimized;											// Totals over the shaders the optimizer ran on
+};
+
+// Descriptor binding a shader stage declares, read from its SPIR-V
+struct LHReflectedBinding {
+	uint32_t set;
+	VkDescriptorSetLayoutBinding binding;											// stageFlags holds the reflected stage
+};
+
+struct LHShaderReflection {
+	VkShaderStageFlagBits stage;
+	std::vector<LHReflectedBinding> bindings;
+	uint32_t pushConstantSize = 0;													// 0 without a push constant block
+	std::vector<VkVertexInputAttributeDescription> vertexInputs;					// Vertex stage only, by location and packed in that order
+	uint32_t vertexStride = 0;														// Size of the packed vertex inputs
+	std::vector<uint32_t> specializationConstants;									// constant_id of every specialization constant
+	uint64_t codeHash = 0;															// Same SPIR-V, same hash, whichever module it went into
+};
+
+// Layouts made from reflection, shared by every pipeline with the same signature
+struct LHLayoutCache {
+	std::map<std::vector<uint32_t>, VkDescriptorSetLayout> setLayouts;
+	std::map<VkDescriptorSetLayout, std::vector<VkDescriptorSetLayoutBinding>> setBindings;
+	std::map<std::vector<uint32_t>, VkPipelineLayout> pipelineLayouts;
+	uint32_t requests = 0;															// Pipeline layouts asked for
+};
+
+// Creates a pipeline from its stages, called again on the reloader thread whenever one of their sources changes
+typedef std::function<VkPipeline(const std::vector<VkPipelineShaderStageCreateInfo>& stages)> LHPipelineBuild;
+
+struct LHReloadPipeline {
+	VkPipeline* pipeline;															// Replaced by applyShaderReloads()
+	std::vector<LHShaderSource> sources;
+	LHPipelineBuild build;
+};
+
+struct LHReloadShader {
+	VkShaderStageFlagBits stage;
+	VkShaderModule module;															// Current module, owned by the reloader
+	time_t modified;																// Polled where there is no inotify
+};
+
+struct LHRetiredPipeline {
+	VkPipeline pipeline;
+	uint64_t timelineValue;															// Destroyed once the frames that used it have executed
+};
+
+struct LHShaderReloader {
+	std::string directory;
+	std::map<std::string, LHReloadShader> shaders;									// By file name within the directory
+	std::vector<LHReloadPipeline> pipelines;
+	std::vector<struct LHPipelinePermutations*> permutations;						// Stages follow the reloaded modules
+	std::vector<std::pair<VkPipeline*, VkPipeline>> ready;							// Rebuilt, waiting for a frame boundary
+	std::vector<LHRetiredPipeline> retired;											// Only touched by the frame loop
+	std::set<VkPipeline*> replaced;													// Watched pipelines now holding one built here, owned by the reloader
+	std::mutex mutex;
+	std::thread thread;
+	std::atomic<bool> quit{ false };
+	int notify = -1;																// inotify descriptor
+};
+
+// Creates one permutation from stages that carry its specialization info. flags and basePipeline go into
+// VkGraphicsPipelineCreateInfo (with basePipelineIndex -1) so permutations can derive from the first one built
+typedef std::function<VkPipeline(const std::vector<VkPipelineShaderStageCreateInfo>&, VkPipelineCreateFlags, VkPipeline)> LHPermutationBuild;
+
+// Pipelines that only differ in the values of their specialization constants, built the first time a key is asked for.
+// A key holds one 32 bit value per constant, in the order of constantIDs
+struct LHPipelinePermutations {
+	std::vector<VkPipelineShaderStageCreateInfo> stages;
+	std::vector<uint32_t> constantIDs;
+	std::vector<std::vector<uint32_t>> stageConstants;								// Indices into constantIDs each stage declares
+	LHPermutationBuild build;
+	std::map<std::vector<uint32_t>, VkPipeline> pipelines;							// By key
+	std::map<std::vector<uint32_t>, std::shared_future<VkPipeline>> building;		// Keys being built outside the lock
+	std::vector<uint32_t> baseKey;													// First permutation built, the parent of the others
+	std::mutex mutex;
+	uint32_t requests = 0;
+};
+
+// Whether the pipeline cache started from disk, and what pipeline creation cost with it
+struct LHPipelineCacheStats {
+	bool warm = false;
+	size_t loadedBytes = 0;
+	size_t savedBytes = 0;
+	double createMs = -1.0;															// Set by timePipelineCreation
+};
+
+// Everything a VkGraphicsPipelineCreateInfo points at, held by value so the pipeline can be created later or on
+// another thread. pipelineDescCreateInfo() fills in the sTypes, counts and pointers
+struct LHGraphicsPipelineDesc {
+	VkGraphicsPipelineCreateInfo info = {};											// flags, layout, renderPass and the base pipeline are set directly
+	std::vector<VkPipelineShaderStageCreateInfo> stages;
+	std::vector<VkVertexInputBindingDescription> vertexBindings;
+	std::vector<VkVertexInputAttributeDescription> vertexAttributes;
+	VkPipelineVertexInputStateCreateInfo vertexInputState = {};
+	VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = {};
+	VkPipelineRasterizationStateCreateInfo rasterizationState = {};
+	std::vector<VkPipelineColorBlendAttachmentState> blendAttachments;
+	VkPipelineColorBlendStateCreateInfo colorBlendState = {};
+	VkPipelineViewportStateCreateInfo viewportState = {};
+	std::vector<VkDynamicState> dynamicStates;
+	VkPipelineDynamicStateCreateInfo dynamicState = {};
+	VkPipelineDepthStencilStateCreateInfo depthStencilState = {};
+	VkPipelineMultisampleStateCreateInfo multisampleState = {};
+	// Copies of the stages' specialization info, the stages point here once the create info is filled in
+	std::vector<VkSpecializationInfo> specializations;
+	std::vector<std::vector<VkSpecializationMapEntry>> specializationEntries;
+	std::vector<std::vector<char>> specializationData;
+};
+
+typedef std::function<VkPipeline()> LHPipelineJob;
+
+// Worker threads creating pipelines off the frame loop, all of them through the context's pipeline cache
+// (which Vulkan synchronizes internally)
+struct LHPipelineCompiler {
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> jobs;
+	std::mutex mutex;
+	std::condition_variable wake;
+	uint32_t busy = 0;																// Jobs being run
+	bool quit = false;
+	// Since the compiler last went idle
+	uint32_t pipelines = 0;
+	uint32_t calls = 0;																// vkCreateGraphicsPipelines calls and jobs
+	std::chrono::high_resolution_clock::time_point start;
+};
+
+// The parts VK_EXT_graphics_pipeline_library splits a pipeline into, each compiled on its own
+enum LHPipelineLibraryPart {
+	LH_LIBRARY_VERTEX_INPUT,
+	LH_LIBRARY_PRE_RASTERIZATION,
+	LH_LIBRARY_FRAGMENT_SHADER,
+	LH_LIBRARY_FRAGMENT_OUTPUT,
+	LH_LIBRARY_PART_COUNT
+};
+
+struct LHLinkedPipeline {
+	VkPipeline fast = VK_NULL_HANDLE;												// Linked without optimization, usable right away
+	std::shared_future<VkPipeline> optimized;										// Relinked with link time optimization on the pipeline compiler
+	bool optimizedRetired = false;													// Destroyed by the shader reloader
+};
+
+// Pipeline parts keyed by their state like the pipeline registry, so a new permutation only compiles the
+// parts that differ and links the rest. Owns the parts and everything linked from them
+struct LHPipelineLibraries {
+	std::map<std::string, VkPipeline> parts[LH_LIBRARY_PART_COUNT];
+	std::vector<VkPipeline> unshared;												// Parts of descs with extension structs
+	std::vector<LHLinkedPipeline> linked;
+	std::mutex mutex;
+	uint32_t requests = 0;															// Parts asked for
+	uint32_t built = 0;																// Parts compiled
+	uint32_t links = 0;
+	double linkMs = 0.0;															// Fast links, parts compiled on the way included
+};
+
+// Every pipeline made by compilePipelines(), keyed by its complete state, so a request for a pipeline that exists
+// (or is being compiled) gets that one back. The registry owns them
+struct LHPipelineRegistry {
+	std::unordered_map<std::string, std::shared_future<VkPipeline>> pipelines;
+	std::mutex mutex;
+	uint32_t requests = 0;
+	uint32_t hits = 0;
+	uint32_t unkeyed = 0;															// Descs with extension structs, never shared
+};
 
 struct LHContext {
 	std::string name;
@@ -105,6 +548,7 @@ struct LHContext {
 	VkPhysicalDeviceProperties deviceProperties;
 	VkPhysicalDeviceFeatures deviceFeatures;
 	VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
+	TBuiltInResource shaderResources;												// glslang limits of the selected GPU, filled by createDeviceInfo
 	std::vector<VkQueueFamilyProperties> queue_props;
 	VkPhysicalDeviceMemoryProperties memory_properties;
 	VkPhysicalDeviceProperties gpu_props;
@@ -126,21 +570,46 @@ struct LHContext {
 	GLFWwindow* window;
 	VkSurfaceKHR surface;
 
-	struct {
-		// Swap chain image presentation
-		VkSemaphore presentComplete;
-		// Command buffer submission and execution
-		VkSemaphore renderComplete;
-	} semaphores;
-
-	VkSubmitInfo submitInfo;
-	VkPipelineStageFlags submitPipelineStages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 	VkCommandPool cmd_pool;
 	VkSwapchainKHR swapChain;
 	uint32_t swapchainImageCount;
 	std::vector<swap_chain_buffer> buffers;
 	std::vector<VkImage> images;
-	std::vector<VkFence> waitFences;
+	// Frames in flight, the CPU records and submits at most framesInFlight frames ahead of the GPU
+	uint32_t framesInFlight = 2;
+	// Present policy, maxFrameLatency > 0 waits for frame N - maxFrameLatency to finish before acquiring
+	LHPresentPolicy presentPolicy = LH_PRESENT_LOW_LATENCY;
+	uint32_t maxFrameLatency = 0;
+	VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;						// Mode the swap chain was created with
+	uint32_t currentFrame = 0;
+	std::vector<LHFrame> frames;
+	struct LHFrameStats frameStats;
+	// Per swap chain image: timeline value of the frame that last rendered to it and the semaphore present waits on
+	std::vector<uint64_t> imageTimelineValues;
+	std::vector<VkSemaphore> renderComplete;
+	std::vector<LHRetiredSemaphores> retiredSemaphores;
+	struct LHRecordThreads* recordThreads = nullptr;
+	// Every queue submission signals the next value of this timeline semaphore
+	VkSemaphore timeline = VK_NULL_HANDLE;
+	std::atomic<uint64_t> timelineValue{ 0 };										// Last value handed out
+	PFN_vkWaitSemaphores fpWaitSemaphores = nullptr;								// Core or KHR entry point, whichever the device has
+	PFN_vkGetSemaphoreCounterValue fpGetSemaphoreCounterValue = nullptr;
+	// Submits and presents from any thread hold this, timeline values reach the queue in the order they were handed out
+	std::mutex queueMutex;
+	// Swap chain recreation, set on resize or a suboptimal present and handled by the frame loop
+	std::atomic<bool> swapChainDirty{ false };
+	bool includeDepth = true;
+	std::function<void()> onSwapChainRecreated;										// Re-record size dependent commands, resize per-image resources
+	// Render on demand, frames are only drawn once input, uploads or the window mark the image dirty
+	bool renderOnDemand = false;
+	std::atomic<bool> frameDirty{ true };
+	double idleTimeout = 0.5;														// Seconds asleep at most while nothing changes
+	// Render thread, the main thread only pumps window events into the input queue
+	bool renderThreaded = false;
+	struct LHInputQueue input;
+	std::chrono::high_resolution_clock::time_point inputEventTime;					// Oldest event applied to the next frame
+	std::atomic<int> framebufferWidth{ 0 };											// Kept by the resize callback for the render thread
+	std::atomic<int> framebufferHeight{ 0 };
 	VkRenderPass render_pass;
 	VkPipelineCache pipelineCache;
 	std::vector<VkFramebuffer> frameBuffers;
@@ -150,6 +619,25 @@ struct LHContext {
 	VkQueue present_queue;
 	//---------------------------------> Optional
 	std::vector<VkCommandBuffer> cmdBuffer;
+	struct LHMemoryAllocator* allocator = nullptr;
+	std::vector<LHStagingUpload> stagingUploads;
+	struct LHUploadBatch* uploadBatch = nullptr;									// Open batch, staging uploads are recorded into it
+	// Compiled shaders are cached here by content along with the pipeline cache, an empty path compiles every
+	// shader and pipeline at startup
+	std::string shaderCacheDir = "shadercache";
+	LHSpirvOptimization shaderOptimization = LH_SPIRV_OPTIMIZE_NONE;				// Applied by createShaderStage to GLSL it compiles
+	struct LHShaderCacheStats shaderCacheStats;
+	struct LHShaderReloader* shaderReloader = nullptr;
+	// Reflection of every module made by createShaderStage, and the layouts derived from it
+	std::map<VkShaderModule, LHShaderReflection> shaderReflections;
+	std::mutex reflectionMutex;
+	struct LHLayoutCache layoutCache;
+	struct LHPipelineCacheStats pipelineCacheStats;
+	struct LHPipelineCompiler* pipelineCompiler = nullptr;
+	struct LHPipelineRegistry pipelineRegistry;
+	bool pipelineLibrary = false;													// VK_EXT_graphics_pipeline_library was enabled
+	bool pipelineLibraryFastLinking = false;
+	struct LHPipelineLibraries pipelineLibraries;
 };
 
 VkResult init_global_extension_propertiesT(layer_properties& layer_props);
@@ -168,6 +656,8 @@ VkResult createSynchPrimitive(struct LHContext& context);
 VkResult createDepthBuffers(struct LHContext& context);
 VkResult createRenderPass(struct LHContext& context, bool includeDepth = true);
 void createPipeLineCache(struct LHContext& context);
+void savePipelineCache(struct LHContext& context);
+void timePipelineCreation(struct LHContext& context, const std::function<void()>& create);
 VkResult createFrameBuffer(struct LHContext& context, bool includeDepth = true);
 void createDeviceQueue(struct LHContext& context);
 void setupRenderPass(struct LHContext& context, bool useStagingBuffers = false);
@@ -178,25 +668,173 @@ VkResult prepareSynchronizationPrimitives(struct LHContext& context);
 //----------------------------> Optional Functions
 
 VkResult mapVerticiesToGPU(struct LHContext& context, const void* vertexInput, uint32_t dataSize,
-	VkBuffer& vertexBuffer, VkDeviceMemory& memory);
+	VkBuffer& vertexBuffer, VkDeviceMemory& memory, bool useStagingBuffers = false);
 VkResult mapIndiciesToGPU(struct LHContext& context, const void* indiciesInput, uint32_t dataSize,
-	VkBuffer& indexBuffer, VkDeviceMemory& memory);
+	VkBuffer& indexBuffer, VkDeviceMemory& memory, bool useStagingBuffers = false);
+VkResult uploadBufferThroughStaging(struct LHContext& context, const void* input, uint32_t dataSize, VkBufferUsageFlags usage,
+	VkBuffer& buffer, VkDeviceMemory& memory);
+uint64_t submitUpload(struct LHContext& context, VkCommandBuffer cmd);
+void retireStagingBuffers(struct LHContext& context, bool wait = false);
+// The buffer is sub-allocated, memory is shared with other buffers and the buffer starts at offset within it.
+// Host visible buffers stay mapped, write through mapped rather than calling vkMapMemory on memory
 VkResult bindBufferToMem(struct LHContext& context, VkBufferCreateInfo& bufferInfo, VkFlags flags,
-	VkBuffer& inputBuffer, VkDeviceMemory& memory);
+	VkBuffer& inputBuffer, VkDeviceMemory& memory, void** mapped = nullptr, VkDeviceSize* offset = nullptr);
 void createClearColor(struct LHContext& context, VkClearValue* clear_values);
 void createRenderPassCreateInfo(struct LHContext& context, VkRenderPassBeginInfo& rp_begin);
-void createBuffer(struct LHContext context, uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
+void createBuffer(struct LHContext& context, uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& bufferMemory);
 void createAttachmentDescription(struct LHContext& context, VkAttachmentDescription* attachments);
 void draw(struct LHContext& context);
+void acquireFrame(struct LHContext& context);
+void submitFrame(struct LHContext& context, VkCommandBuffer cmd = VK_NULL_HANDLE);
 
 void createShaderStage(struct LHContext& context, std::string filename, VkShaderStageFlagBits flag, VkPipelineShaderStageCreateInfo& shaderStage);
 
 #ifdef LHTexture
 #include "texture.h"
 
-void createTextureImage(struct LHContext, std::string filepath);
+void createTextureImage(struct LHContext& context, std::string filepath);
 #endif
 
+//----------------------------> Device memory sub-allocation
+void createMemoryAllocator(struct LHContext& context, VkDeviceSize blockSize = 64 * 1024 * 1024);
+void destroyMemoryAllocator(struct LHContext& context);
+VkResult allocateBufferMemory(struct LHContext& context, VkBuffer buffer, VkFlags flags, LHAllocation& allocation, bool dedicated = false);
+VkResult allocateImageMemory(struct LHContext& context, VkImage image, VkFlags flags, LHAllocation& allocation, bool dedicated = false,
+	VkImageTiling tiling = VK_IMAGE_TILING_OPTIMAL);
+void freeAllocation(struct LHContext& context, LHAllocation& allocation);
+void destroyBuffer(struct LHContext& context, VkBuffer buffer);
+void destroyImage(struct LHContext& context, VkImage image);
+void printMemoryAllocatorStats(struct LHContext& context);
+
+//----------------------------> Uniform ring
+uint32_t reserveUniformSlice(struct LHContext& context, LHUniformRing& ring, VkDeviceSize size);
+VkResult createUniformRing(struct LHContext& context, LHUniformRing& ring, uint32_t frameCount);
+void destroyUniformRing(struct LHContext& context, LHUniformRing& ring);
+bool resizeUniformRing(struct LHContext& context, LHUniformRing& ring, uint32_t frameCount);
+void* uniformRingSlice(LHUniformRing& ring, uint32_t frame, uint32_t slice);
+uint32_t uniformRingOffset(const LHUniformRing& ring, uint32_t frame, uint32_t slice);
+void markUniformRingDirty(LHUniformRing& ring);
+bool uniformRingStale(LHUniformRing& ring, uint32_t frame);
+
+//----------------------------> Frames in flight
+VkResult createFrames(struct LHContext& context, uint32_t framesInFlight);
+void destroyFrames(struct LHContext& context);
+void printFrameStats(struct LHContext& context);
+
+//----------------------------> Parallel command recording
+void createRecordThreads(struct LHContext& context, uint32_t threadCount = 0);
+void destroyRecordThreads(struct LHContext& context);
+void resetRecordPools(struct LHContext& context, uint32_t frame);
+void recordSecondaryCommandBuffers(struct LHContext& context, const VkCommandBufferInheritanceInfo& inheritance,
+	uint32_t itemCount, const LHRecordFunc& record, std::vector<VkCommandBuffer>& secondaries);
+VkCommandBuffer beginFrameCommandBuffer(struct LHContext& context);
+
+//----------------------------> Swap chain recreation
+VkResult recreateSwapChain(struct LHContext& context);
+
+//----------------------------> Present policy
+void setPresentPolicy(struct LHContext& context, LHPresentPolicy policy, uint32_t maxFrameLatency = 0);
+
+//----------------------------> Timeline synchronization
+uint64_t submitTimeline(struct LHContext& context, VkSubmitInfo& submitInfo);
+bool timelineReached(struct LHContext& context, uint64_t value);
+void waitTimeline(struct LHContext& context, uint64_t value);
+
+//----------------------------> Render on demand
+void waitForEvents(struct LHContext& context);
+void markFrameDirty(struct LHContext& context);
+bool frameNeeded(struct LHContext& context);
+
+//----------------------------> Render thread
+bool pushInputEvent(struct LHContext& context, const LHInputEvent& event);
+bool popInputEvent(struct LHContext& context, LHInputEvent& event);
+void runRenderThread(struct LHContext& context, const std::function<void()>& renderLoop);
+
+//----------------------------> Render graph
+uint32_t addGraphImage(struct LHRenderGraph& graph, std::string name, VkFormat format, uint32_t width = 0, uint32_t height = 0);
+uint32_t addGraphBackbuffer(struct LHRenderGraph& graph);
+uint32_t addGraphPass(struct LHRenderGraph& graph, std::string name, LHGraphRecordFunc record);
+void graphWriteColor(struct LHRenderGraph& graph, uint32_t pass, uint32_t image, VkClearValue clear);
+void graphWriteDepth(struct LHRenderGraph& graph, uint32_t pass, uint32_t image, VkClearValue clear);
+void graphRead(struct LHRenderGraph& graph, uint32_t pass, uint32_t image);
+void compileRenderGraph(struct LHContext& context, struct LHRenderGraph& graph, uint32_t output);
+void resizeRenderGraph(struct LHContext& context, struct LHRenderGraph& graph);
+void destroyRenderGraph(struct LHContext& context, struct LHRenderGraph& graph);
+void beginGraphPass(struct LHContext& context, struct LHRenderGraph& graph, uint32_t pass, VkCommandBuffer cmd, uint32_t image, VkSubpassContents contents);
+VkCommandBufferInheritanceInfo graphInheritance(struct LHRenderGraph& graph, uint32_t pass, uint32_t image);
+void recordRenderGraph(struct LHContext& context, struct LHRenderGraph& graph, VkCommandBuffer cmd, uint32_t image, VkSubpassContents contents);
+
+//----------------------------> Upload batches
+void beginUploadBatch(struct LHContext& context, struct LHUploadBatch& batch);
+void batchCopyBuffer(struct LHContext& context, struct LHUploadBatch& batch, const void* data, VkDeviceSize size, VkBuffer buffer,
+	VkAccessFlags dstAccess, VkPipelineStageFlags dstStages);
+void batchCopyImage(struct LHContext& context, struct LHUploadBatch& batch, const void* data, VkDeviceSize size, VkImage image,
+	uint32_t width, uint32_t height, VkImageLayout finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+	VkPipelineStageFlags dstStages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+void batchTransitionImage(struct LHContext& context, struct LHUploadBatch& batch, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+	VkAccessFlags srcAccess, VkPipelineStageFlags srcStages, VkAccessFlags dstAccess, VkPipelineStageFlags dstStages);
+uint64_t submitUploadBatch(struct LHContext& context, struct LHUploadBatch& batch);
+
+//----------------------------> SPIR-V cache
+void printShaderCacheStats(struct LHContext& context);
+
+//----------------------------> Parallel shader compilation
+std::vector<VkPipelineShaderStageCreateInfo> createShaderStages(struct LHContext& context, const std::vector<LHShaderSource>& shaders, uint32_t threadCount = 0);
+
+//----------------------------> Build-time shaders
+// include\shaders.targets compiles shaders\<name>.<stage> into shaders\spv\<name>.<stage>.h, which
+// declares the SPIR-V as <name>_<stage>[]. These make modules from it without touching a file or glslang
+VkShaderModule loadSPIRVShader(struct LHContext& context, const uint32_t* code, size_t codeSize);
+void createShaderStage(struct LHContext& context, const uint32_t* code, size_t codeSize, VkShaderStageFlagBits flag, VkPipelineShaderStageCreateInfo& shaderStage);
+
+template <size_t N>
+VkShaderModule loadSPIRVShader(struct LHContext& context, const uint32_t(&code)[N]) {
+	return loadSPIRVShader(context, code, sizeof(code));
+}
+
+template <size_t N>
+void createShaderStage(struct LHContext& context, const uint32_t(&code)[N], VkShaderStageFlagBits flag, VkPipelineShaderStageCreateInfo& shaderStage) {
+	createShaderStage(context, code, sizeof(code), flag, shaderStage);
+}
+
+//----------------------------> Shader hot reload
+void createShaderReloader(struct LHContext& context, const std::string& directory = "./shaders");
+void destroyShaderReloader(struct LHContext& context);
+void watchPipeline(struct LHContext& context, VkPipeline& pipeline, const std::vector<LHShaderSource>& sources,
+	const std::vector<VkPipelineShaderStageCreateInfo>& stages, LHPipelineBuild build);
+void watchPipelinePermutations(struct LHContext& context, struct LHPipelinePermutations& permutations);
+bool applyShaderReloads(struct LHContext& context);
+
+//----------------------------> SPIR-V reflection
+bool reflectSpirv(const uint32_t* code, size_t codeSize, VkShaderStageFlagBits stage, LHShaderReflection& reflection);
+bool reflectShaderStage(struct LHContext& context, const VkPipelineShaderStageCreateInfo& stage, LHShaderReflection& reflection);
+VkPipelineLayout createReflectedPipelineLayout(struct LHContext& context, const std::vector<VkPipelineShaderStageCreateInfo>& stages,
+	bool dynamicUniforms = false, std::vector<VkDescriptorSetLayout>* setLayouts = nullptr);
+uint32_t reflectVertexInput(struct LHContext& context, const VkPipelineShaderStageCreateInfo& vertexStage,
+	std::vector<VkVertexInputAttributeDescription>& attributes, VkVertexInputBindingDescription& binding, uint32_t stride = 0);
+void addDescriptorPoolSizes(struct LHContext& context, VkDescriptorSetLayout layout, uint32_t setCount, std::vector<VkDescriptorPoolSize>& sizes);
+void destroyLayoutCache(struct LHContext& context);
+
+//----------------------------> Pipeline permutations
+void createPipelinePermutations(struct LHContext& context, struct LHPipelinePermutations& permutations, const std::vector<VkPipelineShaderStageCreateInfo>& stages,
+	const std::vector<uint32_t>& constantIDs, LHPermutationBuild build);
+VkPipeline& getPipelinePermutation(struct LHContext& context, struct LHPipelinePermutations& permutations, const std::vector<uint32_t>& key);
+VkPipeline buildPipelinePermutation(struct LHContext& context, struct LHPipelinePermutations& permutations, const std::vector<uint32_t>& key,
+	const std::vector<VkPipelineShaderStageCreateInfo>& stages, VkPipelineCreateFlags flags = 0, VkPipeline basePipeline = VK_NULL_HANDLE);
+void destroyPipelinePermutations(struct LHContext& context, struct LHPipelinePermutations& permutations);
+
+//----------------------------> Pipeline compiler
+const VkGraphicsPipelineCreateInfo& pipelineDescCreateInfo(struct LHGraphicsPipelineDesc& desc);
+void createPipelineCompiler(struct LHContext& context, uint32_t threadCount = 0);
+void destroyPipelineCompiler(struct LHContext& context);
+std::vector<std::shared_future<VkPipeline>> compilePipelines(struct LHContext& context, const std::vector<LHGraphicsPipelineDesc>& descs);
+std::shared_future<VkPipeline> compilePipeline(struct LHContext& context, LHPipelineJob job);
+bool pipelineReady(const std::shared_future<VkPipeline>& pipeline);
+void destroyPipelineRegistry(struct LHContext& context);
+VkPipeline linkPipeline(struct LHContext& context, const LHGraphicsPipelineDesc& desc, bool optimize = true);
+bool upgradeLinkedPipeline(struct LHContext& context, VkPipeline& pipeline);
+void destroyPipelineLibraries(struct LHContext& context);
+
 //----------------------------> Helper Function code
 std::string physicalDeviceTypeString(VkPhysicalDeviceType type);
 bool memory_type_from_properties(struct LHContext& context, uint32_t typeBits, VkFlags requirements_mask, uint32_t* typeIndex);
@@ -204,7 +842,10 @@ void init_glslang();
 void finalize_glslang();
 VkShaderModule loadSPIRVShader(struct LHContext& context, std::string filename);
 bool GLSLtoSPV(const VkShaderStageFlagBits shader_type, const char* pshader,
-	std::vector<unsigned int>& spirv);
+	std::vector<unsigned int>& spirv, LHSpirvOptimization optimization = LH_SPIRV_OPTIMIZE_NONE, LHSpirvOptimizeReport* report = nullptr,
+	const TBuiltInResource* resources = nullptr);
+bool optimizeSpirv(std::vector<unsigned int>& spirv, LHSpirvOptimization optimization, LHSpirvOptimizeReport* report = nullptr);
 EShLanguage FindLanguage(const VkShaderStageFlagBits shader_type);
 void init_resources(TBuiltInResource& Resources);
+void init_resources(TBuiltInResource& Resources, const VkPhysicalDeviceLimits& limits);
 #endif // !L_H_VULKAN_H
\ No newline at end of file
@@ -29,10 +29,9 @@ struct appState {
 
 		VkDescriptorSet descriptorSet;
 
-		// Uniform buffer block object
+		// Uniform buffer block objects, slices of every frame region in the ring
 		struct UniformBuffer {
-			VkDeviceMemory memory;
-			VkBuffer buffer;
+			uint32_t slice;
 			VkDescriptorBufferInfo descriptor;
 		}  uniformBuffer[2];
 
@@ -43,6 +42,7 @@ struct appState {
 		}uboFS;
 	};
 	std::array<Model, 2> cubes;
+	struct LHUniformRing uniformRing;
 
 	// Contains all Vulkan objects that are required to store and use a texture
 	struct Texture {
@@ -118,7 +118,11 @@ void buildCommandBuffers(struct LHContext& context, struct appState& state) {
 
 		for (auto& cube : state.cubes) {
 			// Bind the cube's descriptor set. This tells the command buffer to use the uniform buffer and image set for this cube
-			vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayout, 0, 1, &cube.descriptorSet, 0, nullptr);
+			// Dynamic offsets (in binding order) select the cube's slices in the ring region of this command buffer
+			uint32_t dynamicOffsets[2] = {
+				uniformRingOffset(state.uniformRing, i, cube.uniformBuffer[0].slice),
+				uniformRingOffset(state.uniformRing, i, cube.uniformBuffer[1].slice) };
+			vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayout, 0, 1, &cube.descriptorSet, 2, dynamicOffsets);
 			vkCmdDrawIndexed(context.cmdBuffer[i], state.cubes[0].i.count, 1, 0, 0, 0);
 		}
 
@@ -149,10 +153,10 @@ void setupDescriptorPool(struct LHContext& context, struct appState& state) {
 
 	// We need to tell the API the number of max. requested descriptors per type
 	VkDescriptorPoolSize typeCounts[3];
-	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	typeCounts[0].descriptorCount = 1 + static_cast<uint32_t>(state.cubes.size());
 
-	typeCounts[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	typeCounts[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	typeCounts[1].descriptorCount = static_cast<uint32_t>(state.cubes.size());
 
 	typeCounts[2].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
@@ -199,14 +203,14 @@ void setupDescriptorSetLayout(struct LHContext& context, struct appState& state)
 
 	// Binding 0: Uniform buffer (Vertex shader)
 	std::array<VkDescriptorSetLayoutBinding, 3>layoutBinding = {};
-	layoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	layoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	layoutBinding[0].descriptorCount = 1;
 	layoutBinding[0].binding = 0;
 	layoutBinding[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 	layoutBinding[0].pImmutableSamplers = nullptr;
 
 	// Binding 1: Uniform buffer (Fragment shader)
-	layoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	layoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	layoutBinding[1].descriptorCount = 1;
 	layoutBinding[1].binding = 1;
 	layoutBinding[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
@@ -260,7 +264,7 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 		writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		writeDescriptorSet[0].dstSet = cube.descriptorSet;
 		writeDescriptorSet[0].descriptorCount = 1;
-		writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		writeDescriptorSet[0].pBufferInfo = &cube.uniformBuffer[0].descriptor;
 		// Binds this uniform buffer to binding point 0
 		writeDescriptorSet[0].dstBinding = 0;
@@ -269,7 +273,7 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 		writeDescriptorSet[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		writeDescriptorSet[1].dstSet = cube.descriptorSet;
 		writeDescriptorSet[1].descriptorCount = 1;
-		writeDescriptorSet[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		writeDescriptorSet[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		writeDescriptorSet[1].pBufferInfo = &cube.uniformBuffer[1].descriptor;
 		// Binds this uniform buffer to binding point 1
 		writeDescriptorSet[1].dstBinding = 1;
@@ -417,8 +421,6 @@ void preparePipelines(struct LHContext& context, struct appState& state) {
 }
 
 void updateUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-	uint8_t* pData;
 
 	state.cubes[0].uboVS.modelMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(-2.0f, 0.0f, 0.0f));
 	state.cubes[1].uboVS.modelMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(2.0f, 0.0f, 0.0f));
@@ -442,48 +444,31 @@ void updateUniformBuffers(struct LHContext& context, struct appState& state) {
 		cube.uboVS.modelMatrix = glm::rotate(cube.uboVS.modelMatrix, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
 		cube.uboVS.modelMatrix = glm::rotate(cube.uboVS.modelMatrix, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
 	
-		// Map uniform buffer and update it
-		res = (vkMapMemory(context.device, cube.uniformBuffer[0].memory, 0, sizeof(cube.uboVS), 0, (void**)&pData));
-		memcpy(pData, &cube.uboVS, sizeof(cube.uboVS));
-		// Unmap after data has been copied
-		// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-		vkUnmapMemory(context.device, cube.uniformBuffer[0].memory);
-
-		res = (vkMapMemory(context.device, cube.uniformBuffer[1].memory, 0, sizeof(cube.uboFS), 0, (void**)&pData));
-		memcpy(pData, &cube.uboFS, sizeof(cube.uboFS));
-		// Unmap after data has been copied
-		// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-		vkUnmapMemory(context.device, cube.uniformBuffer[1].memory);
+		// Write into the current frame's slices, the ring stays mapped and is host coherent so no map/unmap or flush is needed
+		memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, cube.uniformBuffer[0].slice), &cube.uboVS, sizeof(cube.uboVS));
+		memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, cube.uniformBuffer[1].slice), &cube.uboFS, sizeof(cube.uboFS));
 	}
 }
 
 void prepareUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
 	// Prepare and initialize a uniform buffer block containing shader uniforms
 	// Single uniforms like in OpenGL are no longer present in Vulkan. All Shader uniforms are passed via uniform buffer blocks
-	VkMemoryRequirements memReqs;
-	// Vertex shader uniform buffer block
-	VkBufferCreateInfo bufferInfo = {};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+
+	// Vertex and fragment shader uniform buffer blocks of every cube, one aligned slice each per frame in flight
+	for (auto& cube : state.cubes) {
+		cube.uniformBuffer[0].slice = reserveUniformSlice(context, state.uniformRing, sizeof(cube.uboVS));
+		cube.uniformBuffer[1].slice = reserveUniformSlice(context, state.uniformRing, sizeof(cube.uboFS));
+	}
+	createUniformRing(context, state.uniformRing, context.swapchainImageCount);
 
 	for (auto& cube : state.cubes) {
-		bufferInfo.size = sizeof(cube.uboVS);
-		bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			cube.uniformBuffer[0].buffer, cube.uniformBuffer[0].memory);
-	
 		// Store information in the uniform's descriptor that is used by the descriptor set
-		cube.uniformBuffer[0].descriptor.buffer = cube.uniformBuffer[0].buffer;
+		// The offsets stay 0, the slice and frame region are selected with dynamic offsets when binding
+		cube.uniformBuffer[0].descriptor.buffer = state.uniformRing.buffer;
 		cube.uniformBuffer[0].descriptor.offset = 0;
 		cube.uniformBuffer[0].descriptor.range = sizeof(cube.uboVS);
 
-		bufferInfo.size = sizeof(cube.uboFS);
-		bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			cube.uniformBuffer[1].buffer, cube.uniformBuffer[1].memory);
-	
-		// Store information in the uniform's descriptor that is used by the descriptor set
-		cube.uniformBuffer[1].descriptor.buffer = cube.uniformBuffer[1].buffer;
+		cube.uniformBuffer[1].descriptor.buffer = state.uniformRing.buffer;
 		cube.uniformBuffer[1].descriptor.offset = 0;
 		cube.uniformBuffer[1].descriptor.range = sizeof(cube.uboFS);
 	}
@@ -491,6 +476,23 @@ void prepareUniformBuffers(struct LHContext& context, struct appState& state) {
 	updateUniformBuffers(context, state);
 }
 
+// The uniform ring gets a new buffer when the swap chain comes back with a different number of images
+void rebindUniformRing(struct LHContext& context, struct appState& state) {
+	for (auto& cube : state.cubes) {
+		std::array<VkWriteDescriptorSet, 2> writeDescriptorSet = {};
+		for (uint32_t i = 0; i < writeDescriptorSet.size(); i++) {
+			cube.uniformBuffer[i].descriptor.buffer = state.uniformRing.buffer;
+			writeDescriptorSet[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeDescriptorSet[i].dstSet = cube.descriptorSet;
+			writeDescriptorSet[i].descriptorCount = 1;
+			writeDescriptorSet[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			writeDescriptorSet[i].pBufferInfo = &cube.uniformBuffer[i].descriptor;
+			writeDescriptorSet[i].dstBinding = i;
+		}
+		vkUpdateDescriptorSets(context.device, static_cast<uint32_t>(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, nullptr);
+	}
+}
+
 
 /*
 	Upload texture image data to the GPU
@@ -510,7 +512,8 @@ void prepareUniformBuffers(struct LHContext& context, struct appState& state) {
 	In Short: Always use optimal tiled images for rendering.
 */
 
-void prepareLoadTexture(struct LHContext &context, struct appState &state, std::string filename, int index) {
+// The copy and layout transition are only recorded into the upload batch, they execute when it's submitted
+void prepareLoadTexture(struct LHContext &context, struct appState &state, std::string filename, int index, struct LHUploadBatch& uploads) {
 	VkResult U_ASSERT_ONLY res;
 	bool U_ASSERT_ONLY pass;
 
@@ -536,17 +539,8 @@ void prepareLoadTexture(struct LHContext &context, struct appState &state, std::
 		useStaging = !(formatProperties.linearTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
 	}
 
-	VkMemoryRequirements memReqs;
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.pNext = nullptr;
-	allocInfo.allocationSize = 0;
-	allocInfo.memoryTypeIndex = 0;
-
-	VkImage mappableImage;
-	VkDeviceMemory mappableMemory;
+	state.text[index].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-	// Load mip map level 0 to linear tiling image
 	VkImageCreateInfo imageCreateInfo = {};
 	imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 	imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -554,100 +548,79 @@ void prepareLoadTexture(struct LHContext &context, struct appState &state, std::
 	imageCreateInfo.mipLevels = 1;
 	imageCreateInfo.arrayLayers = 1;
 	imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-	imageCreateInfo.tiling = VK_IMAGE_TILING_LINEAR;
-	imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT;
 	imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
 	imageCreateInfo.extent = { state.text[index].width, state.text[index].height, 1 };
-	res = (vkCreateImage(context.device, &imageCreateInfo, nullptr, &mappableImage));
-	assert(res == VK_SUCCESS);
-
-	// Get memory requirements for this image like size and alignment
-	vkGetImageMemoryRequirements(context.device, mappableImage, &memReqs);
-	// Set memory allocation size to required memory size
-	allocInfo.allocationSize = memReqs.size;
-	// Get memory type that can be mapped to host memory
-	pass = memory_type_from_properties(context, memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &allocInfo.memoryTypeIndex);
-	assert(pass && "No mappable coherent memory");
-	res = (vkAllocateMemory(context.device, &allocInfo, nullptr, &mappableMemory));
-	assert(res == VK_SUCCESS);
-	res = (vkBindImageMemory(context.device, mappableImage, mappableMemory, 0));
-	assert(res == VK_SUCCESS);
-
-	// Map image memory
-	void* data;
-	res = (vkMapMemory(context.device, mappableMemory, 0,state.text[index].size, 0, &data));
-	assert(res == VK_SUCCESS);
-	// Copy image data of the first mip level into memory
-	memcpy(data, state.text[index].data,state.text[index].size);
-	vkUnmapMemory(context.device, mappableMemory);
 
-	state.text[index].image = mappableImage;
-	state.text[index].deviceMemory = mappableMemory;
-	state.text[index].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-	// Setup image memory barrier transfer image to shader read layout
-	VkCommandBuffer copyCmd = {};//VulkanExampleBase::createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
-	VkCommandBufferAllocateInfo commandBufferAllocateInfo{};
-	commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	commandBufferAllocateInfo.commandPool = context.cmd_pool;
-	commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	commandBufferAllocateInfo.commandBufferCount = 1;
-
-	res = (vkAllocateCommandBuffers(context.device, &commandBufferAllocateInfo, &copyCmd));
-	assert(res == VK_SUCCESS);
-	VkCommandBufferBeginInfo cmdBufInfo = {};
-	cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	res = (vkBeginCommandBuffer(copyCmd, &cmdBufInfo));
-	assert(res == VK_SUCCESS);
+	if (useStaging) {
+		// Optimal tiled image in device local memory, filled from a staging buffer by the batch
+		imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		res = (vkCreateImage(context.device, &imageCreateInfo, nullptr, &state.text[index].image));
+		assert(res == VK_SUCCESS);
 
-	// The sub resource range describes the regions of the image we will be transition
-	VkImageSubresourceRange subresourceRange = {};
-	subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	subresourceRange.baseMipLevel = 0;
-	subresourceRange.levelCount = 1;
-	subresourceRange.layerCount = 1;
-
-	// Transition the texture image layout to shader read, so it can be sampled from
-	VkImageMemoryBarrier imageMemoryBarrier{};
-	imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	imageMemoryBarrier.image = state.text[index].image;
-	imageMemoryBarrier.subresourceRange = subresourceRange;
-	imageMemoryBarrier.srcAccessMask = VK_ACCESS_HOST_WRITE_BIT;
-	imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-	imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
-	imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-	// Insert a memory dependency at the proper pipeline stages that will execute the image layout transition
-	// Source pipeline stage is host write/read exection (VK_PIPELINE_STAGE_HOST_BIT)
-	// Destination pipeline stage fragment shader access (VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT)
-	vkCmdPipelineBarrier(
-		copyCmd,
-		VK_PIPELINE_STAGE_HOST_BIT,
-		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-		0,
-		0, nullptr,
-		0, nullptr,
-		1, &imageMemoryBarrier);
-
-	if (copyCmd == VK_NULL_HANDLE){
-		return;
+		LHAllocation allocation;
+		res = allocateImageMemory(context, state.text[index].image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, allocation);
+		assert(res == VK_SUCCESS);
+		state.text[index].deviceMemory = allocation.memory;
+
+		// The images are loaded with depth bytes per texel (RGB for the JPEGs), the copy needs full RGBA texels
+		uint32_t texelCount = state.text[index].width * state.text[index].height;
+		std::vector<unsigned char> texels((size_t)texelCount * 4, 255);
+		for (uint32_t t = 0; t < texelCount; t++) {
+			for (uint32_t c = 0; c < std::min<uint32_t>(state.text[index].depth, 4); c++) {
+				texels[t * 4 + c] = state.text[index].data[t * state.text[index].depth + c];
+			}
+		}
+		batchCopyImage(context, uploads, texels.data(), texels.size(), state.text[index].image,
+			state.text[index].width, state.text[index].height, state.text[index].imageLayout);
 	}
+	else {
+		VkMemoryRequirements memReqs;
+		VkMemoryAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.pNext = nullptr;
+		allocInfo.allocationSize = 0;
+		allocInfo.memoryTypeIndex = 0;
+
+		VkImage mappableImage;
+		VkDeviceMemory mappableMemory;
+
+		// Load mip map level 0 to linear tiling image
+		imageCreateInfo.tiling = VK_IMAGE_TILING_LINEAR;
+		imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT;
+		imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_PREINITIALIZED;
+		res = (vkCreateImage(context.device, &imageCreateInfo, nullptr, &mappableImage));
+		assert(res == VK_SUCCESS);
 
-	res = (vkEndCommandBuffer(copyCmd));
+		// Get memory requirements for this image like size and alignment
+		vkGetImageMemoryRequirements(context.device, mappableImage, &memReqs);
+		// Set memory allocation size to required memory size
+		allocInfo.allocationSize = memReqs.size;
+		// Get memory type that can be mapped to host memory
+		pass = memory_type_from_properties(context, memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &allocInfo.memoryTypeIndex);
+		assert(pass && "No mappable coherent memory");
+		res = (vkAllocateMemory(context.device, &allocInfo, nullptr, &mappableMemory));
+		assert(res == VK_SUCCESS);
+		res = (vkBindImageMemory(context.device, mappableImage, mappableMemory, 0));
+		assert(res == VK_SUCCESS);
 
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &copyCmd;
+		// Map image memory
+		void* data;
+		res = (vkMapMemory(context.device, mappableMemory, 0,state.text[index].size, 0, &data));
+		assert(res == VK_SUCCESS);
+		// Copy image data of the first mip level into memory
+		memcpy(data, state.text[index].data,state.text[index].size);
+		vkUnmapMemory(context.device, mappableMemory);
 
-	res = (vkQueueSubmit(context.queue, 1, &submitInfo, VK_NULL_HANDLE));
-	res = (vkQueueWaitIdle(context.queue));
+		state.text[index].image = mappableImage;
+		state.text[index].deviceMemory = mappableMemory;
 
-	vkFreeCommandBuffers(context.device, context.cmd_pool, 1, &copyCmd);
+		// Transition the texture image layout to shader read, so it can be sampled from
+		// Source is the host write above, destination the fragment shader access
+		batchTransitionImage(context, uploads, state.text[index].image, VK_IMAGE_LAYOUT_PREINITIALIZED, state.text[index].imageLayout,
+			VK_ACCESS_HOST_WRITE_BIT, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
+	}
 
 	// Create a texture sampler
 	// In Vulkan textures are accessed by samplers
@@ -781,8 +754,8 @@ void prepareVertices(struct LHContext& context, struct appState& state, int inde
 
 	state.cubes[index].i.count = ni;
 
-	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.cubes[index].i.buffer, state.cubes[index].i.memory);
-	mapVerticiesToGPU(context, state.cubes[index].vBuffer, dataSize, state.cubes[index].v.buffer, state.cubes[index].v.memory);
+	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.cubes[index].i.buffer, state.cubes[index].i.memory, useStagingBuffers);
+	mapVerticiesToGPU(context, state.cubes[index].vBuffer, dataSize, state.cubes[index].v.buffer, state.cubes[index].v.memory, useStagingBuffers);
 
 	//// Vertex input descriptions 
 	//// Specifies the vertex input parameters for a pipeline
@@ -820,14 +793,26 @@ void prepareVertices(struct LHContext& context, struct appState& state, int inde
 void renderLoop(struct LHContext& context, struct appState& state) {
 
 	while (!glfwWindowShouldClose(context.window)) {
-		glfwPollEvents();
-		draw(context);
+		waitForEvents(context);
 		if (update) {
-			updateUniformBuffers(context, state);
+			markUniformRingDirty(state.uniformRing);
+			markFrameDirty(context);
 			update = false;
 		}
+		// Nothing changed since the last presented image, keep sleeping
+		if (!frameNeeded(context)) {
+			continue;
+		}
+		acquireFrame(context);
+		// Each ring region is rewritten once its previous frame has finished, never while the GPU reads it
+		if (uniformRingStale(state.uniformRing, context.currentBuffer)) {
+			updateUniformBuffers(context, state);
+		}
+		submitFrame(context);
 	}
 
+	printFrameStats(context);
+
 	// Flush device to make sure all resources can be freed
 	if (context.device != VK_NULL_HANDLE) {
 		vkDeviceWaitIdle(context.device);
@@ -890,21 +875,38 @@ int main() {
 	prepareSynchronizationPrimitives(context);
 
 	//---> Implement our own functions
-	prepareLoadTexture(context, state, "crate1.jpg", 0);
-	prepareLoadTexture(context, state, "crate2.jpg", 1);
+	// Textures and meshes are copied into device local memory with a single submission
+	struct LHUploadBatch uploads;
+	beginUploadBatch(context, uploads);
+	prepareLoadTexture(context, state, "crate1.jpg", 0, uploads);
+	prepareLoadTexture(context, state, "crate2.jpg", 1, uploads);
 	for (int i = 0; i < state.cubes.size(); i++) {
-		prepareVertices(context, state, i,false);
+		prepareVertices(context, state, i,true);
 	}
+	submitUploadBatch(context, uploads);
 	prepareUniformBuffers(context, state);
 	setupDescriptorSetLayout(context, state);
-	preparePipelines(context, state);
+	timePipelineCreation(context, [&]() { preparePipelines(context, state); });
+	printShaderCacheStats(context);
 	setupDescriptorPool(context, state);
 	setupDescriptorSet(context, state);
 	buildCommandBuffers(context, state);
 
 	glfwSetKeyCallback(context.window, key_callback);
+	// Only redraw when the view changes
+	context.renderOnDemand = true;
+	// The new frame buffers need new command buffers, and the projection follows the aspect ratio
+	context.onSwapChainRecreated = [&]() {
+		if (resizeUniformRing(context, state.uniformRing, context.swapchainImageCount)) {
+			rebindUniformRing(context, state);
+		}
+		buildCommandBuffers(context, state);
+		markUniformRingDirty(state.uniformRing);
+	};
 
 	renderLoop(context, state);
+	// The next run starts with these pipelines already compiled
+	savePipelineCache(context);
 
 	return 0;
 }
\ No newline at end of file
@@ -12,6 +12,18 @@
 #define OBJ_MESH
 #define WIDTH 512
 #define HEIGHT 512
+// Use the SPIR-V compiled by the build (include/shaders.targets) instead of compiling the GLSL at startup
+#define BUILD_TIME_SHADERS true
+// Rebuild the pipelines whenever a file under shaders/ is saved
+#define SHADER_HOT_RELOAD true
+
+#if BUILD_TIME_SHADERS
+#include "shaders/spv/shaderquad.vert.h"
+#include "shaders/spv/shaderquad.frag.h"
+#include "shaders/spv/shader.vert.h"
+#include "shaders/spv/shader.frag.h"
+#include "shaders/spv/shaderOffscree.vert.h"
+#endif
 
 
 //Custom States depending on what is needed
@@ -23,12 +35,12 @@ struct appState {
 	struct indices i[2];
 	float* vBuffer;
 
-	// Uniform buffer block object
+	// Uniform buffer block objects (scene, quad, offscreen), slices of every frame region in the ring
 	struct {
-		VkDeviceMemory memory;
-		VkBuffer buffer;
+		uint32_t slice;
 		VkDescriptorBufferInfo descriptor;
 	}  uniformBufferVS[3];
+	struct LHUniformRing uniformRing;
 
 	glm::vec3 lighPos = glm::vec3();
 
@@ -50,29 +62,33 @@ struct appState {
 	} uboVSscene;
 
 
-	// Framebuffer for offscreen rendering
-	struct FrameBufferAttachment {
-		VkImage image;
-		VkDeviceMemory mem;
-		VkImageView view;
-	};
-
+	// Shadow map rendered from the light's point of view, its image is owned by the render graph
 	struct OffscreenPass {
 		int32_t width, height;
-		VkFramebuffer frameBuffer;
-		FrameBufferAttachment depth;
-		VkRenderPass renderPass;
 		VkSampler depthSampler;
 		VkDescriptorImageInfo descriptor;
 	} offscreenPass;
 
+	// Shadow pass and scene pass, the graph derives their render passes and the dependency between them
+	struct LHRenderGraph graph;
+	uint32_t shadowPass;
+	uint32_t scenePass;
+	uint32_t shadowMap;
+
 	VkPipelineLayout pipelineLayout;
 	struct {
 		VkPipeline quad;
 		VkPipeline offscreen;
-		VkPipeline sceneShadow;
-		VkPipeline sceneShadowPCF;
 	} pipelines;
+	// Shadowed scene with and without PCF filtering, keyed by the enablePCF constant (constant_id = 0)
+	struct LHPipelinePermutations scenePermutations;
+	// Pipelines still on the pipeline compiler, VK_NULL_HANDLE above until collectPipelines() takes them
+	struct {
+		std::shared_future<VkPipeline> quad;
+		std::shared_future<VkPipeline> offscreen;
+		std::shared_future<VkPipeline> scene[2];
+	} pending;
+	bool sceneReady = false;
 	struct {
 		VkPipelineLayout quad;
 		VkPipelineLayout offscreen;
@@ -85,16 +101,20 @@ struct appState {
 	VkDescriptorSetLayout descriptorSetLayout;
 	VkDescriptorSet descriptorSet;
 
-	std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages{};
-	VkVertexInputBindingDescription vertexInputBinding[2];
-	std::array<VkVertexInputAttributeDescription, 3> vertexInputAttributs;
+	// Every stage the pipelines use, the layouts and vertex inputs are reflected from them
+	std::vector<LHShaderSource> shaderSources;
+	std::vector<VkPipelineShaderStageCreateInfo> stages;
+	uint32_t vertexStride;
 };
 
 glm::vec3 rotation = glm::vec3();
 glm::vec3 cameraPos = glm::vec3();
 glm::vec2 mousePos;
 bool filterPCF = true;
+// Record every frame across the record threads instead of replaying the static command buffers
+bool recordPerFrame = true;
 bool update = false;
+bool rebuild = false;
 float eyex, eyey, eyez;	// current user position
 
 double theta, phi;		// user's position  on a sphere centered on the object
@@ -102,114 +122,12 @@ double r;
 int triangles;			// number of triangles
 
 
-// Set up a separate render pass for the offscreen frame buffer
-// This is necessary as the offscreen frame buffer attachments use formats different to those from the example render pass
-void prepareOffscreenRenderpass(struct LHContext &context, struct appState &state){
-	VkResult U_ASSERT_ONLY res;
-	
-	VkAttachmentDescription attachmentDescription{};
-	attachmentDescription.format = VK_FORMAT_D16_UNORM;
-	attachmentDescription.samples = VK_SAMPLE_COUNT_1_BIT;
-	attachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;							// Clear depth at beginning of the render pass
-	attachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_STORE;						// We will read from depth, so it's important to store the depth attachment results
-	attachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-	attachmentDescription.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-	attachmentDescription.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;					// We don't care about initial layout of the attachment
-	attachmentDescription.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;// Attachment will be transitioned to shader read at render pass end
-
-	VkAttachmentReference depthReference = {};
-	depthReference.attachment = 0;
-	depthReference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;			// Attachment will be used as depth/stencil during render pass
-
-	VkSubpassDescription subpass = {};
-	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-	subpass.colorAttachmentCount = 0;													// No color attachments
-	subpass.pDepthStencilAttachment = &depthReference;									// Reference to our depth attachment
-
-	// Use subpass dependencies for layout transitions
-	std::array<VkSubpassDependency, 2> dependencies;
-
-	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
-	dependencies[0].dstSubpass = 0;
-	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-	dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
-	dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-	dependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-
-	dependencies[1].srcSubpass = 0;
-	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
-	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
-	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-	dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-	dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-	dependencies[1].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
-
-	VkRenderPassCreateInfo renderPassCreateInfo = {};
-	renderPassCreateInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-	renderPassCreateInfo.attachmentCount = 1;
-	renderPassCreateInfo.pAttachments = &attachmentDescription;
-	renderPassCreateInfo.subpassCount = 1;
-	renderPassCreateInfo.pSubpasses = &subpass;
-	renderPassCreateInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
-	renderPassCreateInfo.pDependencies = dependencies.data();
-
-	res = (vkCreateRenderPass(context.device, &renderPassCreateInfo, nullptr, &state.offscreenPass.renderPass));
-	assert(res == VK_SUCCESS);
-}
-
-// Setup the offscreen framebuffer for rendering the scene from light's point-of-view to
-// The depth attachment of this framebuffer will then be used to sample from in the fragment shader of the shadowing pass
-void prepareShadowFramebuffer(struct LHContext &context, struct appState&state) {
+// Sampler for the shadow map, used in the fragment shader for shadowed rendering
+void prepareShadowSampler(struct LHContext &context, struct appState&state) {
 	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
 	state.offscreenPass.width = 1280;
 	state.offscreenPass.height = 720;
 
-	// For shadow mapping we only need a depth attachment
-	VkImageCreateInfo image = {};
-	image.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-	image.imageType = VK_IMAGE_TYPE_2D;
-	image.extent.width = state.offscreenPass.width;
-	image.extent.height = state.offscreenPass.height;
-	image.extent.depth = 1;
-	image.mipLevels = 1;
-	image.arrayLayers = 1;
-	image.samples = VK_SAMPLE_COUNT_1_BIT;
-	image.tiling = VK_IMAGE_TILING_OPTIMAL;
-	image.format = VK_FORMAT_D16_UNORM;																// Depth stencil attachment
-	image.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;		// We will sample directly from the depth attachment for the shadow mapping
-	res =(vkCreateImage(context.device, &image, nullptr, &state.offscreenPass.depth.image));
-	assert(res == VK_SUCCESS);
-
-	VkMemoryAllocateInfo memAlloc = {};
-	memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	VkMemoryRequirements memReqs;
-	vkGetImageMemoryRequirements(context.device, state.offscreenPass.depth.image, &memReqs);
-	memAlloc.allocationSize = memReqs.size;
-	pass = memory_type_from_properties(context, memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &memAlloc.memoryTypeIndex);
-	assert(pass);
-
-	res = (vkAllocateMemory(context.device, &memAlloc, nullptr, &state.offscreenPass.depth.mem));
-	assert(res == VK_SUCCESS);
-	res = (vkBindImageMemory(context.device, state.offscreenPass.depth.image, state.offscreenPass.depth.mem, 0));
-	assert(res == VK_SUCCESS);
-
-	VkImageViewCreateInfo depthStencilView = {};
-	depthStencilView.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-	depthStencilView.viewType = VK_IMAGE_VIEW_TYPE_2D;
-	depthStencilView.format = VK_FORMAT_D16_UNORM;
-	depthStencilView.subresourceRange = {};
-	depthStencilView.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-	depthStencilView.subresourceRange.baseMipLevel = 0;
-	depthStencilView.subresourceRange.levelCount = 1;
-	depthStencilView.subresourceRange.baseArrayLayer = 0;
-	depthStencilView.subresourceRange.layerCount = 1;
-	depthStencilView.image = state.offscreenPass.depth.image;
-	res = (vkCreateImageView(context.device, &depthStencilView, nullptr, &state.offscreenPass.depth.view));
-	assert(res == VK_SUCCESS);
-	// Create sampler to sample from to depth attachment 
-	// Used to sample in the fragment shader for shadowed rendering
 	VkSamplerCreateInfo sampler = {};
 	sampler.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
 	sampler.maxAnisotropy = 1.0f;
@@ -226,23 +144,129 @@ void prepareShadowFramebuffer(struct LHContext &context, struct appState&state)
 	sampler.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
 	res = (vkCreateSampler(context.device, &sampler, nullptr, &state.offscreenPass.depthSampler));
 	assert(res == VK_SUCCESS);
+}
 
-	prepareOffscreenRenderpass(context, state);
+// Draw lists of the two passes, an item is one indexed draw
+#define SHADOW_ITEMS 1
+#define SCENE_ITEMS 2
+
+// Shadow map pass, item 0 is the teapot seen from the light
+void recordShadowItems(struct LHContext& context, struct appState& state, VkCommandBuffer cmd, uint32_t image, uint32_t first, uint32_t count) {
+	// Update dynamic viewport state
+	VkViewport viewport = {};
+	createViewports(context, cmd, viewport);
+
+	// Update dynamic scissor state
+	VkRect2D scissor = {};
+	createScisscor(context, cmd, scissor);
+
+	// Set depth bias (aka "Polygon offset")
+	// Required to avoid shadow mapping artefacts
+	vkCmdSetDepthBias(
+		cmd,
+		1.25f,
+		0.0f,
+		1.75f);
+	VkDeviceSize offsets[1] = { 0 };
+
+	for (uint32_t item = first; item < first + count; item++) {
+		// Still compiling
+		if (state.pipelines.offscreen == VK_NULL_HANDLE) {
+			continue;
+		}
+		vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelines.offscreen);
+		// The dynamic offset selects the ring region that belongs to this image
+		uint32_t dynamicOffset = uniformRingOffset(state.uniformRing, image, state.uniformBufferVS[2].slice);
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayouts.offscreen, 0, 1, &state.descriptorSets.offscreen, 1, &dynamicOffset);
+
+		vkCmdBindVertexBuffers(cmd, 0, 1, &state.v[0].buffer, offsets);
+		vkCmdBindIndexBuffer(cmd, state.i[0].buffer, 0, VK_INDEX_TYPE_UINT32);
+		vkCmdDrawIndexed(cmd, state.i[0].count, 1, 0, 0, 0);
+	}
+}
 
-	// Create frame buffer
-	VkFramebufferCreateInfo fbufCreateInfo = {};
-	fbufCreateInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-	fbufCreateInfo.renderPass = state.offscreenPass.renderPass;
-	fbufCreateInfo.attachmentCount = 1;
-	fbufCreateInfo.pAttachments = &state.offscreenPass.depth.view;
-	fbufCreateInfo.width = state.offscreenPass.width;
-	fbufCreateInfo.height = state.offscreenPass.height;
-	fbufCreateInfo.layers = 1;
+// Scene pass, item 0 visualizes the shadow map on a plane and item 1 is the shadowed teapot
+void recordSceneItems(struct LHContext& context, struct appState& state, VkCommandBuffer cmd, uint32_t image, uint32_t first, uint32_t count) {
+	// Update dynamic viewport state
+	VkViewport viewport = {};
+	createViewports(context, cmd, viewport);
+
+	// Update dynamic scissor state
+	VkRect2D scissor = {};
+	createScisscor(context, cmd, scissor);
+	VkDeviceSize offsets[1] = { 0 };
+
+	for (uint32_t item = first; item < first + count; item++) {
+		// Skip a pipeline that is still compiling
+		if (item == 0 ? state.pipelines.quad == VK_NULL_HANDLE : !state.sceneReady) {
+			continue;
+		}
+		if (item == 0) {
+			// Visualize shadow map
+			uint32_t dynamicOffset = uniformRingOffset(state.uniformRing, image, state.uniformBufferVS[1].slice);
+			vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayouts.quad, 0, 1, &state.descriptorSet, 1, &dynamicOffset);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelines.quad);
+			vkCmdBindVertexBuffers(cmd, 0, 1, &state.v[1].buffer, offsets);
+			vkCmdBindIndexBuffer(cmd, state.i[1].buffer, 0, VK_INDEX_TYPE_UINT32);
+			vkCmdDrawIndexed(cmd, state.i[1].count, 1, 0, 0, 0);
+		}
+		else {
+			// 3D scene
+			uint32_t dynamicOffset = uniformRingOffset(state.uniformRing, image, state.uniformBufferVS[0].slice);
+			vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayouts.quad, 0, 1, &state.descriptorSets.scene, 1, &dynamicOffset);
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipelinePermutation(context, state.scenePermutations, { filterPCF ? 1u : 0u }));
+
+			vkCmdBindVertexBuffers(cmd, 0, 1, &state.v[0].buffer, offsets);
+			vkCmdBindIndexBuffer(cmd, state.i[0].buffer, 0, VK_INDEX_TYPE_UINT32);
+			vkCmdDrawIndexed(cmd, state.i[0].count, 1, 0, 0, 0);
+		}
+	}
+}
 
-	res = (vkCreateFramebuffer(context.device, &fbufCreateInfo, nullptr, &state.offscreenPass.frameBuffer));
-	assert(res == VK_SUCCESS);
+// Records a pass's draw items inline, or split across the record threads into secondary command buffers
+void recordGraphItems(struct LHContext& context, struct appState& state, uint32_t pass, VkCommandBuffer cmd, uint32_t image, VkSubpassContents contents, uint32_t itemCount, const LHRecordFunc& record) {
+	if (contents == VK_SUBPASS_CONTENTS_INLINE) {
+		record(cmd, 0, itemCount);
+		return;
+	}
+	std::vector<VkCommandBuffer> secondaries;
+	VkCommandBufferInheritanceInfo inheritance = graphInheritance(state.graph, pass, image);
+	recordSecondaryCommandBuffers(context, inheritance, itemCount, record, secondaries);
+	vkCmdExecuteCommands(cmd, (uint32_t)secondaries.size(), secondaries.data());
+}
+
+// The shadow pass writes the shadow map that the scene pass samples, the graph orders them and derives
+// the layout transition and dependency in between that used to be written out by hand
+void prepareRenderGraph(struct LHContext& context, struct appState& state) {
+	VkClearValue colorClear[2];
+	createClearColor(context, colorClear);
+	VkClearValue depthClear;
+	depthClear.depthStencil = { 1.0f, 0 };
+
+	state.shadowMap = addGraphImage(state.graph, "shadow map", VK_FORMAT_D16_UNORM, state.offscreenPass.width, state.offscreenPass.height);
+	uint32_t depth = addGraphImage(state.graph, "scene depth", VK_FORMAT_D16_UNORM);
+	uint32_t backbuffer = addGraphBackbuffer(state.graph);
+
+	state.shadowPass = addGraphPass(state.graph, "shadow", [&context, &state](VkCommandBuffer cmd, uint32_t image, VkSubpassContents contents) {
+		recordGraphItems(context, state, state.shadowPass, cmd, image, contents, SHADOW_ITEMS, [&](VkCommandBuffer secondary, uint32_t first, uint32_t count) {
+			recordShadowItems(context, state, secondary, image, first, count);
+		});
+	});
+	graphWriteDepth(state.graph, state.shadowPass, state.shadowMap, depthClear);
+
+	state.scenePass = addGraphPass(state.graph, "scene", [&context, &state](VkCommandBuffer cmd, uint32_t image, VkSubpassContents contents) {
+		recordGraphItems(context, state, state.scenePass, cmd, image, contents, SCENE_ITEMS, [&](VkCommandBuffer secondary, uint32_t first, uint32_t count) {
+			recordSceneItems(context, state, secondary, image, first, count);
+		});
+	});
+	graphWriteColor(state.graph, state.scenePass, backbuffer, colorClear[0]);
+	graphWriteDepth(state.graph, state.scenePass, depth, depthClear);
+	graphRead(state.graph, state.scenePass, state.shadowMap);
+
+	compileRenderGraph(context, state.graph, backbuffer);
 }
 
+// Static command buffers, recorded once per swap chain image and re-recorded as a whole on any change
 void buildCommandBuffers(struct LHContext& context, struct appState& state) {
 	VkResult U_ASSERT_ONLY res;
 
@@ -250,131 +274,44 @@ void buildCommandBuffers(struct LHContext& context, struct appState& state) {
 	cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
 	cmdBufInfo.pNext = nullptr;
 
-	// Set clear values for all framebuffer attachments with loadOp set to clear
-	// We use two attachments (color and depth) that are cleared at the start of the subpass and as such we need to set clear values for both
-	VkClearValue clearValues[2];
-	createClearColor(context, clearValues);
-
-	VkRenderPassBeginInfo renderPassBeginInfo = {};
-	createRenderPassCreateInfo(context, renderPassBeginInfo);
-	renderPassBeginInfo.clearValueCount = 2;
-	renderPassBeginInfo.pClearValues = clearValues;
-
 	for (int32_t i = 0; i < context.cmdBuffer.size(); ++i) {
-		// Set target frame buffer
-		renderPassBeginInfo.framebuffer = context.frameBuffers[i];
-
 		res = (vkBeginCommandBuffer(context.cmdBuffer[i], &cmdBufInfo));
 		assert(res == VK_SUCCESS);
-		{
-			clearValues[0].depthStencil = { 1.0f, 0 };
-
-			VkRenderPassBeginInfo renderPassBeginInfo = {};
-			renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-			renderPassBeginInfo.renderPass = state.offscreenPass.renderPass;
-			renderPassBeginInfo.framebuffer = state.offscreenPass.frameBuffer;
-			renderPassBeginInfo.renderArea.extent.width = state.offscreenPass.width;
-			renderPassBeginInfo.renderArea.extent.height = state.offscreenPass.height;
-			renderPassBeginInfo.clearValueCount = 1;
-			renderPassBeginInfo.pClearValues = clearValues;
-
-			vkCmdBeginRenderPass(context.cmdBuffer[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-			// Update dynamic viewport state
-			VkViewport viewport = {};
-			createViewports(context, context.cmdBuffer[i], viewport);
-
-			// Update dynamic scissor state
-			VkRect2D scissor = {};
-			createScisscor(context, context.cmdBuffer[i], scissor);
-
-			// Set depth bias (aka "Polygon offset")
-			// Required to avoid shadow mapping artefacts
-			vkCmdSetDepthBias(
-				context.cmdBuffer[i],
-				1.25f,
-				0.0f,
-				1.75f);
-			VkDeviceSize offsets[1] = { 0 };
-
-			vkCmdBindPipeline(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelines.offscreen);
-			vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayouts.offscreen, 0, 1, &state.descriptorSets.offscreen, 0, NULL);
-
-			vkCmdBindVertexBuffers(context.cmdBuffer[i], 0, 1, &state.v[0].buffer, offsets);
-			vkCmdBindIndexBuffer(context.cmdBuffer[i], state.i[0].buffer, 0, VK_INDEX_TYPE_UINT32);
-			vkCmdDrawIndexed(context.cmdBuffer[i], state.i[0].count, 1, 0, 0, 0);
-
-			vkCmdEndRenderPass(context.cmdBuffer[i]);
-		}
-		{
-			{
-				clearValues[1].depthStencil = { 1.0f, 0 };
-
-				VkRenderPassBeginInfo renderPassBeginInfo = {};
-				renderPassBeginInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-				renderPassBeginInfo.renderPass = context.render_pass;
-				renderPassBeginInfo.framebuffer = context.frameBuffers[i];
-				renderPassBeginInfo.renderArea.extent.width = context.width;
-				renderPassBeginInfo.renderArea.extent.height = context.height;
-				renderPassBeginInfo.clearValueCount = 2;
-				renderPassBeginInfo.pClearValues = clearValues;
-
-				vkCmdBeginRenderPass(context.cmdBuffer[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
-
-				// Update dynamic viewport state
-				VkViewport viewport = {};
-				createViewports(context, context.cmdBuffer[i], viewport);
-
-				// Update dynamic scissor state
-				VkRect2D scissor = {};
-				createScisscor(context, context.cmdBuffer[i], scissor);
-				VkDeviceSize offsets[1] = { 0 };
-
-				// Visualize shadow map
-				if (true) {
-					vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayouts.quad, 0, 1, &state.descriptorSet, 0, NULL);
-					vkCmdBindPipeline(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelines.quad);
-					vkCmdBindVertexBuffers(context.cmdBuffer[i], 0, 1, &state.v[1].buffer, offsets);
-					vkCmdBindIndexBuffer(context.cmdBuffer[i], state.i[1].buffer, 0, VK_INDEX_TYPE_UINT32);
-					vkCmdDrawIndexed(context.cmdBuffer[i], state.i[1].count, 1, 0, 0, 0);
-				}
-
-				// 3D scene
-				vkCmdBindDescriptorSets(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, state.pipelineLayouts.quad, 0, 1, &state.descriptorSets.scene, 0, NULL);
-				vkCmdBindPipeline(context.cmdBuffer[i], VK_PIPELINE_BIND_POINT_GRAPHICS, (filterPCF) ? state.pipelines.sceneShadowPCF : state.pipelines.sceneShadow);
-
-				vkCmdBindVertexBuffers(context.cmdBuffer[i], 0, 1, &state.v[0].buffer, offsets);
-				vkCmdBindIndexBuffer(context.cmdBuffer[i], state.i[0].buffer, 0, VK_INDEX_TYPE_UINT32);
-				vkCmdDrawIndexed(context.cmdBuffer[i], state.i[0].count, 1, 0, 0, 0);
-
-				vkCmdEndRenderPass(context.cmdBuffer[i]);
-			}
 
-			res = (vkEndCommandBuffer(context.cmdBuffer[i]));
-			assert(res == VK_SUCCESS);
-		}
+		recordRenderGraph(context, state.graph, context.cmdBuffer[i], i, VK_SUBPASS_CONTENTS_INLINE);
+
+		res = (vkEndCommandBuffer(context.cmdBuffer[i]));
+		assert(res == VK_SUCCESS);
 	}
 }
 
-void setupDescriptorPool(struct LHContext& context, struct appState& state) {
+// Per-frame recording, the draw lists of both passes are split across the record threads into
+// secondary command buffers that the frame's primary executes inside each render pass
+VkCommandBuffer recordFrame(struct LHContext& context, struct appState& state) {
 	VkResult U_ASSERT_ONLY res;
+	VkCommandBuffer cmd = beginFrameCommandBuffer(context);
 
-	// We need to tell the API the number of max. requested descriptors per type
-	VkDescriptorPoolSize typeCounts[2];
-	// This example only uses one descriptor type (uniform buffer) and only requests one descriptor of this type
-	typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	typeCounts[0].descriptorCount = 6;
+	recordRenderGraph(context, state.graph, cmd, context.currentBuffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
 
-	typeCounts[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	typeCounts[1].descriptorCount = 4;
+	res = vkEndCommandBuffer(cmd);
+	assert(res == VK_SUCCESS);
+	return cmd;
+}
+
+void setupDescriptorPool(struct LHContext& context, struct appState& state) {
+	VkResult U_ASSERT_ONLY res;
+
+	// Enough descriptors for the three sets (offscreen, scene, quad) of the reflected layout
+	std::vector<VkDescriptorPoolSize> typeCounts;
+	addDescriptorPoolSizes(context, state.descriptorSetLayout, 3, typeCounts);
 
 	// Create the global descriptor pool
 	// All descriptors used in this example are allocated from this pool
 	VkDescriptorPoolCreateInfo descriptorPoolInfo = {};
 	descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 	descriptorPoolInfo.pNext = nullptr;
-	descriptorPoolInfo.poolSizeCount = 2;
-	descriptorPoolInfo.pPoolSizes = typeCounts;
+	descriptorPoolInfo.poolSizeCount = static_cast<uint32_t>(typeCounts.size());
+	descriptorPoolInfo.pPoolSizes = typeCounts.data();
 	// Set the max. number of descriptor sets that can be requested from this pool (requesting beyond this limit will result in an error)
 	descriptorPoolInfo.maxSets = 3;
 
@@ -383,63 +320,20 @@ void setupDescriptorPool(struct LHContext& context, struct appState& state) {
 }
 
 void setupDescriptorSetLayout(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-
-	// Setup layout of descriptors used in this example
-	// Basically connects the different shader stages to descriptors for binding uniform buffers, image samplers, etc.
-	// So every shader binding should map to one descriptor set layout binding
-
-	/*
-
-	Descriptor set layout
-
-	The layout describes the shader bindings and types used for a certain descriptor layout and as such must match the shader bindings
-
-	Shader bindings used in this example:
-
-	VS:
-		layout (set = 0, binding = 0) uniform uboVS ...
-
-	FS :
-		layout (set = 0, binding = 1) uniform imagesampler ...;
-
-	*/
-
-
-	// Binding 0: Uniform buffer (Vertex shader)
-	std::array<VkDescriptorSetLayoutBinding, 2>layoutBinding = {};
-	layoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	layoutBinding[0].descriptorCount = 1;
-	layoutBinding[0].binding = 0;
-	layoutBinding[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
-	layoutBinding[0].pImmutableSamplers = nullptr;
-
-	// Binding 0: Uniform buffer (Fragment shader)
-	layoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	layoutBinding[1].descriptorCount = 1;
-	layoutBinding[1].binding = 1;
-	layoutBinding[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-	layoutBinding[1].pImmutableSamplers = nullptr;
-
-	VkDescriptorSetLayoutCreateInfo descriptorLayout = {};
-	descriptorLayout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-	descriptorLayout.pNext = nullptr;
-	descriptorLayout.bindingCount = static_cast<uint32_t>(layoutBinding.size());
-	descriptorLayout.pBindings = layoutBinding.data();
-
-	res = (vkCreateDescriptorSetLayout(context.device, &descriptorLayout, nullptr, &state.descriptorSetLayout));
-	assert(res == VK_SUCCESS);
-
-	// Create the pipeline layout that is used to generate the rendering pipelines that are based on this descriptor set layout
-	// In a more complex scenario you would have different pipeline layouts for different descriptor set layouts that could be reused
-	VkPipelineLayoutCreateInfo pPipelineLayoutCreateInfo = {};
-	pPipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pPipelineLayoutCreateInfo.pNext = nullptr;
-	pPipelineLayoutCreateInfo.setLayoutCount = 1;
-	pPipelineLayoutCreateInfo.pSetLayouts = &state.descriptorSetLayout;
-
-	res = (vkCreatePipelineLayout(context.device, &pPipelineLayoutCreateInfo, nullptr, &state.pipelineLayout));
-	assert(res == VK_SUCCESS);
+	// The layout describes the shader bindings and types used for a certain descriptor layout and as such must match the shader bindings.
+	// Rather than writing it out by hand it is read from the shaders themselves:
+	//
+	// VS:
+	//	layout (set = 0, binding = 0) uniform uboVS ...			(dynamic, every pass picks its slice of the uniform ring)
+	// FS:
+	//	layout (set = 0, binding = 1) uniform sampler2D ...
+	std::vector<VkDescriptorSetLayout> setLayouts;
+	state.pipelineLayout = createReflectedPipelineLayout(context, state.stages, true, &setLayouts);
+	assert(setLayouts.size() == 1);
+	state.descriptorSetLayout = setLayouts[0];
+	// Every pass binds the same descriptor set layout
+	state.pipelineLayouts.quad = state.pipelineLayout;
+	state.pipelineLayouts.offscreen = state.pipelineLayout;
 }
 
 void setupDescriptorSet(struct LHContext& context, struct appState& state) {
@@ -457,15 +351,15 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 
 	VkDescriptorImageInfo texDescriptor = {};
 	texDescriptor.sampler = state.offscreenPass.depthSampler;
-	texDescriptor.imageView = state.offscreenPass.depth.view;
-	texDescriptor.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	texDescriptor.imageView = state.graph.images[state.shadowMap].view;
+	texDescriptor.imageLayout = state.graph.images[state.shadowMap].readLayout;
 
 	std::array<VkWriteDescriptorSet, 2> writeDescriptorSet = {};
 
 	// Binding 0 : Vertex shader uniform buffer
 	writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	writeDescriptorSet[0].dstSet = state.descriptorSet;
-	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	writeDescriptorSet[0].dstBinding = 0;
 	writeDescriptorSet[0].pBufferInfo = &state.uniformBufferVS[1].descriptor;
 	writeDescriptorSet[0].descriptorCount = 1;
@@ -483,30 +377,27 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 	// Offscreen
 	res = (vkAllocateDescriptorSets(context.device, &allocInfo, &state.descriptorSets.offscreen));
 
-	std::array<VkWriteDescriptorSet, 1> writeDescriptorSets = {};
-	
 	// Binding 0 : Vertex shader uniform buffer
 	writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	writeDescriptorSet[0].dstSet = state.descriptorSets.offscreen;
-	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	writeDescriptorSet[0].dstBinding = 0;
 	writeDescriptorSet[0].pBufferInfo = &state.uniformBufferVS[2].descriptor;
 	writeDescriptorSet[0].descriptorCount = 1;
 
-	vkUpdateDescriptorSets(context.device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, NULL);
+	vkUpdateDescriptorSets(context.device, 1, writeDescriptorSet.data(), 0, NULL);
 
 	// 3D scene
 	res = (vkAllocateDescriptorSets(context.device, &allocInfo, &state.descriptorSets.scene));
 
 	// Image descriptor for the shadow map attachment
 	texDescriptor.sampler = state.offscreenPass.depthSampler;
-	texDescriptor.imageView = state.offscreenPass.depth.view;
+	texDescriptor.imageView = state.graph.images[state.shadowMap].view;
 
-	std::array<VkWriteDescriptorSet, 2> writeDescriptorSetss = {};
 		// Binding 0 : Vertex shader uniform buffer
 	writeDescriptorSet[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	writeDescriptorSet[0].dstSet = state.descriptorSets.scene;
-	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	writeDescriptorSet[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	writeDescriptorSet[0].dstBinding = 0;
 	writeDescriptorSet[0].pBufferInfo = &state.uniformBufferVS[0].descriptor;
 	writeDescriptorSet[0].descriptorCount = 1;
@@ -519,187 +410,256 @@ void setupDescriptorSet(struct LHContext& context, struct appState& state) {
 	writeDescriptorSet[1].dstBinding = 1;
 	writeDescriptorSet[1].pImageInfo = &texDescriptor;;
 	writeDescriptorSet[1].descriptorCount = 1;
-	vkUpdateDescriptorSets(context.device, writeDescriptorSetss.size(), writeDescriptorSetss.data(), 0, NULL);
+	vkUpdateDescriptorSets(context.device, writeDescriptorSet.size(), writeDescriptorSet.data(), 0, NULL);
 }
 
-void preparePipelines(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
+// Pipelines of the lab, each one is built on its own so the shader reloader can rebuild it.
+// The scene's PCF variants are permutations of PIPELINE_SCENE
+enum ScenePipeline {
+	PIPELINE_QUAD,
+	PIPELINE_SCENE,
+	PIPELINE_OFFSCREEN
+};
 
-	VkGraphicsPipelineCreateInfo pipelineCreateInfo = {};
-	pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+// Fills in the pipeline without creating it, so it can be created now or handed to the pipeline compiler
+void describePipeline(struct LHContext& context, struct appState& state, ScenePipeline which, const std::vector<VkPipelineShaderStageCreateInfo>& stages,
+	LHGraphicsPipelineDesc& desc, VkPipelineCreateFlags flags = 0, VkPipeline basePipeline = VK_NULL_HANDLE) {
+	desc.info.flags = flags;
+	desc.info.basePipelineHandle = basePipeline;
+	desc.info.basePipelineIndex = -1;
 	// The layout used for this pipeline (can be shared among multiple pipelines using the same layout)
-	pipelineCreateInfo.layout = state.pipelineLayout;
+	desc.info.layout = state.pipelineLayout;
 	// Renderpass this pipeline is attached to
-	pipelineCreateInfo.renderPass = context.render_pass;
+	desc.info.renderPass = state.graph.passes[state.scenePass].renderPass;
 
 	// Construct the differnent states making up the pipeline
 
 	// Input assembly state describes how primitives are assembled
 	// This pipeline will assemble vertex data as a triangle lists
-	VkPipelineInputAssemblyStateCreateInfo inputAssemblyState = {};
-	inputAssemblyState.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	desc.inputAssemblyState.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 
 	// Rasterization state
-	VkPipelineRasterizationStateCreateInfo rasterizationState = {};
-	rasterizationState.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-	rasterizationState.polygonMode = VK_POLYGON_MODE_FILL;
-	rasterizationState.cullMode = VK_CULL_MODE_NONE;
-	rasterizationState.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-	rasterizationState.depthClampEnable = VK_FALSE;
-	rasterizationState.rasterizerDiscardEnable = VK_FALSE;
-	rasterizationState.depthBiasEnable = VK_FALSE;
-	rasterizationState.lineWidth = 1.0f;
+	desc.rasterizationState.polygonMode = VK_POLYGON_MODE_FILL;
+	desc.rasterizationState.cullMode = VK_CULL_MODE_NONE;
+	desc.rasterizationState.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	desc.rasterizationState.depthClampEnable = VK_FALSE;
+	desc.rasterizationState.rasterizerDiscardEnable = VK_FALSE;
+	desc.rasterizationState.depthBiasEnable = VK_FALSE;
+	desc.rasterizationState.lineWidth = 1.0f;
 
 	// Color blend state describes how blend factors are calculated (if used)
 	// We need one blend attachment state per color attachment (even if blending is not used
-	VkPipelineColorBlendAttachmentState blendAttachmentState[1] = {};
-	blendAttachmentState[0].colorWriteMask = 0xf;
-	blendAttachmentState[0].blendEnable = VK_FALSE;
-	VkPipelineColorBlendStateCreateInfo colorBlendState = {};
-	colorBlendState.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-	colorBlendState.attachmentCount = 1;
-	colorBlendState.pAttachments = blendAttachmentState;
+	VkPipelineColorBlendAttachmentState blendAttachmentState = {};
+	blendAttachmentState.colorWriteMask = 0xf;
+	blendAttachmentState.blendEnable = VK_FALSE;
+	desc.blendAttachments = { blendAttachmentState };
 
 	// Viewport state sets the number of viewports and scissor used in this pipeline
 	// Note: This is actually overriden by the dynamic states (see below)
-	VkPipelineViewportStateCreateInfo viewportState = {};
-	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-	viewportState.viewportCount = 1;
-	viewportState.scissorCount = 1;
+	desc.viewportState.viewportCount = 1;
+	desc.viewportState.scissorCount = 1;
 
 	// Enable dynamic states
 	// Most states are baked into the pipeline, but there are still a few dynamic states that can be changed within a command buffer
 	// To be able to change these we need do specify which dynamic states will be changed using this pipeline. Their actual states are set later on in the command buffer.
 	// For this example we will set the viewport and scissor using dynamic states
-	std::vector<VkDynamicState> dynamicStateEnables;
-	dynamicStateEnables.push_back(VK_DYNAMIC_STATE_VIEWPORT);
-	dynamicStateEnables.push_back(VK_DYNAMIC_STATE_SCISSOR);
-	VkPipelineDynamicStateCreateInfo dynamicState = {};
-	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-	dynamicState.pDynamicStates = dynamicStateEnables.data();
-	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStateEnables.size());
+	desc.dynamicStates.push_back(VK_DYNAMIC_STATE_VIEWPORT);
+	desc.dynamicStates.push_back(VK_DYNAMIC_STATE_SCISSOR);
 
 	// Depth and stencil state containing depth and stencil compare and test operations
 	// We only use depth tests and want depth tests and writes to be enabled and compare with less or equal
-	VkPipelineDepthStencilStateCreateInfo depthStencilState = {};
-	depthStencilState.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-	depthStencilState.depthTestEnable = VK_TRUE;
-	depthStencilState.depthWriteEnable = VK_TRUE;
-	depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-	depthStencilState.depthBoundsTestEnable = VK_FALSE;
-	depthStencilState.back.failOp = VK_STENCIL_OP_KEEP;
-	depthStencilState.back.passOp = VK_STENCIL_OP_KEEP;
-	depthStencilState.back.compareOp = VK_COMPARE_OP_ALWAYS;
-	depthStencilState.stencilTestEnable = VK_FALSE;
-	depthStencilState.front = depthStencilState.back;
+	desc.depthStencilState.depthTestEnable = VK_TRUE;
+	desc.depthStencilState.depthWriteEnable = VK_TRUE;
+	desc.depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	desc.depthStencilState.depthBoundsTestEnable = VK_FALSE;
+	desc.depthStencilState.back.failOp = VK_STENCIL_OP_KEEP;
+	desc.depthStencilState.back.passOp = VK_STENCIL_OP_KEEP;
+	desc.depthStencilState.back.compareOp = VK_COMPARE_OP_ALWAYS;
+	desc.depthStencilState.stencilTestEnable = VK_FALSE;
+	desc.depthStencilState.front = desc.depthStencilState.back;
 
 	// Multi sampling state
 	// This example does not make use fo multi sampling (for anti-aliasing), the state must still be set and passed to the pipeline
-	VkPipelineMultisampleStateCreateInfo multisampleState = {};
-	multisampleState.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-	multisampleState.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-	multisampleState.pSampleMask = nullptr;
+	desc.multisampleState.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	desc.multisampleState.pSampleMask = nullptr;
+
+	// Vertex input state used for pipeline creation, the attributes are whatever the vertex shader reads
+	// out of the interleaved vertices (the quad generates its own and reads none)
+	VkVertexInputBindingDescription vertexInputBinding = {};
+	if (reflectVertexInput(context, stages[0], desc.vertexAttributes, vertexInputBinding, state.vertexStride) > 0) {
+		desc.vertexBindings = { vertexInputBinding };
+	}
 
+	// Set pipeline shader stage info
+	desc.stages = stages;
+
+	switch (which) {
+	case PIPELINE_QUAD:
+		//Takes care of the QUAD
+		desc.rasterizationState.cullMode = VK_CULL_MODE_NONE;
+		break;
+	case PIPELINE_SCENE:
+		// No filtering or PCF filtering comes with the stages' specialization info
+		desc.rasterizationState.cullMode = VK_CULL_MODE_BACK_BIT;
+		break;
+	case PIPELINE_OFFSCREEN:
+		// Offscreen pipeline (vertex shader only)
+		desc.rasterizationState.cullMode = VK_CULL_MODE_BACK_BIT;
+		// No blend attachment states (no color attachments used)
+		desc.blendAttachments.clear();
+		// Cull front faces
+		desc.depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+		// Enable depth bias
+		desc.rasterizationState.depthBiasEnable = VK_TRUE;
+		// Add depth bias to dynamic state, so we can change it at runtime
+		desc.dynamicStates.push_back(VK_DYNAMIC_STATE_DEPTH_BIAS);
+
+		desc.info.layout = state.pipelineLayouts.offscreen;
+		desc.info.renderPass = state.graph.passes[state.shadowPass].renderPass;
+		break;
+	}
+}
 
-	// Vertex input state used for pipeline creation
-	VkPipelineVertexInputStateCreateInfo vertexInputState = {};
-	vertexInputState.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputState.vertexBindingDescriptionCount = 1;
-	vertexInputState.pVertexBindingDescriptions = &state.vertexInputBinding[0];
-	vertexInputState.vertexAttributeDescriptionCount = 3;
-	vertexInputState.pVertexAttributeDescriptions = state.vertexInputAttributs.data();
+VkPipeline createPipeline(struct LHContext& context, struct appState& state, ScenePipeline which, const std::vector<VkPipelineShaderStageCreateInfo>& stages,
+	VkPipelineCreateFlags flags = 0, VkPipeline basePipeline = VK_NULL_HANDLE) {
+	VkResult U_ASSERT_ONLY res;
 
-	// Set pipeline shader stage info
-	pipelineCreateInfo.stageCount = static_cast<uint32_t>(state.shaderStages.size());
-	pipelineCreateInfo.pStages = state.shaderStages.data();
-
-	// Assign the pipeline states to the pipeline creation info structure
-	pipelineCreateInfo.pVertexInputState = &vertexInputState;
-	pipelineCreateInfo.pInputAssemblyState = &inputAssemblyState;
-	pipelineCreateInfo.pRasterizationState = &rasterizationState;
-	pipelineCreateInfo.pColorBlendState = &colorBlendState;
-	pipelineCreateInfo.pMultisampleState = &multisampleState;
-	pipelineCreateInfo.pViewportState = &viewportState;
-	pipelineCreateInfo.pDepthStencilState = &depthStencilState;
-	pipelineCreateInfo.renderPass = context.render_pass;
-	pipelineCreateInfo.pDynamicState = &dynamicState;
-
-	//Takes care of the QUAD
-	rasterizationState.cullMode = VK_CULL_MODE_NONE;
-	// Vertex shader
-	createShaderStage(context, "./shaders/shaderquad.vert", VK_SHADER_STAGE_VERTEX_BIT, state.shaderStages[0]);
-	assert(state.shaderStages[0].module != VK_NULL_HANDLE);
-
-	// Fragment shader
-	createShaderStage(context, "./shaders/shaderquad.frag", VK_SHADER_STAGE_FRAGMENT_BIT, state.shaderStages[1]);
-	assert(state.shaderStages[1].module != VK_NULL_HANDLE);
-
-	VkPipelineVertexInputStateCreateInfo emptyInputState = {};
-	emptyInputState.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	pipelineCreateInfo.pVertexInputState = &emptyInputState;
+	LHGraphicsPipelineDesc desc;
+	describePipeline(context, state, which, stages, desc, flags, basePipeline);
 
 	// Create rendering pipeline using the specified states
-	res = (vkCreateGraphicsPipelines(context.device, context.pipelineCache, 1, &pipelineCreateInfo, nullptr, &state.pipelines.quad));
+	VkPipeline pipeline;
+	res = (vkCreateGraphicsPipelines(context.device, context.pipelineCache, 1, &pipelineDescCreateInfo(desc), nullptr, &pipeline));
 	assert(res == VK_SUCCESS);
+	return pipeline;
+}
 
-	pipelineCreateInfo.pVertexInputState = &vertexInputState;
-	rasterizationState.cullMode = VK_CULL_MODE_BACK_BIT;
-
-	// Vertex shader
-	createShaderStage(context, "./shaders/shader.vert", VK_SHADER_STAGE_VERTEX_BIT, state.shaderStages[0]);
-	assert(state.shaderStages[0].module != VK_NULL_HANDLE);
-
-	// Fragment shader
-	createShaderStage(context, "./shaders/shader.frag", VK_SHADER_STAGE_FRAGMENT_BIT, state.shaderStages[1]);
-	assert(state.shaderStages[1].module != VK_NULL_HANDLE);
-
-	uint32_t enablePCF = 0;
-	VkSpecializationMapEntry specializationMapEntry = {};
-	specializationMapEntry.constantID = 0;
-	specializationMapEntry.offset = 0;
-	specializationMapEntry.size = sizeof(uint32_t);
-	VkSpecializationInfo specializationInfo = {};
-	specializationInfo.mapEntryCount = 1;
-	specializationInfo.pMapEntries = &specializationMapEntry;
-	specializationInfo.dataSize = sizeof(uint32_t);
-	specializationInfo.pData = &enablePCF;
-	state.shaderStages[1].pSpecializationInfo = &specializationInfo;
-	// No filtering
-	res = (vkCreateGraphicsPipelines(context.device, context.pipelineCache, 1, &pipelineCreateInfo, nullptr, &state.pipelines.sceneShadow));
-	assert(res == VK_SUCCESS);
-	// PCF filtering
-	enablePCF = 1;
-	res = (vkCreateGraphicsPipelines(context.device, context.pipelineCache, 1, &pipelineCreateInfo, nullptr, &state.pipelines.sceneShadowPCF));
-	assert(res == VK_SUCCESS);
+void prepareShaders(struct LHContext& context, struct appState& state) {
+	// Every stage the pipelines below need
+	state.shaderSources = {
+		{ "./shaders/shaderquad.vert", VK_SHADER_STAGE_VERTEX_BIT },
+		{ "./shaders/shaderquad.frag", VK_SHADER_STAGE_FRAGMENT_BIT },
+		{ "./shaders/shader.vert", VK_SHADER_STAGE_VERTEX_BIT },
+		{ "./shaders/shader.frag", VK_SHADER_STAGE_FRAGMENT_BIT },
+		{ "./shaders/shaderOffscree.vert", VK_SHADER_STAGE_VERTEX_BIT } };
+#if BUILD_TIME_SHADERS
+	state.stages.resize(5);
+	createShaderStage(context, shaderquad_vert, VK_SHADER_STAGE_VERTEX_BIT, state.stages[0]);
+	createShaderStage(context, shaderquad_frag, VK_SHADER_STAGE_FRAGMENT_BIT, state.stages[1]);
+	createShaderStage(context, shader_vert, VK_SHADER_STAGE_VERTEX_BIT, state.stages[2]);
+	createShaderStage(context, shader_frag, VK_SHADER_STAGE_FRAGMENT_BIT, state.stages[3]);
+	createShaderStage(context, shaderOffscree_vert, VK_SHADER_STAGE_VERTEX_BIT, state.stages[4]);
+#else
+	// Compiled concurrently
+	state.stages = createShaderStages(context, state.shaderSources);
+#endif
+	for (auto& stage : state.stages) {
+		assert(stage.module != VK_NULL_HANDLE);
+	}
+}
 
-	// Offscreen pipeline (vertex shader only)
-	createShaderStage(context, "./shaders/shaderOffscree.vert", VK_SHADER_STAGE_VERTEX_BIT, state.shaderStages[0]);
-	assert(state.shaderStages[0].module != VK_NULL_HANDLE);
-	pipelineCreateInfo.stageCount = 1;
-	// No blend attachment states (no color attachments used)
-	colorBlendState.attachmentCount = 0;
-	// Cull front faces
-	depthStencilState.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
-	// Enable depth bias
-	rasterizationState.depthBiasEnable = VK_TRUE;
-	// Add depth bias to dynamic state, so we can change it at runtime
-	dynamicStateEnables.push_back(VK_DYNAMIC_STATE_DEPTH_BIAS);
-	dynamicState = {};
-	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-	dynamicState.pDynamicStates = dynamicStateEnables.data();
-	dynamicState.dynamicStateCount = dynamicStateEnables.size();
-	dynamicState.flags = 0;
-
-	pipelineCreateInfo.layout = state.pipelineLayouts.offscreen;
-	pipelineCreateInfo.renderPass = state.offscreenPass.renderPass;
-	res = (vkCreateGraphicsPipelines(context.device, context.pipelineCache, 1, &pipelineCreateInfo, nullptr, &state.pipelines.offscreen));
-	assert(res == VK_SUCCESS);
+// Rebuilds one of the pipelines above from edited shaders
+LHPipelineBuild rebuildPipeline(struct LHContext& context, struct appState& state, ScenePipeline which) {
+	return [&context, &state, which](const std::vector<VkPipelineShaderStageCreateInfo>& stages) {
+		return createPipeline(context, state, which, stages);
+	};
+}
+
+// Hands every pipeline to the pipeline compiler, collectPipelines() puts them in place as they finish
+void preparePipelines(struct LHContext& context, struct appState& state) {
+	const std::vector<VkPipelineShaderStageCreateInfo>& stages = state.stages;
+
+	// Quad and offscreen pipelines are independent, the compiler spreads the batch over its threads
+	std::vector<LHGraphicsPipelineDesc> descs(2);
+	describePipeline(context, state, PIPELINE_QUAD, { stages[0], stages[1] }, descs[0]);
+	describePipeline(context, state, PIPELINE_OFFSCREEN, { stages[4] }, descs[1]);
+	std::vector<std::shared_future<VkPipeline>> pipelines = compilePipelines(context, descs);
+	state.pending.quad = pipelines[0];
+	state.pending.offscreen = pipelines[1];
+
+	// The shader reads enablePCF as constant_id 0, both variants are built now rather than on the first toggle.
+	// With pipeline libraries a variant only compiles its fragment shader part and links the parts it shares
+	createPipelinePermutations(context, state.scenePermutations, { stages[2], stages[3] }, { 0 },
+		[&context, &state](const std::vector<VkPipelineShaderStageCreateInfo>& stages, VkPipelineCreateFlags flags, VkPipeline basePipeline) {
+			if (!context.pipelineLibrary) {
+				return createPipeline(context, state, PIPELINE_SCENE, stages, flags, basePipeline);
+			}
+			LHGraphicsPipelineDesc desc;
+			describePipeline(context, state, PIPELINE_SCENE, stages, desc, flags, basePipeline);
+			return linkPipeline(context, desc);
+		});
+	for (uint32_t enablePCF = 0; enablePCF < 2; enablePCF++) {
+		state.pending.scene[enablePCF] = compilePipeline(context, [&context, &state, enablePCF]() {
+			return getPipelinePermutation(context, state.scenePermutations, { enablePCF });
+		});
+	}
+
+#if SHADER_HOT_RELOAD
+	// Saving a file under shaders/ rebuilds the pipelines that use it, the reloader keeps the modules from here on
+	createShaderReloader(context, "./shaders");
+#endif
+}
+
+// Called between frames. Rendering starts with whatever pipelines are ready, draws whose pipeline is
+// still compiling are skipped until it is put in place here
+bool collectPipelines(struct LHContext& context, struct appState& state) {
+	const std::vector<LHShaderSource>& sources = state.shaderSources;
+	const std::vector<VkPipelineShaderStageCreateInfo>& stages = state.stages;
+	bool collected = false;
+	auto take = [&collected](std::shared_future<VkPipeline>& pending, VkPipeline& pipeline) {
+		if (!pending.valid() || !pipelineReady(pending)) {
+			return false;
+		}
+		pipeline = pending.get();
+		pending = std::shared_future<VkPipeline>();
+		collected = true;
+		return true;
+	};
+
+	if (take(state.pending.quad, state.pipelines.quad) && SHADER_HOT_RELOAD) {
+		watchPipeline(context, state.pipelines.quad, { sources[0], sources[1] }, { stages[0], stages[1] }, rebuildPipeline(context, state, PIPELINE_QUAD));
+	}
+	if (take(state.pending.offscreen, state.pipelines.offscreen) && SHADER_HOT_RELOAD) {
+		watchPipeline(context, state.pipelines.offscreen, { sources[4] }, { stages[4] }, rebuildPipeline(context, state, PIPELINE_OFFSCREEN));
+	}
+	// The permutation set keeps the scene pipelines, they are only drawn once both are there
+	VkPipeline scene[2] = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+	take(state.pending.scene[0], scene[0]);
+	take(state.pending.scene[1], scene[1]);
+	if (!state.sceneReady && !state.pending.scene[0].valid() && !state.pending.scene[1].valid()) {
+		state.sceneReady = true;
+		for (uint32_t enablePCF = 0; enablePCF < 2 && SHADER_HOT_RELOAD; enablePCF++) {
+			watchPipeline(context, getPipelinePermutation(context, state.scenePermutations, { enablePCF }), { sources[2], sources[3] }, { stages[2], stages[3] },
+				[&context, &state, enablePCF](const std::vector<VkPipelineShaderStageCreateInfo>& stages) {
+					return buildPipelinePermutation(context, state.scenePermutations, { enablePCF }, stages);
+				});
+		}
+		if (SHADER_HOT_RELOAD) {
+			// Keys not built yet follow the reloaded scene shaders
+			watchPipelinePermutations(context, state.scenePermutations);
+		}
+	}
+
+	// Scene pipelines linked from libraries give way to their optimized relinks
+	if (state.sceneReady && context.pipelineLibrary) {
+		std::lock_guard<std::mutex> lock(state.scenePermutations.mutex);
+		for (auto& permutation : state.scenePermutations.pipelines) {
+			collected = upgradeLinkedPipeline(context, permutation.second) || collected;
+		}
+	}
+
+	bool done = !state.pending.quad.valid() && !state.pending.offscreen.valid() && state.sceneReady;
+	if (collected && done && !SHADER_HOT_RELOAD) {
+		// The pipelines no longer need the modules
+		for (auto& stage : state.stages) {
+			vkDestroyShaderModule(context.device, stage.module, nullptr);
+		}
+		state.stages.clear();
+	}
+	return collected;
 }
 
 void updateUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-	uint8_t* pData;
 	//setup Light Pos
 	state.lighPos = glm::vec3(1.0, 0.0, 0.5);
 
@@ -710,12 +670,8 @@ void updateUniformBuffers(struct LHContext& context, struct appState& state) {
 
 	state.uboOffscreenVS.depthMVP = depthProjectionMatrix * depthViewMatrix * depthModelMatrix;
 
-	// Map uniform buffer and update it
-	res = (vkMapMemory(context.device, state.uniformBufferVS[2].memory, 0, sizeof(state.uboOffscreenVS), 0, (void**)&pData));
-	memcpy(pData, &state.uboOffscreenVS, sizeof(state.uboOffscreenVS));
-	// Unmap after data has been copied
-	// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-	vkUnmapMemory(context.device, state.uniformBufferVS[2].memory);
+	// Write into the current frame's slice, the ring stays mapped and is host coherent so no map/unmap or flush is needed
+	memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, state.uniformBufferVS[2].slice), &state.uboOffscreenVS, sizeof(state.uboOffscreenVS));
 
 	float AR = (float)context.height / (float)context.width;
 
@@ -734,65 +690,31 @@ void updateUniformBuffers(struct LHContext& context, struct appState& state) {
 	state.uboVSscene.depthBiasMVP = state.uboOffscreenVS.depthMVP;
 
 
-	// Map uniform buffer and update it
-	res = (vkMapMemory(context.device, state.uniformBufferVS[0].memory, 0, sizeof(state.uboVSscene), 0, (void**)&pData));
-	memcpy(pData, &state.uboVSscene, sizeof(state.uboVSscene));
-	// Unmap after data has been copied
-	// Note: Since we requested a host coherent memory type for the uniform buffer, the write is instantly visible to the GPU
-	vkUnmapMemory(context.device, state.uniformBufferVS[0].memory);
+	memcpy(uniformRingSlice(state.uniformRing, context.currentBuffer, state.uniformBufferVS[0].slice), &state.uboVSscene, sizeof(state.uboVSscene));
 
 }
 
 void prepareUniformBuffers(struct LHContext& context, struct appState& state) {
-	VkResult U_ASSERT_ONLY res;
-	bool U_ASSERT_ONLY pass;
 	// Prepare and initialize a uniform buffer block containing shader uniforms
 	// Single uniforms like in OpenGL are no longer present in Vulkan. All Shader uniforms are passed via uniform buffer blocks
-	VkMemoryRequirements memReqs;
-
-	// Vertex shader uniform buffer block
-	VkBufferCreateInfo bufferInfo = {};
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.pNext = nullptr;
-	allocInfo.allocationSize = 0;
-	allocInfo.memoryTypeIndex = 0;
 
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = sizeof(state.uboVSscene);
-	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-
-	bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		state.uniformBufferVS[0].buffer, state.uniformBufferVS[0].memory);
+	// Scene, quad and offscreen uniform buffer blocks, one aligned slice each per frame in flight
+	state.uniformBufferVS[0].slice = reserveUniformSlice(context, state.uniformRing, sizeof(state.uboVSscene));
+	state.uniformBufferVS[1].slice = reserveUniformSlice(context, state.uniformRing, sizeof(state.uboVSquad));
+	state.uniformBufferVS[2].slice = reserveUniformSlice(context, state.uniformRing, sizeof(state.uboOffscreenVS));
+	createUniformRing(context, state.uniformRing, context.swapchainImageCount);
 
 	// Store information in the uniform's descriptor that is used by the descriptor set
-	state.uniformBufferVS[0].descriptor.buffer = state.uniformBufferVS[0].buffer;
+	// The offsets stay 0, the frame region is selected with dynamic offsets when binding
+	state.uniformBufferVS[0].descriptor.buffer = state.uniformRing.buffer;
 	state.uniformBufferVS[0].descriptor.offset = 0;
 	state.uniformBufferVS[0].descriptor.range = sizeof(state.uboVSscene);
 
-	bufferInfo = {};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = sizeof(state.uboVSquad);
-	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-
-	bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		state.uniformBufferVS[1].buffer, state.uniformBufferVS[1].memory);
-
-	// Store information in the uniform's descriptor that is used by the descriptor set
-	state.uniformBufferVS[1].descriptor.buffer = state.uniformBufferVS[1].buffer;
+	state.uniformBufferVS[1].descriptor.buffer = state.uniformRing.buffer;
 	state.uniformBufferVS[1].descriptor.offset = 0;
 	state.uniformBufferVS[1].descriptor.range = sizeof(state.uboVSquad);
 
-	bufferInfo = {};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = sizeof(state.uboOffscreenVS);
-	bufferInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-
-	bindBufferToMem(context, bufferInfo, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		state.uniformBufferVS[2].buffer, state.uniformBufferVS[2].memory);
-
-	// Store information in the uniform's descriptor that is used by the descriptor set
-	state.uniformBufferVS[2].descriptor.buffer = state.uniformBufferVS[2].buffer;
+	state.uniformBufferVS[2].descriptor.buffer = state.uniformRing.buffer;
 	state.uniformBufferVS[2].descriptor.offset = 0;
 	state.uniformBufferVS[2].descriptor.range = sizeof(state.uboOffscreenVS);
 
@@ -800,6 +722,23 @@ void prepareUniformBuffers(struct LHContext& context, struct appState& state) {
 }
 
 
+// The uniform ring gets a new buffer when the swap chain comes back with a different number of images.
+// Binding 0 of the quad, offscreen and scene sets holds a block of the ring
+void rebindUniformRing(struct LHContext& context, struct appState& state) {
+	VkDescriptorSet sets[3] = { state.descriptorSets.scene, state.descriptorSet, state.descriptorSets.offscreen };
+	std::array<VkWriteDescriptorSet, 3> writeDescriptorSet = {};
+	for (uint32_t i = 0; i < writeDescriptorSet.size(); i++) {
+		state.uniformBufferVS[i].descriptor.buffer = state.uniformRing.buffer;
+		writeDescriptorSet[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		writeDescriptorSet[i].dstSet = sets[i];
+		writeDescriptorSet[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+		writeDescriptorSet[i].dstBinding = 0;
+		writeDescriptorSet[i].pBufferInfo = &state.uniformBufferVS[i].descriptor;
+		writeDescriptorSet[i].descriptorCount = 1;
+	}
+	vkUpdateDescriptorSets(context.device, static_cast<uint32_t>(writeDescriptorSet.size()), writeDescriptorSet.data(), 0, NULL);
+}
+
 #ifdef OBJ_MESH
 void prepareVertices(struct LHContext& context, struct appState& state, std::string filepath,int index,bool useStagingBuffers) {
 	VkResult U_ASSERT_ONLY res;
@@ -881,38 +820,11 @@ void prepareVertices(struct LHContext& context, struct appState& state, std::str
 
 	state.i[index].count = ni;
 
-	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.i[index].buffer, state.i[index].memory);
-	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v[index].buffer, state.v[index].memory);
-
-	//// Vertex input descriptions 
-	//// Specifies the vertex input parameters for a pipeline
-
-	//// Vertex input binding
-	//// This example uses a single vertex input binding at binding point 0 (see vkCmdBindVertexBuffers)
-
-	state.vertexInputBinding[0].binding = 0;
-	state.vertexInputBinding[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-	state.vertexInputBinding[0].stride = dataStride;
-
-
-	// Inpute attribute bindings describe shader attribute locations and memory layouts
-	// These match the following shader layout
-	//	layout (location = 0) in vec3 inPos;
-	//	layout (location = 1) in vec3 inNormal;
-	// Attribute location 0: Position
-	//// Attribute location 1: Normal
-	state.vertexInputAttributs[0].binding = 0;
-	state.vertexInputAttributs[0].location = 0;
-	state.vertexInputAttributs[0].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-	state.vertexInputAttributs[0].offset = 0;
-	state.vertexInputAttributs[1].binding = 0;
-	state.vertexInputAttributs[1].location = 1;
-	state.vertexInputAttributs[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-	state.vertexInputAttributs[1].offset = sizeof(float);
-	state.vertexInputAttributs[2].binding = 0;
-	state.vertexInputAttributs[2].location = 2;
-	state.vertexInputAttributs[2].format = VK_FORMAT_R32G32B32_SFLOAT;
-	state.vertexInputAttributs[2].offset = 2*sizeof(float);
+	mapIndiciesToGPU(context, indices, sizeof(indices[0]) * ni, state.i[index].buffer, state.i[index].memory, useStagingBuffers);
+	mapVerticiesToGPU(context, state.vBuffer, dataSize, state.v[index].buffer, state.v[index].memory, useStagingBuffers);
+
+	// Position, normal and uv interleaved, the attribute layout is reflected from the vertex shaders
+	state.vertexStride = dataStride;
 
 }
 #endif // OBJ_MESH
@@ -920,14 +832,47 @@ void prepareVertices(struct LHContext& context, struct appState& state, std::str
 void renderLoop(struct LHContext& context, struct appState& state) {
 
 	while (!glfwWindowShouldClose(context.window)) {
-		glfwPollEvents();
-		draw(context);
+		waitForEvents(context);
 		if (update) {
-			updateUniformBuffers(context, state);
+			markUniformRingDirty(state.uniformRing);
+			markFrameDirty(context);
 			update = false;
 		}
+		// Pipelines finished by the compiler and pipelines rebuilt from edited shaders are swapped in here, between frames
+		if (collectPipelines(context, state)) {
+			rebuild = true;
+		}
+		if (applyShaderReloads(context)) {
+			rebuild = true;
+		}
+		if (rebuild) {
+			// The static command buffers bake the pipeline in, so all of them have to be recorded again
+			if (!recordPerFrame) {
+				vkDeviceWaitIdle(context.device);
+				buildCommandBuffers(context, state);
+			}
+			rebuild = false;
+			markFrameDirty(context);
+		}
+		// Nothing changed since the last presented image, keep sleeping
+		if (!frameNeeded(context)) {
+			continue;
+		}
+		acquireFrame(context);
+		// Each ring region is rewritten once its previous frame has finished, never while the GPU reads it
+		if (uniformRingStale(state.uniformRing, context.currentBuffer)) {
+			updateUniformBuffers(context, state);
+		}
+		if (recordPerFrame) {
+			submitFrame(context, recordFrame(context, state));
+		}
+		else {
+			submitFrame(context);
+		}
 	}
 
+	printFrameStats(context);
+
 	// Flush device to make sure all resources can be freed
 	if (context.device != VK_NULL_HANDLE) {
 		vkDeviceWaitIdle(context.device);
@@ -954,6 +899,15 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 		theta -= 0.1;
 		update = true;
 	}
+	if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+		filterPCF = !filterPCF;
+		rebuild = true;
+	}
+	if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+		recordPerFrame = !recordPerFrame;
+		rebuild = true;
+		std::cout << (recordPerFrame ? "Recording every frame" : "Replaying static command buffers") << std::endl;
+	}
 
 	eyex = (float)(r * sin(theta) * cos(phi));
 	eyey = (float)(r * sin(theta) * sin(phi));
@@ -983,26 +937,49 @@ int main() {
 	createSwapChain(context);
 	createCommandBuffer(context);
 	createSynchPrimitive(context);
-	createDepthBuffers(context);
-	createRenderPass(context);
 	createPipeLineCache(context);
-	createFrameBuffer(context);
+	createPipelineCompiler(context);
 	prepareSynchronizationPrimitives(context);
+	createRecordThreads(context);
 
 	//---> Implement our own functions
-	prepareShadowFramebuffer(context, state);
+	prepareShadowSampler(context, state);
+	prepareRenderGraph(context, state);
 	prepareVertices(context, state, "angryteapot.obj",0,false);
 	prepareVertices(context, state, "plane.obj",1,false);
 	prepareUniformBuffers(context, state);
+	// GLSL compiled here (and by the shader reloader) goes through the optimizer, the PCF shader benefits most
+	context.shaderOptimization = LH_SPIRV_OPTIMIZE_PERFORMANCE;
+	prepareShaders(context, state);
 	setupDescriptorSetLayout(context, state);
-	preparePipelines(context, state);
+	// Measures handing the pipelines to the compiler, which reports on its own once they are all created
+	timePipelineCreation(context, [&]() { preparePipelines(context, state); });
+	printShaderCacheStats(context);
 	setupDescriptorPool(context, state);
 	setupDescriptorSet(context, state);
 	buildCommandBuffers(context, state);
 
 	glfwSetKeyCallback(context.window, key_callback);
+	// Only redraw when the view changes
+	context.renderOnDemand = true;
+	// The new frame buffers need new command buffers, and the projection follows the aspect ratio
+	context.onSwapChainRecreated = [&]() {
+		if (resizeUniformRing(context, state.uniformRing, context.swapchainImageCount)) {
+			rebindUniformRing(context, state);
+		}
+		resizeRenderGraph(context, state.graph);
+		buildCommandBuffers(context, state);
+		markUniformRingDirty(state.uniformRing);
+	};
 
 	renderLoop(context, state);
+	destroyShaderReloader(context);
+	destroyPipelineCompiler(context);
+	destroyPipelinePermutations(context, state.scenePermutations);
+	destroyPipelineRegistry(context);
+	destroyPipelineLibraries(context);
+	savePipelineCache(context);
+	destroyLayoutCache(context);
 
 	return 0;
 }
\ No newline at end of file